@@ -0,0 +1,350 @@
+#include <algorithm>
+#include <string>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+
+#include "admission.h"
+#include "handshake.h"
+#include "governor.h"
+
+using namespace std;
+using namespace rpc;
+
+pthread_mutex_t Admission::m = PTHREAD_MUTEX_INITIALIZER;
+map<string, SourceAccount*> Admission::sources;
+list<SourceAccount*> Admission::idle;
+i64 Admission::last_sweep_us = 0;
+int Admission::n_conns = 0;
+TokenBucket Admission::rate;
+
+volatile i64 Admission::n_admitted = 0;
+volatile i64 Admission::n_rejected[Admission::n_reasons];
+volatile i64 Admission::n_auth_failures = 0;
+volatile i64 Admission::n_auth_delayed = 0;
+volatile i64 Admission::n_auth_rejected = 0;
+volatile i64 Admission::n_bans = 0;
+volatile i64 Admission::n_evicted = 0;
+
+int Admission::max_handshakes = 4096;
+int Admission::max_conns = 0;
+int Admission::max_source_conns = 0;
+double Admission::conn_rate = 0;
+double Admission::conn_burst = 0;
+double Admission::source_rate = 0;
+double Admission::source_burst = 0;
+int Admission::auth_delay_ms = 200;
+int Admission::auth_max_delay_ms = 5000;
+int Admission::ban_after = 10;
+int Admission::ban_s = 600;
+int Admission::max_sources = 65536;
+
+static const char* reason_names[Admission::n_reasons] = { "handshake backlog", "handshake queue", "relay memory",
+        "connections", "connections per source", "connection rate", "source connection rate", "banned" };
+
+// what rejected clients are told
+static const char* reason_texts[Admission::n_reasons] = { "server busy, try again later",
+        "server busy, try again later", "server busy, try again later", "too many connections",
+        "too many connections from your address", "too many connection attempts, try again later",
+        "too many connection attempts, try again later", "too many failed logins, try again later" };
+
+// idle sources are forgotten this often, once their rate bucket is full and
+// their failed logins are old
+static const i64 sweep_interval_us = 1000 * 1000;
+
+// idle sources looked at for one to forget, when there are max_sources
+static const int max_evict_scan = 64;
+
+// the wait between logins of a source that failed n_failures times in a row
+static i64 auth_delay_us(int n_failures) {
+    if (n_failures == 0 || Admission::auth_delay_ms <= 0) {
+        return 0;
+    }
+    i64 delay_ms = (i64) Admission::auth_delay_ms << min(n_failures - 1, 30);
+    return min(delay_ms, (i64) Admission::auth_max_delay_ms) * 1000;
+}
+
+// failed logins are forgotten after ban_s without any
+static void forget_failures(SourceAccount* source, i64 now_us) {
+    if (source->n_failures > 0 && now_us - source->last_failure_us > Admission::ban_s * 1000000LL) {
+        source->n_failures = 0;
+    }
+}
+
+void Admission::init() {
+    if (conn_rate > 0 && conn_burst <= 0) {
+        conn_burst = max(conn_rate, 1.0);
+    }
+    if (source_rate > 0 && source_burst <= 0) {
+        source_burst = max(source_rate, 1.0);
+    }
+    rate = TokenBucket(conn_rate, conn_burst);
+
+    if (max_conns == 0) {
+        // a session takes the client and server fds, and maybe a spill file
+        struct rlimit rl;
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur > 128) {
+            max_conns = (int) min((rl.rlim_cur - 64) / 3, (rlim_t) INT_MAX);
+        }
+    }
+    if (max_conns > 0) {
+        Log::info("admitting at most %d connections", max_conns);
+    }
+}
+
+// nothing left to remember about an idle source
+bool Admission::expired(SourceAccount* source, i64 now_us) {
+    forget_failures(source, now_us);
+    return source->n_failures == 0 && source->banned_until_us <= now_us && source->next_auth_us <= now_us
+            && source->rate.full(now_us);
+}
+
+void Admission::forget(SourceAccount* source) {
+    verify(source->n_conns == 0);
+    sources.erase(source->addr);
+    idle.erase(source->idle_pos);
+    delete source;
+}
+
+SourceAccount* Admission::evictable(i64 now_us) {
+    // banned sources are kept, or cycling through fresh addresses would lift
+    // their bans. Those found are moved to the back, to keep the search short
+    for (int i = 0; i < max_evict_scan && !idle.empty(); i++) {
+        SourceAccount* source = idle.front();
+        if (source->banned_until_us <= now_us) {
+            return source;
+        }
+        idle.splice(idle.end(), idle, source->idle_pos);
+    }
+    return NULL;
+}
+
+void Admission::sweep(i64 now_us) {
+    list<SourceAccount*>::iterator it = idle.begin();
+    while (it != idle.end()) {
+        SourceAccount* source = *it++;
+        if (expired(source, now_us)) {
+            forget(source);
+        }
+    }
+    last_sweep_us = now_us;
+}
+
+// the reason to reject a connection from source, or -1 to admit it
+int Admission::check(SourceAccount* source, ThreadPool* thpool, i64 now_us) {
+    if (source->banned_until_us > now_us) {
+        return BANNED;
+    }
+    if (max_handshakes > 0 && Handshake::active() >= max_handshakes) {
+        return HANDSHAKES;
+    }
+    // clients that get through their handshake now would find the queue full
+    if (thpool->pending() * 2 >= thpool->max_pending()) {
+        return QUEUE;
+    }
+    if (MemoryGovernor::is_throttling()) {
+        return MEMORY;
+    }
+    if (max_conns > 0 && n_conns >= max_conns) {
+        return CONNS;
+    }
+    if (max_source_conns > 0 && source->n_conns >= max_source_conns) {
+        return SOURCE_CONNS;
+    }
+    if (source_rate > 0 && !source->rate.take(1, now_us)) {
+        return SOURCE_RATE;
+    }
+    if (conn_rate > 0 && !rate.take(1, now_us)) {
+        return RATE;
+    }
+    return -1;
+}
+
+SourceAccount* Admission::admit(const struct sockaddr* addr, ThreadPool* thpool, const char** reason) {
+    char buf[INET6_ADDRSTRLEN];
+    const char* text = NULL;
+    if (addr->sa_family == AF_INET) {
+        text = inet_ntop(AF_INET, &((const sockaddr_in*) addr)->sin_addr, buf, sizeof(buf));
+    } else if (addr->sa_family == AF_INET6) {
+        text = inet_ntop(AF_INET6, &((const sockaddr_in6*) addr)->sin6_addr, buf, sizeof(buf));
+    }
+    string key = (text != NULL) ? text : "unknown";
+    i64 now_us = time_now_us();
+
+    Pthread_mutex_lock(&m);
+
+    if (now_us - last_sweep_us > sweep_interval_us) {
+        sweep(now_us);
+    }
+
+    SourceAccount* source;
+    map<string, SourceAccount*>::iterator it = sources.find(key);
+    if (it == sources.end()) {
+        if (max_sources > 0 && (int) sources.size() >= max_sources) {
+            SourceAccount* victim = evictable(now_us);
+            if (victim != NULL) {
+                forget(victim);
+                n_evicted++;
+            }
+        }
+        source = new SourceAccount(key, source_rate, source_burst);
+        sources[key] = source;
+        source->idle_pos = idle.insert(idle.end(), source);
+    } else {
+        source = it->second;
+        if (source->n_conns == 0) {
+            // most recently used
+            idle.splice(idle.end(), idle, source->idle_pos);
+        }
+    }
+
+    int rejected = check(source, thpool, now_us);
+    if (rejected < 0) {
+        if (source->n_conns == 0) {
+            idle.erase(source->idle_pos);
+        }
+        source->n_conns++;
+        n_conns++;
+    }
+
+    Pthread_mutex_unlock(&m);
+
+    if (rejected >= 0) {
+        __sync_add_and_fetch(&n_rejected[rejected], 1);
+        Log::info("rejecting client connection from %s: %s", key.c_str(), reason_names[rejected]);
+        *reason = reason_texts[rejected];
+        return NULL;
+    }
+    __sync_add_and_fetch(&n_admitted, 1);
+    *reason = NULL;
+    return source;
+}
+
+void Admission::leave(SourceAccount* source) {
+    if (source == NULL) {
+        return;
+    }
+    Pthread_mutex_lock(&m);
+    verify(source->n_conns > 0 && n_conns > 0);
+    source->n_conns--;
+    n_conns--;
+    if (source->n_conns == 0) {
+        // forgotten by a sweep once expired, or when room is needed
+        source->idle_pos = idle.insert(idle.end(), source);
+    }
+    Pthread_mutex_unlock(&m);
+}
+
+void Admission::reject(int fd, const char* reason) {
+    // version greeting, no security types, then why (RFB 3.8), all at once:
+    // the client reads the reason after sending its version
+    char buf[256];
+    int len = min((int) strlen(reason), (int) sizeof(buf) - 17);
+    memcpy(buf, "RFB 003.008\n", 12);
+    buf[12] = 0;
+    uint32_t be_len = htonl(len);
+    memcpy(buf + 13, &be_len, 4);
+    memcpy(buf + 17, reason, len);
+
+    // the socket buffer of a new connection takes this at once, if the
+    // client is still there at all
+    int n;
+    do {
+        n = send(fd, buf, 17 + len, MSG_DONTWAIT);
+    } while (n < 0 && errno == EINTR);
+    close(fd);
+}
+
+i64 Admission::auth_wait_us(SourceAccount* source, i64 deadline_us) {
+    if (source == NULL) {
+        return 0;
+    }
+    i64 now_us = time_now_us();
+    i64 wait_us;
+
+    Pthread_mutex_lock(&m);
+    if (source->banned_until_us > now_us) {
+        wait_us = -1;
+    } else {
+        forget_failures(source, now_us);
+        // logins of one source are checked one delay apart, even if sent at once
+        i64 start_us = max(now_us, source->next_auth_us);
+        if (start_us >= deadline_us) {
+            wait_us = -1;
+        } else {
+            source->next_auth_us = start_us + auth_delay_us(source->n_failures);
+            wait_us = start_us - now_us;
+        }
+    }
+    Pthread_mutex_unlock(&m);
+
+    if (wait_us < 0) {
+        __sync_add_and_fetch(&n_auth_rejected, 1);
+    } else if (wait_us > 0) {
+        __sync_add_and_fetch(&n_auth_delayed, 1);
+    }
+    return wait_us;
+}
+
+void Admission::auth_failed(SourceAccount* source) {
+    __sync_add_and_fetch(&n_auth_failures, 1);
+    if (source == NULL) {
+        return;
+    }
+    i64 now_us = time_now_us();
+    bool banned = false;
+
+    Pthread_mutex_lock(&m);
+    forget_failures(source, now_us);
+    source->n_failures++;
+    source->last_failure_us = now_us;
+    source->next_auth_us = max(source->next_auth_us, now_us + auth_delay_us(source->n_failures));
+    if (ban_after > 0 && source->n_failures >= ban_after && source->banned_until_us <= now_us) {
+        source->banned_until_us = now_us + ban_s * 1000000LL;
+        banned = true;
+    }
+    int n_failures = source->n_failures;
+    Pthread_mutex_unlock(&m);
+
+    if (banned) {
+        __sync_add_and_fetch(&n_bans, 1);
+        Log::warn("banning %s for %d seconds after %d failed logins", source->addr.c_str(), ban_s, n_failures);
+    }
+}
+
+void Admission::auth_passed(SourceAccount* source) {
+    if (source == NULL) {
+        return;
+    }
+    Pthread_mutex_lock(&m);
+    source->n_failures = 0;
+    // the delay a failure put on the next login goes too
+    source->next_auth_us = 0;
+    Pthread_mutex_unlock(&m);
+}
+
+void Admission::dump_stats() {
+    Pthread_mutex_lock(&m);
+    int conns = n_conns;
+    int n_sources = sources.size();
+    Pthread_mutex_unlock(&m);
+
+    string rejected;
+    for (int i = 0; i < n_reasons; i++) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%s%s %lld", i == 0 ? "" : ", ", reason_names[i], (long long) n_rejected[i]);
+        rejected += buf;
+    }
+    Log::info("admission: %d connections from %d sources tracked, %lld admitted", conns, n_sources,
+            (long long) n_admitted);
+    Log::info("connections rejected by reason: %s", rejected.c_str());
+    Log::info("logins: %lld failed, %lld delayed, %lld failed unchecked, %lld sources banned, %lld sources evicted",
+            (long long) n_auth_failures, (long long) n_auth_delayed, (long long) n_auth_rejected, (long long) n_bans,
+            (long long) n_evicted);
+}
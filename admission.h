@@ -0,0 +1,145 @@
+#pragma once
+
+#include <list>
+#include <map>
+#include <string>
+
+#include <sys/socket.h>
+
+#include "utils.h"
+
+/**
+ * Connections from one source address, how fast it opens new ones, and how
+ * often it failed to log in.
+ */
+struct SourceAccount {
+    std::string addr;
+    int n_conns;
+    rpc::TokenBucket rate;
+
+    // failed logins since the last good one, forgotten after ban_s without any
+    int n_failures;
+    rpc::i64 last_failure_us;
+    // the next login may not be checked before this
+    rpc::i64 next_auth_us;
+    rpc::i64 banned_until_us;
+
+    // place among sources without connections, least recently used first
+    std::list<SourceAccount*>::iterator idle_pos;
+
+    SourceAccount(const std::string& a, double rate, double burst)
+            : addr(a), n_conns(0), rate(rate, burst), n_failures(0), last_failure_us(0), next_auth_us(0),
+              banned_until_us(0) {
+    }
+};
+
+/**
+ * Decides on the accept thread whether a new connection is taken.
+ *
+ * A connection is turned away while the proxy is overloaded (max_handshakes
+ * handshakes waiting for their client, the handshake queue half full, or
+ * relay buffers being throttled), at max_conns connections in total or
+ * max_source_conns from its address, or when it comes faster than conn_rate
+ * per second overall or source_rate from its address (with bursts of
+ * conn_burst and source_burst). Rejected clients get an RFB failure reason
+ * and are closed right away, without a handshake or a thread.
+ *
+ * Sources that keep failing to log in are slowed down before any password
+ * is checked: after n failures in a row, each login from that source waits
+ * auth_delay_ms * 2^(n-1) (at most auth_max_delay_ms) after the one before.
+ * The wait is spent on the handshake timer, holding no thread, and a login
+ * that could not be checked before its handshake deadline is failed right
+ * away. After ban_after failures, new connections from the source are
+ * turned away for ban_s seconds.
+ *
+ * An admitted connection holds its SourceAccount until it is closed, from
+ * the handshake on through its session. Up to max_sources sources are
+ * remembered; beyond that, the least recently used ones without
+ * connections or an active ban are forgotten (banned sources are only
+ * forgotten once their ban is over). A limit of 0 means unlimited. This is
+ * thread safe.
+ */
+class Admission {
+public:
+
+    enum {
+        HANDSHAKES = 0, QUEUE = 1, MEMORY = 2, CONNS = 3, SOURCE_CONNS = 4, RATE = 5, SOURCE_RATE = 6, BANNED = 7,
+        n_reasons = 8
+    };
+
+private:
+
+    static pthread_mutex_t m;
+    static std::map<std::string, SourceAccount*> sources;
+    static std::list<SourceAccount*> idle;
+    static rpc::i64 last_sweep_us;
+    static int n_conns;
+    static rpc::TokenBucket rate;
+
+    static volatile rpc::i64 n_admitted;
+    static volatile rpc::i64 n_rejected[n_reasons];
+    static volatile rpc::i64 n_auth_failures;
+    static volatile rpc::i64 n_auth_delayed;
+    static volatile rpc::i64 n_auth_rejected;
+    static volatile rpc::i64 n_bans;
+    static volatile rpc::i64 n_evicted;
+
+    static bool expired(SourceAccount* source, rpc::i64 now_us);
+    static void forget(SourceAccount* source);
+    static SourceAccount* evictable(rpc::i64 now_us);
+    static void sweep(rpc::i64 now_us);
+    static int check(SourceAccount* source, rpc::ThreadPool* thpool, rpc::i64 now_us);
+
+public:
+
+    static int max_handshakes;
+    static int max_conns;
+    static int max_source_conns;
+    static double conn_rate;
+    static double conn_burst;
+    static double source_rate;
+    static double source_burst;
+    static int auth_delay_ms;
+    static int auth_max_delay_ms;
+    static int ban_after;
+    static int ban_s;
+    static int max_sources;
+
+    /**
+     * Called once the limits are set.
+     */
+    static void init();
+
+    /**
+     * Returns the account the new connection from addr holds, or NULL if it
+     * is turned away, with *reason set to what the client should be told.
+     * thpool runs the server side of handshakes.
+     */
+    static SourceAccount* admit(const struct sockaddr* addr, rpc::ThreadPool* thpool, const char** reason);
+
+    /**
+     * Called when an admitted connection is closed. NULL is ignored.
+     */
+    static void leave(SourceAccount* source);
+
+    /**
+     * Tell the client on fd why it is turned away, and close fd. Does not block.
+     */
+    static void reject(int fd, const char* reason);
+
+    /**
+     * Called when a client from source sent its password, before it is
+     * checked. Returns how long to wait before checking it (0 for right
+     * away), or -1 if it should be failed without checking, because it
+     * could not be checked by deadline_us or the source is banned.
+     */
+    static rpc::i64 auth_wait_us(SourceAccount* source, rpc::i64 deadline_us);
+
+    /**
+     * Called with the outcome of checking a password from source.
+     */
+    static void auth_failed(SourceAccount* source);
+    static void auth_passed(SourceAccount* source);
+
+    static void dump_stats();
+};
@@ -0,0 +1,351 @@
+#include <string>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif // __linux__
+
+#include "arena.h"
+
+using namespace std;
+
+namespace rpc {
+
+int BufferArena::max_pages_ = 0;
+int BufferArena::n_nodes_ = 1;
+volatile int BufferArena::n_pages_ = 0;
+volatile int BufferArena::n_huge_pages_ = 0;
+BufferArena::SizeClass BufferArena::classes_[BufferArena::max_nodes][BufferArena::n_classes];
+BufferArena::PageNode* BufferArena::page_nodes_ = NULL;
+int BufferArena::page_nodes_mask_ = 0;
+pthread_mutex_t BufferArena::page_nodes_m_ = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t BufferArena::thread_cache_key_;
+
+/**
+ * Free slots kept by each thread, in bytes per size class.
+ */
+static const int thread_cache_bytes = 512 * 1024;
+
+struct ArenaThreadCache {
+    int node;
+    char* head[BufferArena::n_classes];
+    int count[BufferArena::n_classes];
+};
+
+static __thread ArenaThreadCache* thread_cache = NULL;
+
+// free slots are linked through their first bytes
+static char*& next_of(char* slot) {
+    return *(char**) slot;
+}
+
+static int cache_limit(int cls) {
+    return max(4, thread_cache_bytes / (BufferArena::min_slot_size << cls));
+}
+
+ArenaThreadCache* BufferArena::get_thread_cache() {
+    if (thread_cache == NULL) {
+        // flushed back to the shared lists by release_thread_cache() when the thread exits
+        thread_cache = new ArenaThreadCache;
+        memset(thread_cache, 0, sizeof(*thread_cache));
+        if (n_nodes_ > 1) {
+            thread_cache->node = numa_node_of_cpu(current_cpu()) % n_nodes_;
+        }
+        verify(pthread_setspecific(thread_cache_key_, thread_cache) == 0);
+    }
+    return thread_cache;
+}
+
+// e.g. a drained poll thread, or an idle pool worker retiring
+void BufferArena::release_thread_cache(void* arg) {
+    ArenaThreadCache* tc = (ArenaThreadCache *) arg;
+    for (int cls = 0; cls < n_classes; cls++) {
+        if (tc->head[cls] != NULL) {
+            char* tail = tc->head[cls];
+            while (next_of(tail) != NULL) {
+                tail = next_of(tail);
+            }
+            give_back(tc->node, cls, tc->head[cls], tail, tc->count[cls]);
+        }
+    }
+    delete tc;
+    thread_cache = NULL;
+}
+
+void BufferArena::init(i64 max_bytes) {
+    for (int node = 0; node < max_nodes; node++) {
+        for (int i = 0; i < n_classes; i++) {
+            SizeClass& sc = classes_[node][i];
+            Pthread_mutex_init(&sc.m, NULL);
+            sc.free_list = NULL;
+            sc.n_free = 0;
+            sc.n_slots = 0;
+            sc.n_in_use = 0;
+        }
+    }
+    max_pages_ = (int) (max_bytes / page_size);
+    verify(pthread_key_create(&thread_cache_key_, release_thread_cache) == 0);
+
+    n_nodes_ = 1;
+    int n = n_cpus();
+    for (int cpu = 0; cpu < n; cpu++) {
+        n_nodes_ = max(n_nodes_, numa_node_of_cpu(cpu) + 1);
+    }
+    n_nodes_ = min(n_nodes_, (int) max_nodes);
+
+    if (n_nodes_ > 1 && max_pages_ > 0) {
+        int size = 1;
+        while (size < 2 * max_pages_) {
+            size <<= 1;
+        }
+        page_nodes_ = new PageNode[size];
+        memset(page_nodes_, 0, sizeof(PageNode) * size);
+        page_nodes_mask_ = size - 1;
+    }
+}
+
+int BufferArena::class_of(int size) {
+    for (int cls = 0; cls < n_classes; cls++) {
+        if (size <= (min_slot_size << cls)) {
+            return cls;
+        }
+    }
+    return -1;
+}
+
+static inline int page_hash(uintptr_t page) {
+    return (int) ((page / BufferArena::page_size) * 2654435761u);
+}
+
+void BufferArena::set_node_of(char* page, int node) {
+    Pthread_mutex_lock(&page_nodes_m_);
+    int i = page_hash((uintptr_t) page) & page_nodes_mask_;
+    while (page_nodes_[i].page != 0) {
+        i = (i + 1) & page_nodes_mask_;
+    }
+    page_nodes_[i].node = node;
+    // publish the node before the page, lookups do not lock
+    __sync_synchronize();
+    page_nodes_[i].page = (uintptr_t) page;
+    Pthread_mutex_unlock(&page_nodes_m_);
+}
+
+int BufferArena::node_of(char* slot) {
+    uintptr_t page = (uintptr_t) slot & ~((uintptr_t) page_size - 1);
+    int i = page_hash(page) & page_nodes_mask_;
+    for (;;) {
+        uintptr_t p = page_nodes_[i].page;
+        verify(p != 0);
+        if (p == page) {
+            return page_nodes_[i].node;
+        }
+        i = (i + 1) & page_nodes_mask_;
+    }
+}
+
+char* BufferArena::map_page(int node, bool* huge) {
+    *huge = false;
+    char* page = NULL;
+
+#ifdef MAP_HUGETLB
+    void* p = mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+        *huge = true;
+        page = (char *) p;
+    }
+#endif // MAP_HUGETLB
+
+    if (page == NULL) {
+        // no huge pages reserved, map twice the size to get an aligned page for THP
+        char* q = (char *) mmap(NULL, 2 * page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (q == MAP_FAILED) {
+            return NULL;
+        }
+        page = (char *) (((uintptr_t) q + page_size - 1) & ~((uintptr_t) page_size - 1));
+        if (page > q) {
+            munmap(q, page - q);
+        }
+        if (page + page_size < q + 2 * page_size) {
+            munmap(page + page_size, q + 2 * page_size - (page + page_size));
+        }
+
+#ifdef MADV_HUGEPAGE
+        madvise(page, page_size, MADV_HUGEPAGE);
+#endif // MADV_HUGEPAGE
+    }
+
+    if (n_nodes_ > 1) {
+#ifdef __linux__
+        // MPOL_PREFERRED, memory still comes from another node if this one is full.
+        // Nothing has touched the page yet, so it applies to all of it.
+        unsigned long mask = 1UL << node;
+        const int mpol_preferred = 1;
+        syscall(SYS_mbind, page, page_size, mpol_preferred, &mask, sizeof(mask) * 8, 0);
+#endif // __linux__
+        set_node_of(page, node);
+    }
+
+    return page;
+}
+
+// take up to n free slots of class cls into a list at *head, returns how many
+int BufferArena::refill(int node, int cls, char** head, int n) {
+    SizeClass& sc = classes_[node][cls];
+    int slot_size = min_slot_size << cls;
+
+    Pthread_mutex_lock(&sc.m);
+
+    if (sc.free_list == NULL) {
+        if (__sync_add_and_fetch(&n_pages_, 1) > max_pages_) {
+            __sync_sub_and_fetch(&n_pages_, 1);
+            Pthread_mutex_unlock(&sc.m);
+            return 0;
+        }
+        bool huge;
+        char* page = map_page(node, &huge);
+        if (page == NULL) {
+            __sync_sub_and_fetch(&n_pages_, 1);
+            Pthread_mutex_unlock(&sc.m);
+            Log::error("cannot map page for buffer arena");
+            return 0;
+        }
+        if (huge) {
+            __sync_add_and_fetch(&n_huge_pages_, 1);
+        }
+
+        int n_slots = page_size / slot_size;
+        for (int i = n_slots - 1; i >= 0; i--) {
+            char* slot = page + i * slot_size;
+            next_of(slot) = sc.free_list;
+            sc.free_list = slot;
+        }
+        sc.n_free += n_slots;
+        sc.n_slots += n_slots;
+    }
+
+    int n_taken = 0;
+    *head = NULL;
+    char* tail = NULL;
+    while (n_taken < n && sc.free_list != NULL) {
+        char* slot = sc.free_list;
+        sc.free_list = next_of(slot);
+        next_of(slot) = NULL;
+        if (tail == NULL) {
+            *head = slot;
+        } else {
+            next_of(tail) = slot;
+        }
+        tail = slot;
+        n_taken++;
+    }
+    sc.n_free -= n_taken;
+
+    Pthread_mutex_unlock(&sc.m);
+    return n_taken;
+}
+
+void BufferArena::give_back(int node, int cls, char* head, char* tail, int n) {
+    SizeClass& sc = classes_[node][cls];
+    Pthread_mutex_lock(&sc.m);
+    next_of(tail) = sc.free_list;
+    sc.free_list = head;
+    sc.n_free += n;
+    Pthread_mutex_unlock(&sc.m);
+}
+
+char* BufferArena::alloc(int size, int* slot_size) {
+    int cls = class_of(size);
+    if (cls < 0) {
+        return NULL;
+    }
+
+    ArenaThreadCache* tc = get_thread_cache();
+
+    if (tc->head[cls] == NULL) {
+        tc->count[cls] = refill(tc->node, cls, &tc->head[cls], cache_limit(cls) / 2);
+        if (tc->count[cls] == 0) {
+            return NULL;
+        }
+    }
+
+    char* slot = tc->head[cls];
+    tc->head[cls] = next_of(slot);
+    tc->count[cls]--;
+    __sync_add_and_fetch(&classes_[tc->node][cls].n_in_use, 1);
+
+    *slot_size = min_slot_size << cls;
+    return slot;
+}
+
+void BufferArena::free(char* p, int slot_size) {
+    int cls = class_of(slot_size);
+    verify(cls >= 0 && (min_slot_size << cls) == slot_size);
+
+    ArenaThreadCache* tc = get_thread_cache();
+
+    if (n_nodes_ > 1) {
+        int node = node_of(p);
+        if (node != tc->node) {
+            // e.g. a session moved to a poll thread on another node, keep slots local
+            __sync_sub_and_fetch(&classes_[node][cls].n_in_use, 1);
+            give_back(node, cls, p, p, 1);
+            return;
+        }
+    }
+
+    next_of(p) = tc->head[cls];
+    tc->head[cls] = p;
+    tc->count[cls]++;
+    __sync_sub_and_fetch(&classes_[tc->node][cls].n_in_use, 1);
+
+    int limit = cache_limit(cls);
+    if (tc->count[cls] > limit) {
+        // e.g. a thread that only frees, hand half of its slots to others
+        int n = tc->count[cls] - limit / 2;
+        char* head = tc->head[cls];
+        char* tail = head;
+        for (int i = 1; i < n; i++) {
+            tail = next_of(tail);
+        }
+        tc->head[cls] = next_of(tail);
+        tc->count[cls] -= n;
+        give_back(tc->node, cls, head, tail, n);
+    }
+}
+
+void BufferArena::dump_stats() {
+    if (!enabled()) {
+        return;
+    }
+
+    i64 in_use = 0;
+    string classes;
+    for (int cls = 0; cls < n_classes; cls++) {
+        int slot_size = min_slot_size << cls;
+        i64 n_in_use = 0;
+        i64 n_slots = 0;
+        for (int node = 0; node < n_nodes_; node++) {
+            n_in_use += classes_[node][cls].n_in_use;
+            n_slots += classes_[node][cls].n_slots;
+        }
+        in_use += n_in_use * slot_size;
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%s%dk: %lld/%lld", cls == 0 ? "" : ", ", slot_size / 1024,
+                (long long) n_in_use, (long long) n_slots);
+        classes += buf;
+    }
+    i64 mapped = (i64) n_pages_ * page_size;
+
+    // a page serves the size class that first needed it for good, and is never unmapped,
+    // so its free slots cannot serve other size classes
+    Log::info("arena: %d pages (%d huge, max %d) on %d numa nodes, %lld of %lld bytes in use, "
+            "%.1f%% free in pages kept by their size class",
+            (int) n_pages_, (int) n_huge_pages_, max_pages_, n_nodes_, (long long) in_use, (long long) mapped,
+            mapped > 0 ? 100.0 * (mapped - in_use) / mapped : 0.0);
+    Log::info("arena slots in use by size: %s", classes.c_str());
+}
+
+} // namespace rpc
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "utils.h"
+
+namespace rpc {
+
+struct ArenaThreadCache;
+
+/**
+ * Storage for Chunk data, carved out of 2 MB huge pages.
+ *
+ * Each page serves one size class (8 KB to 256 KB, powers of two), so slots
+ * never straddle pages and no per-slot header is needed. Pages come from
+ * MAP_HUGETLB if the system has huge pages reserved, otherwise from aligned
+ * anonymous memory with MADV_HUGEPAGE. Pages are never given back, and stay
+ * with the size class that first needed them: free slots are reused, but
+ * only for buffers of that size.
+ *
+ * Each thread keeps a small free list per size class, and only takes the
+ * class lock to move a batch of slots from or to the shared list. A thread
+ * that exits hands its cached slots back to the shared lists.
+ *
+ * On numa systems each node has its own pages and free lists, and pages are
+ * bound to their node. Threads take slots of the node they run on (poll
+ * threads pinned with --pin-cpus stay there), and slots freed by a thread of
+ * another node go straight back to their own node.
+ *
+ * Disabled until init() is called. This is thread safe.
+ */
+class BufferArena {
+public:
+
+    static const int page_size = 2 * 1024 * 1024;
+    static const int min_slot_size = 8 * 1024;
+    static const int n_classes = 6;
+    static const int max_nodes = 8;
+
+    /**
+     * Map at most max_bytes of pages, on demand.
+     */
+    static void init(i64 max_bytes);
+
+    static bool enabled() {
+        return max_pages_ > 0;
+    }
+
+    /**
+     * Returns NULL if size is larger than the largest size class, or the
+     * arena is full. *slot_size gets the usable size, at least size.
+     */
+    static char* alloc(int size, int* slot_size);
+
+    /**
+     * slot_size must be what alloc() returned.
+     */
+    static void free(char* p, int slot_size);
+
+    /**
+     * Log pages mapped, and how much of them is in use, by size class.
+     */
+    static void dump_stats();
+
+private:
+
+    struct SizeClass {
+        pthread_mutex_t m;
+        char* free_list;
+        int n_free;
+        volatile i64 n_slots;
+        volatile i64 n_in_use;
+    };
+
+    // node of each mapped page, by page address, only used with several nodes
+    struct PageNode {
+        volatile uintptr_t page;
+        int node;
+    };
+
+    static int max_pages_;
+    static int n_nodes_;
+    static volatile int n_pages_;
+    static volatile int n_huge_pages_;
+    static SizeClass classes_[max_nodes][n_classes];
+
+    // open addressing, pages are only ever added, inserts hold page_nodes_m_
+    static PageNode* page_nodes_;
+    static int page_nodes_mask_;
+    static pthread_mutex_t page_nodes_m_;
+
+    static pthread_key_t thread_cache_key_;
+
+    static ArenaThreadCache* get_thread_cache();
+    static void release_thread_cache(void* arg);
+    static int class_of(int size);
+    static char* map_page(int node, bool* huge);
+    static void set_node_of(char* page, int node);
+    static int node_of(char* slot);
+    static int refill(int node, int cls, char** head, int n);
+    static void give_back(int node, int cls, char* head, char* tail, int n);
+};
+
+} // namespace rpc
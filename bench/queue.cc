@@ -0,0 +1,161 @@
+/**
+ * Pushes items through a RingQueue, and through a list guarded by a mutex
+ * and a condition variable (the queue ThreadPool used before), with several
+ * producer and consumer threads, and reports items per second.
+ *
+ *   queue [<producers> <consumers>] [<items>]
+ *
+ * Without thread counts, runs 1 to 64 producers with as many consumers.
+ */
+
+#include <list>
+#include <vector>
+
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#include "../utils.h"
+
+using namespace std;
+using namespace rpc;
+
+class LockedQueue {
+    list<long> q_;
+    pthread_mutex_t m_;
+    pthread_cond_t not_empty_;
+
+public:
+    LockedQueue() {
+        Pthread_mutex_init(&m_, NULL);
+        Pthread_cond_init(&not_empty_, NULL);
+    }
+
+    ~LockedQueue() {
+        Pthread_cond_destroy(&not_empty_);
+        Pthread_mutex_destroy(&m_);
+    }
+
+    void push(long e) {
+        Pthread_mutex_lock(&m_);
+        q_.push_back(e);
+        Pthread_cond_signal(&not_empty_);
+        Pthread_mutex_unlock(&m_);
+    }
+
+    long pop() {
+        Pthread_mutex_lock(&m_);
+        while (q_.empty()) {
+            Pthread_cond_wait(&not_empty_, &m_);
+        }
+        long e = q_.front();
+        q_.pop_front();
+        Pthread_mutex_unlock(&m_);
+        return e;
+    }
+};
+
+// items are 1..n, 0 tells a consumer to stop
+struct Run {
+    RingQueue<long>* ring;
+    LockedQueue* locked;
+    long n_items;
+    volatile long sum;
+};
+
+static void* produce(void* arg) {
+    Run* run = (Run *) arg;
+    for (long i = 1; i <= run->n_items; i++) {
+        if (run->ring != NULL) {
+            while (!run->ring->try_push(i)) {
+                sched_yield();
+            }
+        } else {
+            run->locked->push(i);
+        }
+    }
+    return NULL;
+}
+
+static void* consume(void* arg) {
+    Run* run = (Run *) arg;
+    long sum = 0;
+    for (;;) {
+        long e;
+        if (run->ring != NULL) {
+            while (!run->ring->try_pop(&e)) {
+                sched_yield();
+            }
+        } else {
+            e = run->locked->pop();
+        }
+        if (e == 0) {
+            break;
+        }
+        sum += e;
+    }
+    __sync_add_and_fetch(&run->sum, sum);
+    return NULL;
+}
+
+// returns items per second
+static double run_once(bool ring, int n_producers, int n_consumers, long n_items) {
+    Run run;
+    run.ring = ring ? new RingQueue<long>(1024) : NULL;
+    run.locked = ring ? NULL : new LockedQueue;
+    run.n_items = n_items / n_producers;
+    run.sum = 0;
+
+    i64 start = time_now_us();
+    vector<pthread_t> producers(n_producers), consumers(n_consumers);
+    for (int i = 0; i < n_consumers; i++) {
+        Pthread_create(&consumers[i], NULL, consume, &run);
+    }
+    for (int i = 0; i < n_producers; i++) {
+        Pthread_create(&producers[i], NULL, produce, &run);
+    }
+    for (int i = 0; i < n_producers; i++) {
+        Pthread_join(producers[i], NULL);
+    }
+    for (int i = 0; i < n_consumers; i++) {
+        if (ring) {
+            while (!run.ring->try_push(0)) {
+                sched_yield();
+            }
+        } else {
+            run.locked->push(0);
+        }
+    }
+    for (int i = 0; i < n_consumers; i++) {
+        Pthread_join(consumers[i], NULL);
+    }
+    i64 elapsed = time_now_us() - start;
+
+    // every item came out exactly once
+    verify(run.sum == n_producers * (run.n_items * (run.n_items + 1) / 2));
+    delete run.ring;
+    delete run.locked;
+    return (double) n_producers * run.n_items / (elapsed / 1e6);
+}
+
+static void report(int n_producers, int n_consumers, long n_items) {
+    double ring = run_once(true, n_producers, n_consumers, n_items);
+    double locked = run_once(false, n_producers, n_consumers, n_items);
+    Log::info("%2d producers, %2d consumers: RingQueue %.2f M/s, mutex queue %.2f M/s", n_producers, n_consumers,
+            ring / 1e6, locked / 1e6);
+}
+
+int main(int argc, char* argv[]) {
+    long n_items = 1000000;
+    if (argc == 2 || argc == 4) {
+        n_items = atol(argv[argc - 1]);
+    }
+    if (argc >= 3) {
+        report(atoi(argv[1]), atoi(argv[2]), n_items);
+        return 0;
+    }
+    for (int n = 1; n <= 64; n *= 2) {
+        report(n, n, n_items);
+    }
+    return 0;
+}
@@ -0,0 +1,300 @@
+/**
+ * Drives a running vncproxy with VNC sessions to a built-in VNC server, and
+ * measures what it relays.
+ *
+ *   relay <proxy host:port> <forward_key> <server host:port> bulk <sessions> <seconds> [up|down|both]
+ *   relay <proxy host:port> <forward_key> <server host:port> latency <busy sessions> <keystrokes>
+ *
+ * The server listens on <server host:port>, which should be the dest_addr
+ * of <forward_key> in the proxy's routes, and offers no authentication.
+ *
+ * bulk: every session streams data for the given time, from the client to
+ * the server (up), the server to the client (down), or both at once, and
+ * the bytes relayed per second are reported for each direction.
+ *
+ * latency: one session sends a byte at a time from the client, like key
+ * presses, while the other sessions stream from the server to the client,
+ * like screen updates, and the time it takes each byte to reach the server
+ * is reported.
+ */
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "../utils.h"
+#include "../d3des.h"
+
+using namespace std;
+using namespace rpc;
+
+static bool recv_all(int fd, void* buf, int size) {
+    char* p = (char *) buf;
+    while (size > 0) {
+        int r = recv(fd, p, size, 0);
+        if (r <= 0) {
+            return false;
+        }
+        p += r;
+        size -= r;
+    }
+    return true;
+}
+
+static bool send_all(int fd, const void* buf, int size) {
+    const char* p = (const char *) buf;
+    while (size > 0) {
+        int r = send(fd, p, size, MSG_NOSIGNAL);
+        if (r <= 0) {
+            return false;
+        }
+        p += r;
+        size -= r;
+    }
+    return true;
+}
+
+// the server side of sessions the proxy forwards to us, in accept order
+class Server {
+    int server_sock_;
+    pthread_mutex_t m_;
+    pthread_cond_t cv_;
+    vector<int> fds_;
+
+    static void* start_accept_loop(void* arg) {
+        ((Server *) arg)->accept_loop();
+        return NULL;
+    }
+
+    void accept_loop() {
+        for (;;) {
+            int fd = accept(server_sock_, NULL, NULL);
+            if (fd < 0) {
+                continue;
+            }
+            // RFB 3.8 with no authentication
+            char buf[12];
+            char none = 1;
+            u32 ok = 0;
+            if (!send_all(fd, "RFB 003.008\n", 12) || !recv_all(fd, buf, 12) || !send_all(fd, "\x01\x01", 2)
+                    || !recv_all(fd, &none, 1) || !send_all(fd, &ok, 4)) {
+                close(fd);
+                continue;
+            }
+            Pthread_mutex_lock(&m_);
+            fds_.push_back(fd);
+            Pthread_cond_signal(&cv_);
+            Pthread_mutex_unlock(&m_);
+        }
+    }
+
+public:
+    Server(int server_sock)
+            : server_sock_(server_sock) {
+        Pthread_mutex_init(&m_, NULL);
+        Pthread_cond_init(&cv_, NULL);
+        pthread_t th;
+        Pthread_create(&th, NULL, Server::start_accept_loop, this);
+    }
+
+    // the server fd of the n-th session
+    int wait_session(int n) {
+        Pthread_mutex_lock(&m_);
+        while ((int) fds_.size() <= n) {
+            Pthread_cond_wait(&cv_, &m_);
+        }
+        int fd = fds_[n];
+        Pthread_mutex_unlock(&m_);
+        return fd;
+    }
+};
+
+// log in to the proxy as a VNC client, returns the client fd or -1
+static int login(const char* proxy_addr, const char* forward_key) {
+    int fd = connect_to(proxy_addr);
+    if (fd < 0) {
+        return -1;
+    }
+    char version[12];
+    unsigned char types[2];
+    unsigned char vnc_auth = 2;
+    unsigned char challenge[16];
+    unsigned char response[16];
+    u32 result = 1;
+    if (!recv_all(fd, version, 12) || !send_all(fd, "RFB 003.008\n", 12) || !recv_all(fd, types, 2)
+            || !send_all(fd, &vnc_auth, 1) || !recv_all(fd, challenge, 16)) {
+        close(fd);
+        return -1;
+    }
+    unsigned char key[8];
+    memset(key, 0, sizeof(key));
+    memcpy(key, forward_key, min(strlen(forward_key), sizeof(key)));
+    rfbDesKey(key, EN0);
+    for (int i = 0; i < 16; i += 8) {
+        rfbDes(challenge + i, response + i);
+    }
+    if (!send_all(fd, response, 16) || !recv_all(fd, &result, 4) || result != 0) {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+struct Stream {
+    int fd;
+    bool sending;
+    // client to server
+    bool up;
+    volatile bool* stop;
+    volatile i64 n_bytes;
+};
+
+static void* run_stream(void* arg) {
+    Stream* s = (Stream *) arg;
+    static const int buf_size = 64 * 1024;
+    char* buf = new char[buf_size];
+    memset(buf, 'x', buf_size);
+    while (!*s->stop) {
+        int r = s->sending ? send(s->fd, buf, buf_size, MSG_NOSIGNAL) : recv(s->fd, buf, buf_size, 0);
+        if (r <= 0) {
+            break;
+        }
+        __sync_add_and_fetch(&s->n_bytes, r);
+    }
+    delete[] buf;
+    return NULL;
+}
+
+// logs in sessions first..first+n-1 and starts streaming on them, returns false if a login fails
+static bool start_streams(const char* proxy_addr, const char* forward_key, Server* server, int first, int n,
+        bool up, bool down, volatile bool* stop, vector<Stream*>* streams) {
+    for (int i = first; i < first + n; i++) {
+        int clnt_fd = login(proxy_addr, forward_key);
+        if (clnt_fd < 0) {
+            Log::error("cannot log in to %s", proxy_addr);
+            return false;
+        }
+        int server_fd = server->wait_session(i);
+        // a sender and a receiver for each direction
+        for (int j = 0; j < 4; j++) {
+            Stream* s = new Stream;
+            s->up = (j < 2);
+            s->sending = (j % 2 == 0);
+            s->fd = (s->up == s->sending) ? clnt_fd : server_fd;
+            s->stop = stop;
+            s->n_bytes = 0;
+            if ((s->up && up) || (!s->up && down)) {
+                streams->push_back(s);
+            } else {
+                delete s;
+            }
+        }
+    }
+    for (size_t i = 0; i < streams->size(); i++) {
+        pthread_t th;
+        Pthread_create(&th, NULL, run_stream, (*streams)[i]);
+    }
+    return true;
+}
+
+static int run_bulk(const char* proxy_addr, const char* forward_key, Server* server, int n_sessions,
+        int seconds, const char* dirs) {
+    volatile bool stop = false;
+    vector<Stream*> streams;
+    if (!start_streams(proxy_addr, forward_key, server, 0, n_sessions, strcmp(dirs, "down") != 0,
+            strcmp(dirs, "up") != 0, &stop, &streams)) {
+        return 1;
+    }
+
+    i64 start = time_now_us();
+    sleep(seconds);
+
+    // what arrived, by direction
+    i64 n_up = 0, n_down = 0;
+    for (size_t i = 0; i < streams.size(); i++) {
+        if (!streams[i]->sending) {
+            (streams[i]->up ? n_up : n_down) += streams[i]->n_bytes;
+        }
+    }
+    double elapsed = (time_now_us() - start) / 1e6;
+    stop = true;
+
+    Log::info("%d sessions, %s: up %.1f MB/s, down %.1f MB/s, total %.1f MB/s", n_sessions, dirs,
+            n_up / elapsed / (1 << 20), n_down / elapsed / (1 << 20), (n_up + n_down) / elapsed / (1 << 20));
+    // streams are blocked in syscalls, exit instead of joining
+    return 0;
+}
+
+static int run_latency(const char* proxy_addr, const char* forward_key, Server* server, int n_busy,
+        int n_keys) {
+    int clnt_fd = login(proxy_addr, forward_key);
+    if (clnt_fd < 0) {
+        Log::error("cannot log in to %s", proxy_addr);
+        return 1;
+    }
+    int server_fd = server->wait_session(0);
+
+    volatile bool stop = false;
+    vector<Stream*> streams;
+    if (!start_streams(proxy_addr, forward_key, server, 1, n_busy, false, true, &stop, &streams)) {
+        return 1;
+    }
+    // let the streams fill the buffers
+    usleep(200 * 1000);
+
+    vector<i64> latency_us;
+    for (int i = 0; i < n_keys; i++) {
+        char key = 'k';
+        i64 start = time_now_us();
+        if (!send_all(clnt_fd, &key, 1) || !recv_all(server_fd, &key, 1)) {
+            Log::error("keystroke session closed");
+            return 1;
+        }
+        latency_us.push_back(time_now_us() - start);
+        // a fast typist
+        usleep(10 * 1000);
+    }
+    stop = true;
+
+    sort(latency_us.begin(), latency_us.end());
+    Log::info("%d keystrokes, %d busy sessions: latency p50 %lld us, p90 %lld us, p99 %lld us, max %lld us",
+            n_keys, n_busy, (long long) latency_us[n_keys / 2], (long long) latency_us[n_keys * 9 / 10],
+            (long long) latency_us[n_keys * 99 / 100], (long long) latency_us[n_keys - 1]);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc >= 7 && strcmp(argv[4], "bulk") == 0) {
+        struct addrinfo *result, *rp;
+        int server_sock = bind_on(argv[3], &result, &rp);
+        if (server_sock < 0) {
+            return 1;
+        }
+        Server server(server_sock);
+        return run_bulk(argv[1], argv[2], &server, atoi(argv[5]), atoi(argv[6]), argc >= 8 ? argv[7] : "both");
+    }
+    if (argc == 7 && strcmp(argv[4], "latency") == 0 && atoi(argv[6]) > 0) {
+        struct addrinfo *result, *rp;
+        int server_sock = bind_on(argv[3], &result, &rp);
+        if (server_sock < 0) {
+            return 1;
+        }
+        Server server(server_sock);
+        return run_latency(argv[1], argv[2], &server, atoi(argv[5]), atoi(argv[6]));
+    }
+    printf("usage: %s <proxy host:port> <forward_key> <server host:port> bulk <sessions> <seconds> [up|down|both]\n",
+            argv[0]);
+    printf("       %s <proxy host:port> <forward_key> <server host:port> latency <busy sessions> <keystrokes>\n",
+            argv[0]);
+    return 1;
+}
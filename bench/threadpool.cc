@@ -0,0 +1,80 @@
+/**
+ * Submits jobs to a ThreadPool from one thread, the way the poll threads hand
+ * handshakes to it, and reports how long jobs waited for a thread.
+ *
+ *   threadpool <threads> <jobs per second> <seconds> <slow %> <slow ms>
+ *
+ * Most jobs return right away, the given share of them sleeps for slow ms,
+ * like a handshake connecting to a VNC server that is slow to answer.
+ */
+
+#include <algorithm>
+#include <vector>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../utils.h"
+
+using namespace std;
+using namespace rpc;
+
+static i64* delays_us;
+static volatile int n_done = 0;
+
+class Job: public Runnable {
+    i64 queued_us_;
+    int index_;
+    int sleep_ms_;
+public:
+    Job(int index, int sleep_ms)
+            : queued_us_(time_now_us()), index_(index), sleep_ms_(sleep_ms) {
+    }
+    void run() {
+        delays_us[index_] = time_now_us() - queued_us_;
+        if (sleep_ms_ > 0) {
+            usleep(sleep_ms_ * 1000);
+        }
+        __sync_add_and_fetch(&n_done, 1);
+    }
+};
+
+int main(int argc, char* argv[]) {
+    if (argc != 6) {
+        printf("usage: %s <threads> <jobs per second> <seconds> <slow %%> <slow ms>\n", argv[0]);
+        return 1;
+    }
+    int n_threads = atoi(argv[1]);
+    int rate = atoi(argv[2]);
+    int seconds = atoi(argv[3]);
+    int slow_pct = atoi(argv[4]);
+    int slow_ms = atoi(argv[5]);
+
+    int n_jobs = rate * seconds;
+    delays_us = new i64[n_jobs];
+    ThreadPool* pool = new ThreadPool(n_threads, n_threads);
+
+    // not rand(), a pool may use it to place jobs
+    unsigned int seed = 1;
+    i64 start = time_now_us();
+    for (int i = 0; i < n_jobs; i++) {
+        i64 due = start + (i64) i * 1000000 / rate;
+        i64 now = time_now_us();
+        if (due > now) {
+            usleep(due - now);
+        }
+        pool->run_async(new Job(i, rand_r(&seed) % 100 < slow_pct ? slow_ms : 0));
+    }
+    // runs what is left
+    delete pool;
+    verify(n_done == n_jobs);
+
+    vector<i64> sorted(delays_us, delays_us + n_jobs);
+    sort(sorted.begin(), sorted.end());
+    Log::info("%d threads, %d jobs, %d%% sleep %d ms: queueing delay p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms",
+            n_threads, n_jobs, slow_pct, slow_ms, sorted[n_jobs / 2] / 1000.0, sorted[n_jobs * 9 / 10] / 1000.0,
+            sorted[n_jobs * 99 / 100] / 1000.0, sorted[n_jobs - 1] / 1000.0);
+    delete[] delays_us;
+    return 0;
+}
@@ -0,0 +1,159 @@
+/**
+ * Sends bursts through a Marshal, with plain writes or MSG_ZEROCOPY, the way
+ * Session sends framebuffer updates to a client, and reports throughput and
+ * the CPU time the sender spent.
+ *
+ *   zerocopy recv <host:port>
+ *   zerocopy send <host:port> <total size> <burst size> [--zerocopy=<min size>]
+ *
+ * Sizes take k/m/g suffixes. Run the receiver in another network namespace
+ * behind a veth pair, or on another host, to see the difference: the kernel
+ * copies zero copy sends that are received locally (loopback) anyway.
+ */
+
+#include <string>
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "../utils.h"
+#include "../marshal.h"
+
+using namespace std;
+using namespace rpc;
+
+static i64 parse_size(const char* s) {
+    char* end;
+    i64 size = strtoll(s, &end, 10);
+    if (*end == 'k' || *end == 'K') {
+        size <<= 10;
+    } else if (*end == 'm' || *end == 'M') {
+        size <<= 20;
+    } else if (*end == 'g' || *end == 'G') {
+        size <<= 30;
+    }
+    return size;
+}
+
+static i64 cpu_time_us() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000LL + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static int run_recv(const char* addr) {
+    struct addrinfo *result, *rp;
+    int server_sock = bind_on(addr, &result, &rp);
+    if (server_sock < 0) {
+        return 1;
+    }
+    for (;;) {
+        int fd = accept(server_sock, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        static char buf[256 * 1024];
+        i64 n_total = 0;
+        i64 start = time_now_us();
+        int r;
+        while ((r = read(fd, buf, sizeof(buf))) > 0) {
+            n_total += r;
+        }
+        i64 elapsed = time_now_us() - start;
+        Log::info("received %lld bytes in %.3f s", (long long) n_total, elapsed / 1e6);
+        close(fd);
+    }
+    return 0;
+}
+
+// zerocopy_min_size is as Session::zerocopy_min_size, 0 for plain writes
+static int run_send(const char* addr, i64 total, int burst, int zerocopy_min_size) {
+    int fd = connect_to(addr);
+    if (fd < 0) {
+        Log::error("cannot connect to %s", addr);
+        return 1;
+    }
+    set_nonblocking(fd, true);
+
+    ZeroCopyQueue* zc = NULL;
+    Marshal out;
+    if (zerocopy_min_size > 0) {
+        if (!ZeroCopyQueue::enable(fd)) {
+            Log::error("SO_ZEROCOPY not supported");
+            return 1;
+        }
+        zc = new ZeroCopyQueue(zerocopy_min_size);
+        out.set_zerocopy(zc);
+    }
+
+    string burst_data(burst, 'x');
+    i64 n_queued = 0;
+    i64 n_sent = 0;
+    i64 start = time_now_us();
+    i64 cpu_start = cpu_time_us();
+
+    while (n_sent < total || (zc != NULL && !zc->idle())) {
+        // a new update arrives once the last one is out, like a server waiting for the next request
+        if (out.empty() && n_queued < total) {
+            out.write(burst_data.c_str(), burst);
+            n_queued += burst;
+        }
+
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = out.empty() ? 0 : POLLOUT;
+        pfd.revents = 0;
+        poll(&pfd, 1, 1000);
+
+        if (zc != NULL && (pfd.revents & POLLERR)) {
+            if (zc->reap(fd) < 0) {
+                Log::error("socket error");
+                return 1;
+            }
+        }
+        if (pfd.revents & POLLOUT) {
+            int r = out.write_to_fd(fd);
+            if (r < 0 && errno != EAGAIN) {
+                Log::error("write: %s", strerror(errno));
+                return 1;
+            }
+            if (r > 0) {
+                n_sent += r;
+            }
+        }
+    }
+
+    i64 elapsed = time_now_us() - start;
+    i64 cpu = cpu_time_us() - cpu_start;
+    Log::info("%s, %d byte bursts: %lld bytes in %.3f s, %.1f MB/s, %.1f ms cpu per 100 MB",
+            zc != NULL ? "MSG_ZEROCOPY" : "write", burst, (long long) n_sent, elapsed / 1e6,
+            n_sent / (elapsed / 1e6) / (1 << 20), cpu / 1000.0 / (n_sent / (100.0 * (1 << 20))));
+    if (zc != NULL) {
+        ZeroCopyQueue::dump_stats();
+        out.set_zerocopy(NULL);
+        delete zc;
+    }
+    close(fd);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc == 3 && strcmp(argv[1], "recv") == 0) {
+        return run_recv(argv[2]);
+    }
+    if ((argc == 5 || argc == 6) && strcmp(argv[1], "send") == 0) {
+        int zerocopy_min_size = 0;
+        if (argc == 6 && strncmp(argv[5], "--zerocopy=", 11) == 0) {
+            zerocopy_min_size = (int) parse_size(argv[5] + 11);
+        }
+        return run_send(argv[2], parse_size(argv[3]), (int) parse_size(argv[4]), zerocopy_min_size);
+    }
+    printf("usage: %s recv <host:port>\n", argv[0]);
+    printf("       %s send <host:port> <total size> <burst size> [--zerocopy=<min size>]\n", argv[0]);
+    return 1;
+}
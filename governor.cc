@@ -0,0 +1,122 @@
+#include <algorithm>
+#include <functional>
+
+#include "governor.h"
+
+using namespace std;
+using namespace rpc;
+
+volatile i64 MemoryGovernor::used = 0;
+volatile i64 MemoryGovernor::peak = 0;
+
+pthread_mutex_t MemoryGovernor::m = PTHREAD_MUTEX_INITIALIZER;
+map<string, BufferAccount*> MemoryGovernor::accounts;
+
+volatile bool MemoryGovernor::throttling = false;
+i64 MemoryGovernor::over_since_us = 0;
+
+volatile i64 MemoryGovernor::n_paused_budget = 0;
+volatile i64 MemoryGovernor::n_paused_session_cap = 0;
+volatile i64 MemoryGovernor::n_paused_route_cap = 0;
+volatile i64 MemoryGovernor::n_paused_spill_quota = 0;
+volatile i64 MemoryGovernor::n_dropped = 0;
+
+i64 MemoryGovernor::budget = 0;
+i64 MemoryGovernor::session_cap = 0;
+i64 MemoryGovernor::route_cap = 0;
+int MemoryGovernor::drop_after_ms = 0;
+
+BufferAccount* MemoryGovernor::get_account(const string& forward_key) {
+    Pthread_mutex_lock(&m);
+    BufferAccount* account;
+    map<string, BufferAccount*>::iterator it = accounts.find(forward_key);
+    if (it == accounts.end()) {
+        account = new BufferAccount(forward_key);
+        accounts[forward_key] = account;
+    } else {
+        account = it->second;
+    }
+    account->n_users++;
+    Pthread_mutex_unlock(&m);
+    return account;
+}
+
+void MemoryGovernor::put_account(BufferAccount* account) {
+    Pthread_mutex_lock(&m);
+    account->n_users--;
+    if (account->n_users == 0) {
+        verify(account->bytes == 0);
+        accounts.erase(account->forward_key);
+        delete account;
+    }
+    Pthread_mutex_unlock(&m);
+}
+
+i64 MemoryGovernor::pause_threshold(const vector<i64>& session_bytes, bool* drop) {
+    *drop = false;
+    if (budget <= 0) {
+        return 0;
+    }
+
+    // stop throttling once back under 90% of the budget
+    i64 low_watermark = budget / 10 * 9;
+    i64 u = used;
+
+    Pthread_mutex_lock(&m);
+    if (u > budget) {
+        if (!throttling) {
+            Log::warn("relay buffers use %lld bytes, over budget of %lld bytes", (long long) u, (long long) budget);
+            over_since_us = time_now_us();
+        }
+        throttling = true;
+        if (drop_after_ms > 0 && time_now_us() - over_since_us >= (i64) drop_after_ms * 1000) {
+            *drop = true;
+        }
+    } else {
+        over_since_us = time_now_us();
+        if (throttling && u < low_watermark) {
+            Log::info("relay buffers back to %lld bytes, stop throttling", (long long) u);
+            throttling = false;
+        }
+    }
+    bool throttle = throttling;
+    Pthread_mutex_unlock(&m);
+
+    if (!throttle) {
+        return 0;
+    }
+
+    // pick the largest sessions, until they hold the bytes we are over the low watermark
+    vector<i64> sorted(session_bytes);
+    sort(sorted.begin(), sorted.end(), greater<i64>());
+    i64 excess = u - low_watermark;
+    i64 threshold = 1;
+    for (vector<i64>::iterator it = sorted.begin(); it != sorted.end() && *it > 0; ++it) {
+        threshold = *it;
+        excess -= *it;
+        if (excess <= 0) {
+            break;
+        }
+    }
+    return threshold;
+}
+
+void MemoryGovernor::count_pause(int reason) {
+    if (reason == SESSION_CAP) {
+        __sync_add_and_fetch(&n_paused_session_cap, 1);
+    } else if (reason == ROUTE_CAP) {
+        __sync_add_and_fetch(&n_paused_route_cap, 1);
+    } else if (reason == SPILL_QUOTA) {
+        __sync_add_and_fetch(&n_paused_spill_quota, 1);
+    } else {
+        __sync_add_and_fetch(&n_paused_budget, 1);
+    }
+}
+
+void MemoryGovernor::dump_stats() {
+    Log::info("relay buffers: %lld bytes used, %lld peak, budget %lld; session cap %lld, route cap %lld",
+            (long long) used, (long long) peak, (long long) budget, (long long) session_cap, (long long) route_cap);
+    Log::info("reads paused: %lld by budget, %lld by session cap, %lld by route cap, %lld by spill quota; "
+            "%lld sessions dropped", (long long) n_paused_budget, (long long) n_paused_session_cap,
+            (long long) n_paused_route_cap, (long long) n_paused_spill_quota, (long long) n_dropped);
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "utils.h"
+
+/**
+ * Relay buffer bytes held by all sessions of one route, and, if shaped, the
+ * bandwidth they share.
+ */
+struct BufferAccount {
+    std::string forward_key;
+    volatile rpc::i64 bytes;
+    int n_users;
+
+    // what all sessions of the route may send to their clients, guarded by rate_m
+    pthread_mutex_t rate_m;
+    rpc::TokenBucket rate;
+
+    BufferAccount(const std::string& key)
+            : forward_key(key), bytes(0), n_users(0) {
+        Pthread_mutex_init(&rate_m, NULL);
+    }
+
+    ~BufferAccount() {
+        Pthread_mutex_destroy(&rate_m);
+    }
+};
+
+/**
+ * Bounds memory held in relay buffers.
+ *
+ * Sessions charge every change of their buffer storage here. Each session
+ * stops reading when its own buffers reach session_cap, or its route's
+ * reach route_cap. When the total passes budget, the sessions holding the
+ * most are told to stop reading until the total is back under the low
+ * watermark. If drop_after_ms is set and the total stays over budget that
+ * long (e.g. viewers that do not read at all), the largest sessions are
+ * closed, one per check.
+ *
+ * A limit of 0 means unlimited. This is thread safe.
+ */
+class MemoryGovernor {
+    static volatile rpc::i64 used;
+    static volatile rpc::i64 peak;
+
+    static pthread_mutex_t m;
+    static std::map<std::string, BufferAccount*> accounts;
+
+    // written with m held
+    static volatile bool throttling;
+    static rpc::i64 over_since_us;
+
+    static volatile rpc::i64 n_paused_budget;
+    static volatile rpc::i64 n_paused_session_cap;
+    static volatile rpc::i64 n_paused_route_cap;
+    static volatile rpc::i64 n_paused_spill_quota;
+    static volatile rpc::i64 n_dropped;
+
+public:
+
+    enum {
+        SESSION_CAP = 1, ROUTE_CAP = 2, BUDGET = 3, SPILL_QUOTA = 4
+    };
+
+    static rpc::i64 budget;
+    static rpc::i64 session_cap;
+    static rpc::i64 route_cap;
+    static int drop_after_ms;
+
+    static BufferAccount* get_account(const std::string& forward_key);
+    static void put_account(BufferAccount*);
+
+    static void charge(BufferAccount* account, rpc::i64 delta) {
+        __sync_add_and_fetch(&account->bytes, delta);
+        rpc::i64 u = __sync_add_and_fetch(&used, delta);
+        if (u > peak) {
+            // racy, but only used for reporting
+            peak = u;
+        }
+    }
+
+    static rpc::i64 used_bytes() {
+        return used;
+    }
+
+    static bool over_budget() {
+        return budget > 0 && used > budget;
+    }
+
+    static bool is_throttling() {
+        return throttling;
+    }
+
+    /**
+     * Called periodically with the buffer bytes of every session.
+     * Returns the size at or above which sessions should stop reading, or 0
+     * if no session needs to. Sets *drop if the largest session should be
+     * closed.
+     */
+    static rpc::i64 pause_threshold(const std::vector<rpc::i64>& session_bytes, bool* drop);
+
+    static void count_pause(int reason);
+    static void count_drop() {
+        __sync_add_and_fetch(&n_dropped, 1);
+    }
+
+    static void dump_stats();
+};
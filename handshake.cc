@@ -0,0 +1,271 @@
+#include <string>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "handshake.h"
+
+using namespace std;
+using namespace rpc;
+
+int Handshake::phase_timeout_ms = 5000;
+int Handshake::total_timeout_ms = 15000;
+
+volatile int Handshake::n_active = 0;
+volatile i64 Handshake::n_started = 0;
+volatile i64 Handshake::n_passed_on = 0;
+volatile i64 Handshake::n_refused = 0;
+volatile i64 Handshake::n_timeouts[Handshake::n_phases];
+volatile i64 Handshake::n_failures[Handshake::n_phases];
+
+static const char* phase_names[Handshake::n_phases] = { "version", "security type", "auth response", "server" };
+
+Handshake::Handshake(PollMgr* pmgr, HandshakeListener* listener, int clnt_fd, SourceAccount* source)
+        : poll_(pmgr), listener_(listener), fd_(clnt_fd), source_(source), mode_(Pollable::READ), phase_(VERSION),
+          deadline_us_(time_now_us() + total_timeout_ms * 1000LL), done_(false), passed_on_(false), held_(false), in_len_(0),
+          out_len_(0), out_off_(0) {
+}
+
+Handshake::~Handshake() {
+    if (!passed_on_) {
+        close(fd_);
+        Admission::leave(source_);
+    }
+}
+
+void Handshake::start(PollMgr* pmgr, HandshakeListener* listener, int clnt_fd, SourceAccount* source) {
+    verify(set_nonblocking(clnt_fd, true) == 0);
+    __sync_add_and_fetch(&n_started, 1);
+    __sync_add_and_fetch(&n_active, 1);
+
+    Handshake* hs = new Handshake(pmgr, listener, clnt_fd, source);
+
+    // only version 3.8 is supported, the client answers with its own
+    hs->send("RFB 003.008\n", 12);
+
+    pmgr->add(hs, min(phase_timeout_ms, total_timeout_ms));
+    hs->release();
+}
+
+void Handshake::count_abort(int phase, bool timed_out) {
+    if (timed_out) {
+        __sync_add_and_fetch(&n_timeouts[phase], 1);
+    } else {
+        __sync_add_and_fetch(&n_failures[phase], 1);
+    }
+}
+
+// size of the client message expected in the current phase
+int Handshake::in_size() {
+    if (phase_ == VERSION) {
+        return 12;
+    } else if (phase_ == SECURITY) {
+        return 1;
+    } else {
+        return sizeof(challenge_);
+    }
+}
+
+// our messages are tiny and come one per phase, the socket takes them right away unless
+// the client does not read at all
+void Handshake::send(const void* data, int size) {
+    verify(out_off_ == out_len_ && size <= (int) sizeof(out_));
+    memcpy(out_, data, size);
+    out_len_ = size;
+    out_off_ = 0;
+    flush();
+}
+
+void Handshake::flush() {
+    while (out_off_ < out_len_) {
+        int n = ::write(fd_, out_ + out_off_, out_len_ - out_off_);
+        if (n <= 0) {
+            break;
+        }
+        out_off_ += n;
+    }
+
+    int mode = Pollable::READ;
+    if (out_off_ < out_len_) {
+        mode |= Pollable::WRITE;
+    }
+    if (mode != mode_) {
+        mode_ = mode;
+        // before the handshake is added, this only sets the mode it is added with
+        poll_->update_mode(this, 0, mode);
+    }
+}
+
+void Handshake::arm_timer() {
+    i64 left_ms = (deadline_us_ - time_now_us()) / 1000;
+    poll_->set_timer(this, (int) max(min((i64) phase_timeout_ms, left_ms), (i64) 0));
+}
+
+void Handshake::next_phase() {
+    in_len_ = 0;
+
+    if (phase_ == VERSION) {
+        if (memcmp(in_, "RFB 003.008\n", 12) != 0) {
+            char version[13];
+            memcpy(version, in_, 12);
+            version[12] = '\0';
+            Log::info("client protocol not supported: %s", version);
+            abort(false);
+            return;
+        }
+        // request passwd from client, which is used as redirect hint
+        unsigned char security[2];
+        security[0] = 1;    // 1 security type available
+        security[1] = 2;    // use VNC auth
+        phase_ = SECURITY;
+        send(security, sizeof(security));
+        arm_timer();
+
+    } else if (phase_ == SECURITY) {
+        // challenge client for passwd, whatever security type it picked
+        for (int i = 0; i < (int) sizeof(challenge_); i++) {
+            challenge_[i] = rand() & 0xFF;
+        }
+        phase_ = RESPONSE;
+        send(challenge_, sizeof(challenge_));
+        arm_timer();
+
+    } else {
+        check_auth();
+    }
+}
+
+// slow down sources that keep failing to log in, before the password is checked
+void Handshake::check_auth() {
+    i64 wait_us = Admission::auth_wait_us(source_, deadline_us_);
+    if (wait_us < 0) {
+        refuse();
+    } else if (wait_us > 0) {
+        held_ = true;
+        poll_->set_timer(this, (int) ((wait_us + 999) / 1000));
+    } else {
+        pass_on();
+    }
+}
+
+void Handshake::pass_on() {
+    done_ = true;
+    passed_on_ = true;
+    __sync_sub_and_fetch(&n_active, 1);
+    __sync_add_and_fetch(&n_passed_on, 1);
+    poll_->remove(this);
+    listener_->client_authenticating(fd_, source_, challenge_, in_, deadline_us_);
+}
+
+// fail the login without checking the password
+void Handshake::refuse() {
+    Log::info("failing login of client_fd=%d unchecked, too many failed logins from its address", fd_);
+
+    // security result "failed", then why (RFB 3.8)
+    const char* reason = "too many failed logins, try again later";
+    int len = strlen(reason);
+    char buf[64];
+    uint32_t be_result = htonl(1);
+    uint32_t be_len = htonl(len);
+    memcpy(buf, &be_result, 4);
+    memcpy(buf + 4, &be_len, 4);
+    memcpy(buf + 8, reason, len);
+    // nothing else was sent since the challenge, so the socket takes it
+    if (::write(fd_, buf, 8 + len) < 0) {
+        Log::debug("could not tell client_fd=%d its login failed", fd_);
+    }
+
+    done_ = true;
+    __sync_sub_and_fetch(&n_active, 1);
+    __sync_add_and_fetch(&n_refused, 1);
+    poll_->remove(this);
+}
+
+void Handshake::abort(bool timed_out) {
+    if (done_) {
+        return;
+    }
+    done_ = true;
+    count_abort(phase_, timed_out);
+    __sync_sub_and_fetch(&n_active, 1);
+
+    // the fd is closed once the poll thread let go of it
+    poll_->remove(this);
+}
+
+void Handshake::handle_read(int idx) {
+    if (held_ && !done_) {
+        // the client waits for the outcome, so only look for it hanging up
+        char c;
+        int n = ::recv(fd_, &c, 1, MSG_PEEK);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            abort(false);
+        }
+        return;
+    }
+    // once held, further bytes stay in the socket until the response is checked
+    while (!done_ && !held_) {
+        int n = ::read(fd_, in_ + in_len_, in_size() - in_len_);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (n <= 0) {
+            Log::error("error communicating with client");
+            abort(false);
+            return;
+        }
+        in_len_ += n;
+        if (in_len_ == in_size()) {
+            next_phase();
+        }
+    }
+}
+
+void Handshake::handle_write(int idx) {
+    if (!done_) {
+        flush();
+    }
+}
+
+void Handshake::handle_error(int idx) {
+    if (!done_) {
+        Log::error("error communicating with client");
+        abort(false);
+    }
+}
+
+void Handshake::handle_timeout() {
+    if (held_ && !done_) {
+        held_ = false;
+        pass_on();
+    } else if (!done_) {
+        Log::info("handshake with client_fd=%d timed out waiting for its %s", fd_, phase_names[phase_]);
+        abort(true);
+    }
+}
+
+void Handshake::dump_stats() {
+    string timeouts;
+    string failures;
+    for (int phase = 0; phase < n_phases; phase++) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%s%s %lld", phase == 0 ? "" : ", ", phase_names[phase],
+                (long long) n_timeouts[phase]);
+        timeouts += buf;
+        snprintf(buf, sizeof(buf), "%s%s %lld", phase == 0 ? "" : ", ", phase_names[phase],
+                (long long) n_failures[phase]);
+        failures += buf;
+    }
+    Log::info("handshakes: %lld started, %d waiting for their client, %lld passed on to servers, %lld refused",
+            (long long) n_started, (int) n_active, (long long) n_passed_on, (long long) n_refused);
+    Log::info("handshakes timed out by phase: %s", timeouts.c_str());
+    Log::info("handshakes failed by phase: %s", failures.c_str());
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+#include "utils.h"
+#include "polling.h"
+#include "admission.h"
+
+/**
+ * Told when a client has sent its auth response, and the rest of the
+ * handshake (finding the route, talking to the server) can go on.
+ */
+class HandshakeListener {
+public:
+    virtual ~HandshakeListener() {
+    }
+
+    /**
+     * Takes over clnt_fd (nonblocking), and source, the admission account it
+     * holds. The whole handshake should be done by deadline_us. Called on a
+     * poll thread, so it must not block.
+     */
+    virtual void client_authenticating(int clnt_fd, SourceAccount* source, const unsigned char* challenge,
+            const unsigned char* response, rpc::i64 deadline_us) = 0;
+};
+
+/**
+ * The client side of a VNC handshake (RFB 3.8, VNC auth), up to the client's
+ * auth response. It runs on a poll thread as the client's messages come in,
+ * so a client that is slow or silent holds no thread, only its fd.
+ *
+ * Each phase (waiting for the client's version, security type, and auth
+ * response) must be done within phase_timeout_ms, and the whole handshake,
+ * server side included, within total_timeout_ms. The deadlines are kept with
+ * the PollMgr timer of the handshake.
+ *
+ * A client whose source keeps failing to log in is held after its auth
+ * response, on the same timer, for as long as Admission says, or told right
+ * away that its login failed.
+ */
+class Handshake: public rpc::Pollable {
+public:
+
+    enum {
+        VERSION = 0, SECURITY = 1, RESPONSE = 2, SERVER = 3, n_phases = 4
+    };
+
+private:
+
+    rpc::PollMgr* poll_;
+    HandshakeListener* listener_;
+    int fd_;
+    SourceAccount* source_;
+    int mode_;
+    int phase_;
+    rpc::i64 deadline_us_;
+
+    // finished or aborted, the fd is passed on or closed
+    bool done_;
+    bool passed_on_;
+    // waiting with the auth response, before it is passed on
+    bool held_;
+
+    // the message of the current phase, as far as it came in
+    unsigned char in_[16];
+    int in_len_;
+
+    // our last message, as far as it is not sent
+    unsigned char out_[16];
+    int out_len_;
+    int out_off_;
+
+    unsigned char challenge_[16];
+
+    static volatile int n_active;
+    static volatile rpc::i64 n_started;
+    static volatile rpc::i64 n_passed_on;
+    static volatile rpc::i64 n_refused;
+    static volatile rpc::i64 n_timeouts[n_phases];
+    static volatile rpc::i64 n_failures[n_phases];
+
+    Handshake(rpc::PollMgr* pmgr, HandshakeListener* listener, int clnt_fd, SourceAccount* source);
+
+    int in_size();
+    void send(const void* data, int size);
+    void flush();
+    void next_phase();
+    void arm_timer();
+    void check_auth();
+    void pass_on();
+    void refuse();
+    void abort(bool timed_out);
+
+protected:
+
+    // RefCounted object uses protected dtor to prevent accidental deletion
+    ~Handshake();
+
+public:
+
+    static int phase_timeout_ms;
+    static int total_timeout_ms;
+
+    /**
+     * Greet the client on clnt_fd, and go on as it answers. The connection
+     * holds source until it is closed, or passed on with it.
+     */
+    static void start(rpc::PollMgr* pmgr, HandshakeListener* listener, int clnt_fd, SourceAccount* source);
+
+    /**
+     * Count a handshake given up in a phase handled elsewhere (SERVER).
+     */
+    static void count_abort(int phase, bool timed_out);
+
+    // handshakes waiting for their client
+    static int active() {
+        return n_active;
+    }
+
+    /**
+     * Log handshakes in progress, and those aborted by phase.
+     */
+    static void dump_stats();
+
+    int fd(int idx) {
+        return fd_;
+    }
+
+    int poll_mode(int idx) {
+        return mode_;
+    }
+
+    void handle_read(int idx);
+    void handle_write(int idx);
+    void handle_error(int idx);
+    void handle_timeout();
+};
@@ -1,3 +1,14 @@
+#ifdef __linux__
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/errqueue.h>
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define USE_ZEROCOPY
+#endif
+#endif // __linux__
+
 #include "marshal.h"
 
 using namespace std;
@@ -10,9 +21,25 @@ namespace rpc {
  */
 const int Chunk::min_size = 8192;
 
+/**
+ * Upper bound of adaptive chunk size in Marshal::read_from_fd().
+ */
+const int Chunk::max_size = 256 * 1024;
+
+// 8k, 16k, ..., 256k
+volatile i64 Marshal::chunk_size_hist_[Marshal::n_chunk_size_buckets];
+
+void Marshal::drop_chunk(Chunk* c) {
+    if (zc_ != NULL && c->zc_pending_) {
+        zc_->retire(c);
+    } else {
+        delete c;
+    }
+}
+
 Marshal::~Marshal() {
     for (list<Chunk*>::iterator it = chunk_.begin(); it != chunk_.end(); ++it) {
-        delete *it;
+        drop_chunk(*it);
     }
 }
 
@@ -28,7 +55,7 @@ Marshal::Bookmark* Marshal::set_bookmark(int size) {
 
     for (int i = 0; i < bmark->size_; i++) {
         if (chunk_.empty() || chunk_.back()->fully_written()) {
-            chunk_.push_back(new Chunk);
+            push_chunk(new Chunk);
         }
         bmark->ptr_[i] = chunk_.back()->set_bookmark();
     }
@@ -48,7 +75,7 @@ int Marshal::write(const void* p, int n) {
     assert(chunk_.empty() || !chunk_.front()->fully_read());
 
     if (chunk_.empty() || chunk_.back()->fully_written()) {
-        chunk_.push_back(new Chunk(p, n));
+        push_chunk(new Chunk(p, n));
     } else {
         int n_write = chunk_.back()->write(p, n);
 
@@ -57,7 +84,7 @@ int Marshal::write(const void* p, int n) {
 
         if (n_write < n) {
             const char* pc = (const char *) p;
-            chunk_.push_back(new Chunk(pc + n_write, n - n_write));
+            push_chunk(new Chunk(pc + n_write, n - n_write));
         }
     }
 
@@ -74,8 +101,7 @@ int Marshal::read(void* p, int n) {
         int r = chunk_.front()->read(pc + n_read, n - n_read);
         if (chunk_.front()->fully_read()) {
             // remove fully read chunks, avoid unnecessary mem usage
-            delete chunk_.front();
-            chunk_.pop_front();
+            pop_chunk();
         }
         if (r == 0) {
             // currently there's no content for us to read, so stop.
@@ -119,12 +145,15 @@ int Marshal::write_to_fd(int fd) {
     assert(chunk_.empty() || !chunk_.front()->fully_read());
 
     int n_write = 0;
+    if (zc_ != NULL && zc_->enabled_ && content_size_gt(zc_->min_size_ - 1)) {
+        n_write = write_to_fd_zerocopy(fd);
+    }
+
     while (!chunk_.empty()) {
         int r = chunk_.front()->write_to_fd(fd);
         if (chunk_.front()->fully_read()) {
             // remove useless chunks when they are fully read
-            delete chunk_.front();
-            chunk_.pop_front();
+            pop_chunk();
         }
         if (r <= 0) {
             break;
@@ -132,11 +161,82 @@ int Marshal::write_to_fd(int fd) {
         n_write += r;
     }
 
+    if (chunk_.size() == 1 && chunk_.front()->content_size() == 0 && !(zc_ != NULL && zc_->busy(chunk_.front()))) {
+        // drained but not fully read, rewind it so that it can be reused from the start
+        chunk_.front()->read_idx_ = 0;
+        chunk_.front()->write_idx_ = 0;
+    }
+
     assert(chunk_.empty() || !chunk_.front()->fully_read());
 
     return n_write;
 }
 
+// send content of many chunks with one sendmsg(MSG_ZEROCOPY), stops when the socket is full
+int Marshal::write_to_fd_zerocopy(int fd) {
+    int n_write = 0;
+
+#ifdef USE_ZEROCOPY
+
+    static const int max_iov = 64;
+    while (!chunk_.empty()) {
+        struct iovec iov[max_iov];
+        int n_iov = 0;
+        int n_pending = 0;
+        for (list<Chunk*>::iterator it = chunk_.begin(); it != chunk_.end() && n_iov < max_iov; ++it) {
+            Chunk* c = *it;
+            if (c->content_size() > 0) {
+                iov[n_iov].iov_base = c->data_ + c->read_idx_;
+                iov[n_iov].iov_len = c->content_size();
+                n_pending += c->content_size();
+                n_iov++;
+            }
+        }
+        if (n_pending < zc_->min_size_) {
+            // not worth pinning pages for, leave the rest to plain write
+            break;
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n_iov;
+        int r = sendmsg(fd, &msg, MSG_ZEROCOPY);
+        if (r <= 0) {
+            // ENOBUFS if over the optmem limit, plain write will do
+            break;
+        }
+
+        u32 seq = zc_->next_seq_++;
+        __sync_add_and_fetch(&ZeroCopyQueue::n_sends, 1);
+        __sync_add_and_fetch(&ZeroCopyQueue::n_bytes, r);
+        n_write += r;
+
+        int left = r;
+        while (left > 0) {
+            Chunk* c = chunk_.front();
+            int n = min(left, c->content_size());
+            if (n > 0) {
+                c->zc_pending_ = true;
+                c->zc_seq_ = seq;
+                c->read_idx_ += n;
+                left -= n;
+            }
+            if (c->fully_read()) {
+                pop_chunk();
+            }
+        }
+
+        if (r < n_pending) {
+            break;
+        }
+    }
+
+#endif // USE_ZEROCOPY
+
+    return n_write;
+}
+
 string Marshal::dump() const {
     string s;
     s.reserve(this->content_size());
@@ -162,7 +262,8 @@ int Marshal::read_from_marshal(Marshal& m, int n) {
             if (head_size < n - n_read) {
 
                 // speed up: directly transfer chunk pointer, avoid memory copying
-                chunk_.push_back(m.chunk_.front());
+                push_chunk(m.chunk_.front());
+                m.storage_size_ -= m.chunk_.front()->size_;
                 m.chunk_.pop_front();
                 n_read += head_size;
 
@@ -170,15 +271,14 @@ int Marshal::read_from_marshal(Marshal& m, int n) {
                 continue;
 
             } else {
-                chunk_.push_back(new Chunk);
+                push_chunk(new Chunk);
             }
         }
         int r = chunk_.back()->read_from_chunk(*m.chunk_.front(), n - n_read);
 
         if (m.chunk_.front()->fully_read()) {
             // remove useless chunks when they are fully read
-            delete m.chunk_.front();
-            m.chunk_.pop_front();
+            m.pop_chunk();
         }
         if (r == 0) {
             // no more data to read
@@ -193,19 +293,46 @@ int Marshal::read_from_marshal(Marshal& m, int n) {
     return n_read;
 }
 
-int Marshal::read_from_fd(int fd) {
+int Marshal::read_from_fd(int fd, int max_size /* =... */) {
     assert(chunk_.empty() || !chunk_.front()->fully_read());
 
     int n_read = 0;
-    for (;;) {
+    while (max_size < 0 || n_read < max_size) {
+        bool new_chunk = false;
         if (chunk_.empty() || chunk_.back()->fully_written()) {
-            chunk_.push_back(new Chunk);
+            int size = chunk_size_;
+            if (max_size >= 0) {
+                // don't allocate much more than allowed to read
+                size = max(min(size, max_size - n_read), Chunk::min_size);
+            }
+            push_chunk(new Chunk(size));
+            new_chunk = true;
         }
         int r = chunk_.back()->read_from_fd(fd);
         if (r <= 0) {
+            if (new_chunk) {
+                // don't keep storage around for data that did not come
+                storage_size_ -= chunk_.back()->size_;
+                delete chunk_.back();
+                chunk_.pop_back();
+            }
             break;
         }
         n_read += r;
+        if (new_chunk) {
+            int bucket = 0;
+            while ((Chunk::min_size << bucket) < chunk_.back()->size_ && bucket < n_chunk_size_buckets - 1) {
+                bucket++;
+            }
+            __sync_add_and_fetch(&chunk_size_hist_[bucket], 1);
+        }
+    }
+
+    // grow for senders that fill whole chunks, shrink back for interactive traffic
+    if (n_read >= chunk_size_) {
+        chunk_size_ = min(chunk_size_ * 2, Chunk::max_size);
+    } else if (n_read < chunk_size_ / 4) {
+        chunk_size_ = max(chunk_size_ / 2, Chunk::min_size);
     }
 
     assert(chunk_.empty() || !chunk_.front()->fully_read());
@@ -234,4 +361,130 @@ int Marshal::content_size() const {
     return size;
 }
 
+int Marshal::shrink() {
+    if (content_size_gt(0)) {
+        return 0;
+    }
+    return clear();
+}
+
+int Marshal::clear() {
+    int freed = 0;
+    for (list<Chunk*>::iterator it = chunk_.begin(); it != chunk_.end(); ++it) {
+        freed += (*it)->size_;
+        drop_chunk(*it);
+    }
+    chunk_.clear();
+    storage_size_ = 0;
+    return freed;
+}
+
+volatile i64 ZeroCopyQueue::n_sends = 0;
+volatile i64 ZeroCopyQueue::n_bytes = 0;
+volatile i64 ZeroCopyQueue::n_copied = 0;
+volatile i64 ZeroCopyQueue::n_abandoned = 0;
+
+ZeroCopyQueue::ZeroCopyQueue(int min_size)
+        : min_size_(min_size), enabled_(true), next_seq_(0), n_done_(0), storage_size_(0) {
+}
+
+ZeroCopyQueue::~ZeroCopyQueue() {
+    for (list<Chunk*>::iterator it = retired_.begin(); it != retired_.end(); ++it) {
+        if (busy(*it)) {
+            // its pages might still go out on the wire, it must not hold another session's data
+            __sync_add_and_fetch(&n_abandoned, 1);
+        } else {
+            delete *it;
+        }
+    }
+}
+
+bool ZeroCopyQueue::enable(int fd) {
+#ifdef USE_ZEROCOPY
+    int one = 1;
+    return setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+#else
+    return false;
+#endif // USE_ZEROCOPY
+}
+
+void ZeroCopyQueue::retire(Chunk* c) {
+    if (busy(c)) {
+        retired_.push_back(c);
+        storage_size_ += c->size_;
+    } else {
+        delete c;
+    }
+}
+
+int ZeroCopyQueue::reap(int fd) {
+    int n_reaped = 0;
+
+#ifdef USE_ZEROCOPY
+
+    for (;;) {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE) < 0) {
+            break;
+        }
+        for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err* serr = (struct sock_extended_err *) CMSG_DATA(cm);
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0) {
+                return -1;
+            }
+            // sends [ee_info, ee_data] are done, TCP completes them in order
+            n_done_ = serr->ee_data + 1;
+            n_reaped++;
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                if (enabled_) {
+                    __sync_add_and_fetch(&n_copied, 1);
+                }
+                enabled_ = false;
+            }
+        }
+    }
+
+    while (!retired_.empty() && !busy(retired_.front())) {
+        storage_size_ -= retired_.front()->size_;
+        delete retired_.front();
+        retired_.pop_front();
+    }
+
+    // completions come as EPOLLERR too, tell them from a real error or hangup
+    int err = 0;
+    socklen_t len = sizeof(err);
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLRDHUP;
+    pfd.revents = 0;
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0
+            || (poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLRDHUP | POLLHUP | POLLNVAL)))) {
+        return -1;
+    }
+
+#endif // USE_ZEROCOPY
+
+    return n_reaped;
+}
+
+void Marshal::dump_chunk_stats() {
+    string hist;
+    for (int i = 0; i < n_chunk_size_buckets; i++) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%s%dk: %lld", i == 0 ? "" : ", ", (Chunk::min_size << i) / 1024,
+                (long long) chunk_size_hist_[i]);
+        hist += buf;
+    }
+    Log::info("chunks allocated for reads: %s", hist.c_str());
+}
+
+void ZeroCopyQueue::dump_stats() {
+    Log::info("zerocopy: %lld sends, %lld bytes, %lld sockets fell back to copying, %lld chunks abandoned",
+            (long long) n_sends, (long long) n_bytes, (long long) n_copied, (long long) n_abandoned);
+}
+
 }
@@ -10,16 +10,19 @@
 #include <unistd.h>
 
 #include "utils.h"
+#include "arena.h"
 
 namespace rpc {
 
 class Marshal;
+class ZeroCopyQueue;
 
 /**
  * Not thread safe, for better performance.
  */
 class Chunk: public NoCopy {
     friend class Marshal;
+    friend class ZeroCopyQueue;
 
     char* data_;
     int size_;
@@ -28,28 +31,56 @@ class Chunk: public NoCopy {
     int read_idx_;
     int write_idx_;
 
+    // set if sent with MSG_ZEROCOPY, the kernel may read it until send zc_seq_ completes
+    bool zc_pending_;
+    u32 zc_seq_;
+
+    // data_ is from BufferArena
+    bool arena_;
+
     static const int min_size;
+    static const int max_size;
+
+    void alloc_data() {
+        data_ = NULL;
+        arena_ = false;
+        if (BufferArena::enabled()) {
+            int slot_size;
+            data_ = BufferArena::alloc(size_, &slot_size);
+            if (data_ != NULL) {
+                size_ = slot_size;
+                arena_ = true;
+            }
+        }
+        if (data_ == NULL) {
+            data_ = new char[size_];
+        }
+    }
 
 public:
 
     Chunk(int size = Chunk::min_size)
-            : read_idx_(0), write_idx_(0) {
+            : read_idx_(0), write_idx_(0), zc_pending_(false), zc_seq_(0) {
         size_ = std::max(Chunk::min_size, size);
-        data_ = new char[size_];
+        alloc_data();
     }
 
     /**
      * Construct by copying a buffer.
      */
     Chunk(const void* p, int n)
-            : read_idx_(0), write_idx_(n) {
+            : read_idx_(0), write_idx_(n), zc_pending_(false), zc_seq_(0) {
         size_ = std::max(Chunk::min_size, n);
-        data_ = new char[size_];
+        alloc_data();
         memcpy(data_, p, n);
     }
 
     ~Chunk() {
-        delete[] data_;
+        if (arena_) {
+            BufferArena::free(data_, size_);
+        } else {
+            delete[] data_;
+        }
     }
 
     const char* content_ptr() const {
@@ -205,6 +236,31 @@ class Marshal: public NoCopy {
 
     std::list<Chunk*> chunk_;
     i32 write_counter_;
+    int storage_size_;
+    ZeroCopyQueue* zc_;
+
+    // size of chunks allocated by read_from_fd(), adapts to how much each call reads
+    int chunk_size_;
+
+    static const int n_chunk_size_buckets = 6;
+    static volatile i64 chunk_size_hist_[n_chunk_size_buckets];
+
+    void push_chunk(Chunk* c) {
+        storage_size_ += c->size_;
+        chunk_.push_back(c);
+    }
+
+    void pop_chunk() {
+        Chunk* c = chunk_.front();
+        storage_size_ -= c->size_;
+        chunk_.pop_front();
+        drop_chunk(c);
+    }
+
+    // delete a chunk no longer in chunk_, or hand it to zc_ if the kernel still uses it
+    void drop_chunk(Chunk* c);
+
+    int write_to_fd_zerocopy(int fd);
 
 public:
 
@@ -222,11 +278,11 @@ public:
     };
 
     Marshal()
-            : write_counter_(0) {
+            : write_counter_(0), storage_size_(0), zc_(NULL), chunk_size_(Chunk::min_size) {
     }
     Marshal(const std::string& data)
-            : write_counter_(0) {
-        chunk_.push_back(new Chunk(&data[0], data.length()));
+            : write_counter_(0), storage_size_(0), zc_(NULL), chunk_size_(Chunk::min_size) {
+        push_chunk(new Chunk(&data[0], data.length()));
     }
     ~Marshal();
 
@@ -247,9 +303,32 @@ public:
     int peek(void* p, int n) const;
 
     int read_from_marshal(Marshal&, int n);
-    int read_from_fd(int fd);
+    /**
+     * Read until the fd would block, or once at least max_size bytes were
+     * read (-1 for no limit).
+     *
+     * Chunks for the data grow from Chunk::min_size up to Chunk::max_size
+     * while calls keep reading more than a chunk, so bulk transfers use
+     * fewer, larger syscalls. They shrink back when calls read little.
+     */
+    int read_from_fd(int fd, int max_size = -1);
     int write_to_fd(int fd);
 
+    /**
+     * Send content with MSG_ZEROCOPY in write_to_fd(), when there is at least
+     * ZeroCopyQueue::min_size of it. Sent chunks are kept by zc until the
+     * kernel is done with them, also when the Marshal is cleared or
+     * destroyed, so zc must outlive it. NULL disables.
+     */
+    void set_zerocopy(ZeroCopyQueue* zc) {
+        zc_ = zc;
+    }
+
+    /**
+     * Log how many chunks read_from_fd() allocated of each size.
+     */
+    static void dump_chunk_stats();
+
     std::string dump() const;
 
     /**
@@ -263,6 +342,24 @@ public:
         return !content_size_gt(0);
     }
 
+    /**
+     * Bytes of chunk storage held, including space not holding content.
+     */
+    int storage_size() const {
+        return storage_size_;
+    }
+
+    /**
+     * Free all chunks if there is no content left, so an idle Marshal holds
+     * no storage. Returns number of bytes freed.
+     */
+    int shrink();
+
+    /**
+     * Drop all chunks, content included. Returns number of bytes freed.
+     */
+    int clear();
+
     void write_i32(const rpc::i32& v) {
         verify(write(&v, sizeof(v)) == sizeof(v));
     }
@@ -276,6 +373,80 @@ public:
     }
 };
 
+/**
+ * Chunks sent with MSG_ZEROCOPY on one socket, kept until the kernel
+ * reports through the socket error queue that it is done with them.
+ *
+ * Only available on Linux. If the kernel reports that it had to copy anyway
+ * (e.g. on loopback), zero copy is turned off for the socket, as it is then
+ * slower than a plain write.
+ *
+ * Not thread safe, for better performance.
+ */
+class ZeroCopyQueue: public NoCopy {
+    friend class Marshal;
+
+    int min_size_;
+    bool enabled_;
+
+    // sequence number of the next MSG_ZEROCOPY send, and number of sends completed
+    u32 next_seq_;
+    u32 n_done_;
+
+    // chunks no longer in a Marshal, in send order
+    std::list<Chunk*> retired_;
+    int storage_size_;
+
+    static volatile i64 n_sends;
+    static volatile i64 n_bytes;
+    static volatile i64 n_copied;
+    static volatile i64 n_abandoned;
+
+    bool done(u32 seq) const {
+        return (i32) (seq - n_done_) < 0;
+    }
+
+    bool busy(const Chunk* c) const {
+        return c->zc_pending_ && !done(c->zc_seq_);
+    }
+
+    void retire(Chunk* c);
+
+public:
+
+    ZeroCopyQueue(int min_size);
+
+    /**
+     * Chunks the kernel may still read from are never freed: once the
+     * socket is closed, their completions cannot be reaped any more, so
+     * they are abandoned (and counted) instead. Reap until idle() first.
+     */
+    ~ZeroCopyQueue();
+
+    /**
+     * Turn on SO_ZEROCOPY, returns false if not supported.
+     */
+    static bool enable(int fd);
+
+    /**
+     * Read completions from the error queue of fd, and free chunks the kernel
+     * is done with. Returns number of completions, or -1 if the socket had a
+     * real error or was hung up.
+     */
+    int reap(int fd);
+
+    int storage_size() const {
+        return storage_size_;
+    }
+
+    // no chunk left waiting for the kernel
+    bool idle() const {
+        return retired_.empty();
+    }
+
+    static void dump_stats();
+};
+
 } // namespace rpc
 
 // define marshaling operators in default namespace, so we can use them without using namespace rpc
@@ -8,9 +8,16 @@
 #include <sys/epoll.h>
 #endif
 
+#include <string>
+#include <vector>
+#include <algorithm>
+
 #include <unistd.h>
+#include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
+#include <sys/socket.h>
 
 #include "utils.h"
 #include "polling.h"
@@ -19,33 +26,115 @@ using namespace std;
 
 namespace rpc {
 
-class PollMgr::PollThread {
+// epoll/kqueue user data is the pollable pointer, with fd index in the low bits
+
+static inline void* poll_tag(Pollable* poll, int idx) {
+    return (void *) ((uintptr_t) poll | (uintptr_t) idx);
+}
+
+static inline Pollable* tag_pollable(void* tag) {
+    return (Pollable *) ((uintptr_t) tag & ~(uintptr_t) (Pollable::max_fds - 1));
+}
+
+static inline int tag_idx(void* tag) {
+    return (int) ((uintptr_t) tag & (uintptr_t) (Pollable::max_fds - 1));
+}
+
+// what a round of polling reported for one fd
+struct PollEvent {
+    Pollable* poll;
+    int idx;
+    int mode;
+    bool error;
+};
+
+/**
+ * Operations on a pollable return false if it is not registered with this
+ * thread (anymore), PollMgr then looks up its thread again.
+ */
+class PollThread {
 
-    // guard mode_ and poll_set_
+    PollMgr* mgr_;
+
+    // guard mode_, poll_set_, timers and draining_
     pthread_mutex_t m_;
     std::map<int, int> mode_;
     std::set<Pollable*> poll_set_;
     int poll_fd_;
 
+    // timers of the pollables
+    TimerWheel wheel_;
+
     std::set<Pollable*> pending_remove_;
     pthread_mutex_t pending_remove_m_;
 
+    // takes no new pollables, moves its own away and stops once empty
+    bool draining_;
+
+    i64 window_start_us_;
+
+    // current busy poll budget, adapted between 0 and PollMgr::busy_poll_us
+    int spin_us_;
+
+    // pollables whose handlers left fds ready (with their still_ready_ bits),
+    // handled again next round, each holds a reference
+    std::vector<std::pair<Pollable*, int> > ready_;
+
     pthread_t th_;
     bool stop_flag_;
 
     static void* start_poll_loop(void* arg) {
         PollThread* thiz = (PollThread *) arg;
+        if (thiz->cpu >= 0 && !pin_to_cpu(thiz->cpu)) {
+            Log::warn("cannot pin poll thread to cpu %d", thiz->cpu);
+        }
         thiz->poll_loop();
         pthread_exit(NULL);
         return NULL;
     }
 
     void poll_loop();
+    void dispatch(PollEvent* events, int n_events);
+    void handled(Pollable*, i64* handled_us);
+    void run_again(std::vector<std::pair<Pollable*, int> >& again, i64* handled_us);
+    void fire_timers();
+    int timer_wait_ms(int max_ms);
+    bool move_all_away();
+    void end_window();
+    void adapt_spin(bool woken);
+    void shed_load(std::vector<std::pair<i64, Pollable*> >& loads);
+
+    // caller must hold m_
+    void arm(Pollable*, int idx, int mode);
+    void disarm(int fd);
 
 public:
 
-    PollThread()
-            : stop_flag_(false) {
+    // pinned to, or -1
+    const int cpu;
+
+    // pollables registered, read without lock to pick threads
+    volatile int n_pollables;
+
+    // timers armed, read without lock for stats
+    volatile int n_timers;
+
+    // load over the last window, read by other threads to balance
+    volatile i64 window_us;
+    volatile i64 window_busy_us;
+    volatile i64 window_bytes;
+    volatile int n_moved_out;
+
+    // waits that found events while spinning
+    volatile i64 n_spin_hits;
+
+    // handlers that stopped at the io budget
+    volatile i64 n_requeued;
+
+    PollThread(PollMgr* mgr, int cpu)
+            : mgr_(mgr), wheel_(time_now_us() / 1000), draining_(false), window_start_us_(time_now_us()), spin_us_(PollMgr::busy_poll_us),
+              stop_flag_(false), cpu(cpu), n_pollables(0), n_timers(0), window_us(0), window_busy_us(0), window_bytes(0),
+              n_moved_out(0), n_spin_hits(0), n_requeued(0) {
         Pthread_mutex_init(&m_, NULL);
         Pthread_mutex_init(&pending_remove_m_, NULL);
 
@@ -57,7 +146,7 @@ public:
 
         verify(poll_fd_ != -1);
 
-        Pthread_create(&th_, NULL, PollMgr::PollThread::start_poll_loop, this);
+        Pthread_create(&th_, NULL, PollThread::start_poll_loop, this);
     }
 
     ~PollThread() {
@@ -75,23 +164,182 @@ public:
         Pthread_mutex_destroy(&pending_remove_m_);
     }
 
-    void add(Pollable*);
-    void remove(Pollable*);
-    void update_mode(Pollable*, int new_mode);
+    void drain() {
+        Pthread_mutex_lock(&m_);
+        draining_ = true;
+        Pthread_mutex_unlock(&m_);
+    }
+
+    // false if draining
+    bool add(Pollable*, int timer_ms);
+    bool remove(Pollable*);
+    bool update_mode(Pollable*, int idx, int new_mode);
+    bool set_timer(Pollable*, int delay_ms);
+    bool cancel_timer(Pollable*);
+
+    // only called by this thread's poll loop, false if not moved
+    bool migrate(Pollable*, PollThread* target);
 };
 
+int PollMgr::rebalance_ms = 1000;
+bool PollMgr::pin_cpus = false;
+int PollMgr::busy_poll_us = 0;
+int PollMgr::io_budget = 256 * 1024;
+
+TimerWheel::TimerWheel(i64 now_ms)
+        : now_ms_(now_ms), n_armed_(0) {
+    for (int level = 0; level < n_levels; level++) {
+        n_in_level_[level] = 0;
+        for (int i = 0; i < n_slots; i++) {
+            slots_[level][i].prev = &slots_[level][i];
+            slots_[level][i].next = &slots_[level][i];
+        }
+    }
+}
+
+void TimerWheel::arm(Timer* t, i64 due_ms) {
+    verify(!t->armed());
+    t->due_ms = max(due_ms, now_ms_ + 1);
+    place(t);
+    n_armed_++;
+}
+
+void TimerWheel::cancel(Timer* t) {
+    if (!t->armed()) {
+        return;
+    }
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = NULL;
+    t->next = NULL;
+    n_in_level_[t->level]--;
+    n_armed_--;
+}
+
+// link a timer into the slot for its due time, on the lowest level that reaches that far
+void TimerWheel::place(Timer* t) {
+    i64 due = t->due_ms;
+    int level = 0;
+    while (level < n_levels - 1 && due - now_ms_ >= (1LL << (slot_bits * (level + 1)))) {
+        level++;
+    }
+    if (due - now_ms_ >= (1LL << (slot_bits * n_levels))) {
+        // beyond the wheel, park it in the farthest slot, it is placed again from there
+        due = now_ms_ + (1LL << (slot_bits * n_levels)) - 1;
+    }
+
+    Timer* head = &slots_[level][(due >> (slot_bits * level)) & (n_slots - 1)];
+    t->level = level;
+    n_in_level_[level]++;
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+// spread the slot of a level that just came up over the levels below
+void TimerWheel::cascade(int level) {
+    int idx = (int) ((now_ms_ >> (slot_bits * level)) & (n_slots - 1));
+    Timer* head = &slots_[level][idx];
+    Timer* t = head->next;
+    head->prev = head;
+    head->next = head;
+    while (t != head) {
+        Timer* next = t->next;
+        n_in_level_[level]--;
+        place(t);
+        t = next;
+    }
+    if (idx == 0 && level + 1 < n_levels) {
+        cascade(level + 1);
+    }
+}
+
+void TimerWheel::advance(i64 now_ms, vector<Timer*>* expired) {
+    while (now_ms_ < now_ms) {
+        if (n_armed_ == 0) {
+            // nothing to cascade or fire, skip the ticks
+            now_ms_ = now_ms;
+            break;
+        }
+
+        // nothing happens before the next slot of the lowest level in use comes up
+        int level = 0;
+        while (n_in_level_[level] == 0) {
+            level++;
+        }
+        if (level > 0) {
+            i64 skip_to = now_ms_ | ((1LL << (slot_bits * level)) - 1);
+            if (skip_to >= now_ms) {
+                now_ms_ = now_ms;
+                break;
+            }
+            now_ms_ = skip_to;
+        }
+
+        now_ms_++;
+        int idx = (int) (now_ms_ & (n_slots - 1));
+        if (idx == 0) {
+            cascade(1);
+        }
+
+        Timer* head = &slots_[0][idx];
+        while (head->next != head) {
+            Timer* t = head->next;
+            cancel(t);
+            expired->push_back(t);
+        }
+    }
+}
+
+i64 TimerWheel::next_tick(int max_ms) const {
+    int offset = (int) (now_ms_ & (n_slots - 1));
+    int limit = max_ms;
+    for (int level = 1; level < n_levels; level++) {
+        if (n_in_level_[level] > 0) {
+            // the next cascade, where timers of higher levels come down
+            limit = min(limit, n_slots - offset);
+            break;
+        }
+    }
+    if (n_in_level_[0] > 0) {
+        for (int i = 1; i < limit && i < n_slots; i++) {
+            const Timer* head = &slots_[0][(offset + i) & (n_slots - 1)];
+            if (head->next != head) {
+                return now_ms_ + i;
+            }
+        }
+    }
+    return now_ms_ + limit;
+}
+
+// at most this many pollables are moved away by a thread per window
+static const int max_moves_per_window = 8;
+
 PollMgr::PollMgr(int n_threads /* =... */)
-        : n_(n_threads) {
-    poll_threads_ = new PollThread[n_];
-    //Log::debug("rpc::PollMgr: start with %d thread", n_);
+        : n_rx_placed_(0) {
+    Pthread_mutex_init(&m_, NULL);
+    Pthread_mutex_lock(&m_);
+    for (int i = 0; i < n_threads; i++) {
+        poll_threads_.push_back(new PollThread(this, pick_cpu()));
+    }
+    Pthread_mutex_unlock(&m_);
+    //Log::debug("rpc::PollMgr: start with %d thread", n_threads);
 }
 
 PollMgr::~PollMgr() {
-    delete[] poll_threads_;
+    // draining threads may still be moving pollables to the others
+    for (size_t i = 0; i < drained_.size(); i++) {
+        delete drained_[i];
+    }
+    for (size_t i = 0; i < poll_threads_.size(); i++) {
+        delete poll_threads_[i];
+    }
+    Pthread_mutex_destroy(&m_);
     //Log::debug("rpc::PollMgr: destroyed");
 }
 
-void PollMgr::PollThread::poll_loop() {
+void PollThread::poll_loop() {
     while (!stop_flag_) {
         const int max_nev = 100;
 
@@ -100,57 +348,95 @@ void PollMgr::PollThread::poll_loop() {
         struct kevent evlist[max_nev];
         struct timespec timeout;
         timeout.tv_sec = 0;
-        timeout.tv_nsec = 50 * 1000 * 1000; // 0.05 sec
-
-        int nev = kevent(poll_fd_, NULL, 0, evlist, max_nev, &timeout);
+        timeout.tv_nsec = timer_wait_ms(50) * 1000 * 1000; // 0.05 sec at most
+
+        struct timespec no_wait;
+        no_wait.tv_sec = 0;
+        no_wait.tv_nsec = 0;
+
+        int nev = 0;
+        if (!ready_.empty()) {
+            // handlers left work from the last round, only pick up what else came in
+            nev = kevent(poll_fd_, NULL, 0, evlist, max_nev, &no_wait);
+        } else {
+            if (spin_us_ > 0) {
+                // busy poll: check without blocking until something comes or the budget is spent
+                i64 spin_until = time_now_us() + spin_us_;
+                do {
+                    nev = kevent(poll_fd_, NULL, 0, evlist, max_nev, &no_wait);
+                } while (nev <= 0 && !stop_flag_ && time_now_us() < spin_until);
+                if (nev > 0) {
+                    n_spin_hits++;
+                }
+            }
+            if (nev <= 0) {
+                nev = kevent(poll_fd_, NULL, 0, evlist, max_nev, &timeout);
+                adapt_spin(nev > 0);
+            }
+        }
 
+        PollEvent events[max_nev];
         for (int i = 0; i < nev; i++) {
-            Pollable* poll = (Pollable *) evlist[i].udata;
-            verify(poll != NULL);
-
+            events[i].poll = tag_pollable(evlist[i].udata);
+            events[i].idx = tag_idx(evlist[i].udata);
+            events[i].mode = 0;
             if (evlist[i].filter == EVFILT_READ) {
-                poll->handle_read();
+                events[i].mode |= Pollable::READ;
             }
             if (evlist[i].filter == EVFILT_WRITE) {
-                poll->handle_write();
-            }
-
-            // handle error after handle IO, so that we can at least process something
-            if (evlist[i].flags & EV_EOF) {
-                poll->handle_error();
+                events[i].mode |= Pollable::WRITE;
             }
+            events[i].error = (evlist[i].flags & EV_EOF) != 0;
         }
 
 #else
 
         struct epoll_event evlist[max_nev];
-        int timeout = 50; // milli, 0.05 sec
-
-        int nev = epoll_wait(poll_fd_, evlist, max_nev, timeout);
+        int timeout = timer_wait_ms(50); // milli, 0.05 sec at most
+
+        int nev = 0;
+        if (!ready_.empty()) {
+            // handlers left work from the last round, only pick up what else came in
+            nev = epoll_wait(poll_fd_, evlist, max_nev, 0);
+        } else {
+            if (spin_us_ > 0) {
+                // busy poll: check without blocking until something comes or the budget is spent
+                i64 spin_until = time_now_us() + spin_us_;
+                do {
+                    nev = epoll_wait(poll_fd_, evlist, max_nev, 0);
+                } while (nev <= 0 && !stop_flag_ && time_now_us() < spin_until);
+                if (nev > 0) {
+                    n_spin_hits++;
+                }
+            }
+            if (nev <= 0) {
+                nev = epoll_wait(poll_fd_, evlist, max_nev, timeout);
+                adapt_spin(nev > 0);
+            }
+        }
 
         if (stop_flag_) {
             break;
         }
 
+        PollEvent events[max_nev];
         for (int i = 0; i < nev; i++) {
-            Pollable* poll = (Pollable *) evlist[i].data.ptr;
-            verify(poll != NULL);
-
+            events[i].poll = tag_pollable(evlist[i].data.ptr);
+            events[i].idx = tag_idx(evlist[i].data.ptr);
+            events[i].mode = 0;
             if (evlist[i].events & EPOLLIN) {
-                poll->handle_read();
+                events[i].mode |= Pollable::READ;
             }
             if (evlist[i].events & EPOLLOUT) {
-                poll->handle_write();
-            }
-
-            // handle error after handle IO, so that we can at least process something
-            if (evlist[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
-                poll->handle_error();
+                events[i].mode |= Pollable::WRITE;
             }
+            events[i].error = (evlist[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) != 0;
         }
 
 #endif
 
+        dispatch(events, nev);
+
         // after each poll loop, remove uninterested pollables
         Pthread_mutex_lock(&pending_remove_m_);
         list<Pollable*> remove_poll(pending_remove_.begin(), pending_remove_.end());
@@ -159,84 +445,203 @@ void PollMgr::PollThread::poll_loop() {
 
         for (list<Pollable*>::iterator it = remove_poll.begin(); it != remove_poll.end(); ++it) {
             Pollable* poll = *it;
-            int fd = poll->fd();
 
             Pthread_mutex_lock(&m_);
-            if (mode_.find(fd) == mode_.end()) {
-                // NOTE: only remove the fd when it is not immediately added again
-                // if the same fd is used again, mode_ will contains its info
-#ifdef USE_KQUEUE
-
-                struct kevent ev;
-
-                bzero(&ev, sizeof(ev));
-                ev.ident = fd;
-                ev.flags = EV_DELETE;
-                ev.filter = EVFILT_READ;
-                kevent(poll_fd_, &ev, 1, NULL, 0, NULL);
-
-                bzero(&ev, sizeof(ev));
-                ev.ident = fd;
-                ev.flags = EV_DELETE;
-                ev.filter = EVFILT_WRITE;
-                kevent(poll_fd_, &ev, 1, NULL, 0, NULL);
-
-#else
-                struct epoll_event ev;
-                memset(&ev, 0, sizeof(ev));
-
-                epoll_ctl(poll_fd_, EPOLL_CTL_DEL, fd, &ev);
-#endif
+            for (int idx = 0; idx < poll->n_fds(); idx++) {
+                int fd = poll->fd(idx);
+                if (mode_.find(fd) != mode_.end()) {
+                    // NOTE: only remove the fd when it is not immediately added again
+                    // if the same fd is used again, mode_ will contains its info
+                    continue;
+                }
+                disarm(fd);
             }
             Pthread_mutex_unlock(&m_);
 
             poll->release();
         }
+
+        fire_timers();
+
+        if (draining_ && move_all_away()) {
+            break;
+        }
+
+        // load is measured for stats even if not balanced
+        int window_ms = PollMgr::rebalance_ms > 0 ? PollMgr::rebalance_ms : 1000;
+        if (time_now_us() - window_start_us_ >= window_ms * 1000LL) {
+            end_window();
+        }
     }
 
     // when stopping, release anything registered in pollmgr
     for (set<Pollable*>::iterator it = poll_set_.begin(); it != poll_set_.end(); ++it) {
         (*it)->release();
     }
+    for (size_t i = 0; i < ready_.size(); i++) {
+        ready_[i].first->release();
+    }
 
     close(poll_fd_);
 }
 
-void PollMgr::PollThread::add(Pollable* poll) {
-    poll->ref_copy();   // increase ref count
+// handle the events of one round: urgent directions first (e.g. user input
+// stuck behind bulk updates), then the rest, then the handlers left over from
+// the last round
+void PollThread::dispatch(PollEvent* events, int n_events) {
+    vector<pair<Pollable*, int> > again;
+    again.swap(ready_);
+
+    // one clock read per event, handlers are charged for the time up to it
+    i64 handled_us = time_now_us();
+    for (int i = 0; i < n_events; i++) {
+        PollEvent& ev = events[i];
+        verify(ev.poll != NULL);
+        int urgent = ev.mode & ev.poll->urgent_mode(ev.idx);
+        if (urgent == 0) {
+            continue;
+        }
+        if (urgent & Pollable::READ) {
+            ev.poll->handle_read(ev.idx);
+        }
+        if (urgent & Pollable::WRITE) {
+            ev.poll->handle_write(ev.idx);
+        }
+        ev.mode &= ~urgent;
+        handled(ev.poll, &handled_us);
+    }
+
+    // pollables are only released after the round, so they are still alive
+    for (int i = 0; i < n_events; i++) {
+        PollEvent& ev = events[i];
+        if (ev.mode & Pollable::READ) {
+            ev.poll->handle_read(ev.idx);
+        }
+        if (ev.mode & Pollable::WRITE) {
+            ev.poll->handle_write(ev.idx);
+        }
+
+        // handle error after handle IO, so that we can at least process something
+        if (ev.error) {
+            ev.poll->handle_error(ev.idx);
+        }
+
+        if (ev.mode != 0 || ev.error) {
+            handled(ev.poll, &handled_us);
+        }
+    }
 
-    int poll_mode = poll->poll_mode();
-    int fd = poll->fd();
+    run_again(again, &handled_us);
+}
+
+// charge a pollable for the time up to now, and keep it for the next round if
+// its handlers left fds ready
+void PollThread::handled(Pollable* poll, i64* handled_us) {
+    i64 now = time_now_us();
+    poll->busy_us_ += now - *handled_us;
+    *handled_us = now;
+
+    if (poll->still_ready_ != 0) {
+        poll->ref_copy();
+        ready_.push_back(make_pair(poll, poll->still_ready_));
+        poll->still_ready_ = 0;
+        n_requeued++;
+    }
+}
+
+void PollThread::run_again(vector<pair<Pollable*, int> >& again, i64* handled_us) {
+    for (size_t i = 0; i < again.size(); i++) {
+        Pollable* poll = again[i].first;
+        // skip those removed, or moved away: arming on the other thread reported their fds
+        if (poll->poll_thread_ == this) {
+            for (int idx = 0; idx < poll->n_fds(); idx++) {
+                int mode = again[i].second >> (2 * idx);
+                if (mode & Pollable::READ) {
+                    poll->handle_read(idx);
+                }
+                if (mode & Pollable::WRITE) {
+                    poll->handle_write(idx);
+                }
+            }
+            handled(poll, handled_us);
+        }
+        poll->release();
+    }
+}
+
+// spin as long as configured while events keep coming, and half as long after
+// each spin that found nothing, so idle threads soon stop spinning at all
+void PollThread::adapt_spin(bool woken) {
+    if (PollMgr::busy_poll_us <= 0) {
+        return;
+    }
+    if (woken) {
+        spin_us_ = PollMgr::busy_poll_us;
+    } else {
+        spin_us_ /= 2;
+    }
+}
 
+// ask the kernel to busy poll the nic queue of a socket too, best effort: raising
+// it above net.core.busy_read needs CAP_NET_ADMIN, and fds might not be sockets
+static void set_busy_poll(int fd) {
+#ifdef SO_BUSY_POLL
+    int us = PollMgr::busy_poll_us;
+    setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us));
+#endif // SO_BUSY_POLL
+#ifdef SO_PREFER_BUSY_POLL
+    int prefer = 1;
+    setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer));
+#endif // SO_PREFER_BUSY_POLL
+}
+
+// move pollables to the least loaded running threads, true once none is left
+bool PollThread::move_all_away() {
     Pthread_mutex_lock(&m_);
+    list<Pollable*> polls(poll_set_.begin(), poll_set_.end());
+    Pthread_mutex_unlock(&m_);
 
-    // verify not exists
-    verify(poll_set_.find(poll) == poll_set_.end());
-    verify(mode_.find(fd) == mode_.end());
+    // pollables are only released by this thread, so they are still alive
+    for (list<Pollable*>::iterator it = polls.begin(); it != polls.end(); ++it) {
+        Pthread_mutex_lock(&mgr_->m_);
+        PollThread* target = mgr_->least_loaded();
+        Pthread_mutex_unlock(&mgr_->m_);
 
-    // register pollable
-    poll_set_.insert(poll);
-    mode_[fd] = poll_mode;
+        // if the target started draining too, try again next round
+        migrate(*it, target);
+    }
 
+    Pthread_mutex_lock(&m_);
+    bool empty = poll_set_.empty();
     Pthread_mutex_unlock(&m_);
 
+    Pthread_mutex_lock(&pending_remove_m_);
+    empty = empty && pending_remove_.empty();
+    Pthread_mutex_unlock(&pending_remove_m_);
+
+    return empty;
+}
+
+void PollThread::arm(Pollable* poll, int idx, int mode) {
+    int fd = poll->fd(idx);
+
 #ifdef USE_KQUEUE
 
     struct kevent ev;
-    if (poll_mode & Pollable::READ) {
+    if (mode & Pollable::READ) {
         bzero(&ev, sizeof(ev));
         ev.ident = fd;
         ev.flags = EV_ADD;
         ev.filter = EVFILT_READ;
-        ev.udata = poll;
+        ev.udata = poll_tag(poll, idx);
         verify(kevent(poll_fd_, &ev, 1, NULL, 0, NULL) == 0);
     }
-    if (poll_mode & Pollable::WRITE) {
+    if (mode & Pollable::WRITE) {
         bzero(&ev, sizeof(ev));
         ev.ident = fd;
         ev.flags = EV_ADD;
         ev.filter = EVFILT_WRITE;
-        ev.udata = poll;
+        ev.udata = poll_tag(poll, idx);
         verify(kevent(poll_fd_, &ev, 1, NULL, 0, NULL) == 0);
     }
 
@@ -245,45 +650,125 @@ void PollMgr::PollThread::add(Pollable* poll) {
     struct epoll_event ev;
     memset(&ev, 0, sizeof(ev));
 
-    ev.data.ptr = poll;
-    ev.events = EPOLLIN | EPOLLET | EPOLLRDHUP; // EPOLLERR and EPOLLHUP are included by default
-    if (poll_mode & Pollable::WRITE) {
+    ev.data.ptr = poll_tag(poll, idx);
+    ev.events = EPOLLET | EPOLLRDHUP; // EPOLLERR and EPOLLHUP are included by default
+    if (mode & Pollable::READ) {
+        ev.events |= EPOLLIN;
+    }
+    if (mode & Pollable::WRITE) {
         ev.events |= EPOLLOUT;
     }
-    verify(epoll_ctl(poll_fd_, EPOLL_CTL_ADD, fd, &ev) == 0);
+    if (epoll_ctl(poll_fd_, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        // the fd was removed from this thread but not yet disarmed, and is
+        // added again (e.g. a handshake passing its fd on to a session)
+        verify(errno == EEXIST);
+        verify(epoll_ctl(poll_fd_, EPOLL_CTL_MOD, fd, &ev) == 0);
+    }
 
 #endif
 }
 
-void PollMgr::PollThread::remove(Pollable* poll) {
-    bool found = false;
+void PollThread::disarm(int fd) {
+#ifdef USE_KQUEUE
+
+    struct kevent ev;
+
+    bzero(&ev, sizeof(ev));
+    ev.ident = fd;
+    ev.flags = EV_DELETE;
+    ev.filter = EVFILT_READ;
+    kevent(poll_fd_, &ev, 1, NULL, 0, NULL);
+
+    bzero(&ev, sizeof(ev));
+    ev.ident = fd;
+    ev.flags = EV_DELETE;
+    ev.filter = EVFILT_WRITE;
+    kevent(poll_fd_, &ev, 1, NULL, 0, NULL);
+
+#else
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+
+    epoll_ctl(poll_fd_, EPOLL_CTL_DEL, fd, &ev);
+#endif
+}
+
+bool PollThread::add(Pollable* poll, int timer_ms) {
+    int n_fds = poll->n_fds();
+    verify(n_fds >= 1 && n_fds <= Pollable::max_fds);
+    verify(tag_pollable(poll) == poll);
+
     Pthread_mutex_lock(&m_);
-    set<Pollable*>::iterator it = poll_set_.find(poll);
-    if (it != poll_set_.end()) {
-        found = true;
-        assert(mode_.find(poll->fd()) != mode_.end());
-        poll_set_.erase(poll);
-        mode_.erase(poll->fd());
-    } else {
-        assert(mode_.find(poll->fd()) == mode_.end());
+
+    if (draining_) {
+        Pthread_mutex_unlock(&m_);
+        return false;
     }
+
+    poll->ref_copy();   // increase ref count
+
+    // verify not exists
+    verify(poll_set_.find(poll) == poll_set_.end());
+    verify(poll->poll_thread_ == NULL);
+
+    // register pollable
+    poll_set_.insert(poll);
+    n_pollables++;
+    poll->poll_thread_ = this;
+    for (int idx = 0; idx < n_fds; idx++) {
+        int fd = poll->fd(idx);
+        verify(mode_.find(fd) == mode_.end());
+        mode_[fd] = poll->poll_mode(idx);
+    }
+
+    // armed with the lock held, so the pollable cannot be moved half armed
+    for (int idx = 0; idx < n_fds; idx++) {
+        arm(poll, idx, mode_[poll->fd(idx)]);
+        if (PollMgr::busy_poll_us > 0) {
+            set_busy_poll(poll->fd(idx));
+        }
+    }
+    if (timer_ms >= 0) {
+        wheel_.arm(&poll->timer_, time_now_us() / 1000 + timer_ms);
+        n_timers = wheel_.size();
+    }
+
     Pthread_mutex_unlock(&m_);
+    return true;
+}
 
-    if (found) {
-        Pthread_mutex_lock(&pending_remove_m_);
-        pending_remove_.insert(poll);
-        Pthread_mutex_unlock(&pending_remove_m_);
+bool PollThread::remove(Pollable* poll) {
+    Pthread_mutex_lock(&m_);
+    if (poll->poll_thread_ != this) {
+        Pthread_mutex_unlock(&m_);
+        return false;
     }
+
+    poll_set_.erase(poll);
+    n_pollables--;
+    poll->poll_thread_ = NULL;
+    wheel_.cancel(&poll->timer_);
+    n_timers = wheel_.size();
+    for (int idx = 0; idx < poll->n_fds(); idx++) {
+        assert(mode_.find(poll->fd(idx)) != mode_.end());
+        mode_.erase(poll->fd(idx));
+    }
+    Pthread_mutex_unlock(&m_);
+
+    Pthread_mutex_lock(&pending_remove_m_);
+    pending_remove_.insert(poll);
+    Pthread_mutex_unlock(&pending_remove_m_);
+    return true;
 }
 
-void PollMgr::PollThread::update_mode(Pollable* poll, int new_mode) {
-    int fd = poll->fd();
+bool PollThread::update_mode(Pollable* poll, int idx, int new_mode) {
+    int fd = poll->fd(idx);
 
     Pthread_mutex_lock(&m_);
 
-    if (poll_set_.find(poll) == poll_set_.end()) {
+    if (poll->poll_thread_ != this) {
         Pthread_mutex_unlock(&m_);
-        return;
+        return false;
     }
 
     map<int, int>::iterator it = mode_.find(fd);
@@ -300,7 +785,7 @@ void PollMgr::PollThread::update_mode(Pollable* poll, int new_mode) {
             // add READ
             bzero(&ev, sizeof(ev));
             ev.ident = fd;
-            ev.udata = poll;
+            ev.udata = poll_tag(poll, idx);
             ev.flags = EV_ADD;
             ev.filter = EVFILT_READ;
             verify(kevent(poll_fd_, &ev, 1, NULL, 0, NULL) == 0);
@@ -309,7 +794,7 @@ void PollMgr::PollThread::update_mode(Pollable* poll, int new_mode) {
             // del READ
             bzero(&ev, sizeof(ev));
             ev.ident = fd;
-            ev.udata = poll;
+            ev.udata = poll_tag(poll, idx);
             ev.flags = EV_DELETE;
             ev.filter = EVFILT_READ;
             verify(kevent(poll_fd_, &ev, 1, NULL, 0, NULL) == 0);
@@ -318,7 +803,7 @@ void PollMgr::PollThread::update_mode(Pollable* poll, int new_mode) {
             // add WRITE
             bzero(&ev, sizeof(ev));
             ev.ident = fd;
-            ev.udata = poll;
+            ev.udata = poll_tag(poll, idx);
             ev.flags = EV_ADD;
             ev.filter = EVFILT_WRITE;
             verify(kevent(poll_fd_, &ev, 1, NULL, 0, NULL) == 0);
@@ -327,7 +812,7 @@ void PollMgr::PollThread::update_mode(Pollable* poll, int new_mode) {
             // del WRITE
             bzero(&ev, sizeof(ev));
             ev.ident = fd;
-            ev.udata = poll;
+            ev.udata = poll_tag(poll, idx);
             ev.flags = EV_DELETE;
             ev.filter = EVFILT_WRITE;
             verify(kevent(poll_fd_, &ev, 1, NULL, 0, NULL) == 0);
@@ -338,7 +823,7 @@ void PollMgr::PollThread::update_mode(Pollable* poll, int new_mode) {
         struct epoll_event ev;
         memset(&ev, 0, sizeof(ev));
 
-        ev.data.ptr = poll;
+        ev.data.ptr = poll_tag(poll, idx);
         ev.events = EPOLLET | EPOLLRDHUP;
         if (new_mode & Pollable::READ) {
             ev.events |= EPOLLIN;
@@ -353,30 +838,360 @@ void PollMgr::PollThread::update_mode(Pollable* poll, int new_mode) {
     }
 
     Pthread_mutex_unlock(&m_);
+    return true;
+}
+
+bool PollThread::migrate(Pollable* poll, PollThread* target) {
+    if (target == this) {
+        return false;
+    }
+
+    // lock both threads, in a fixed order
+    PollThread* first = this < target ? this : target;
+    PollThread* second = this < target ? target : this;
+    Pthread_mutex_lock(&first->m_);
+    Pthread_mutex_lock(&second->m_);
+
+    bool moved = false;
+    if (poll->poll_thread_ == this && !target->draining_) {
+        if (poll->timer_.armed()) {
+            i64 due_ms = poll->timer_.due_ms;
+            wheel_.cancel(&poll->timer_);
+            target->wheel_.arm(&poll->timer_, due_ms);
+            n_timers = wheel_.size();
+            target->n_timers = target->wheel_.size();
+        }
+
+        poll_set_.erase(poll);
+        n_pollables--;
+        target->poll_set_.insert(poll);
+        target->n_pollables++;
+        poll->poll_thread_ = target;
+
+        // edge triggered events of data already buffered are reported again
+        // when armed on the target, so nothing is lost in between
+        for (int idx = 0; idx < poll->n_fds(); idx++) {
+            int fd = poll->fd(idx);
+            map<int, int>::iterator it = mode_.find(fd);
+            verify(it != mode_.end());
+            int mode = it->second;
+            mode_.erase(it);
+            disarm(fd);
+
+            verify(target->mode_.find(fd) == target->mode_.end());
+            target->mode_[fd] = mode;
+            target->arm(poll, idx, mode);
+        }
+
+        moved = true;
+    }
+
+    Pthread_mutex_unlock(&second->m_);
+    Pthread_mutex_unlock(&first->m_);
+    return moved;
+}
+
+bool PollThread::set_timer(Pollable* poll, int delay_ms) {
+    i64 due_ms = time_now_us() / 1000 + delay_ms;
+
+    Pthread_mutex_lock(&m_);
+    if (poll->poll_thread_ != this) {
+        Pthread_mutex_unlock(&m_);
+        return false;
+    }
+    wheel_.cancel(&poll->timer_);
+    wheel_.arm(&poll->timer_, due_ms);
+    n_timers = wheel_.size();
+    Pthread_mutex_unlock(&m_);
+    return true;
+}
+
+bool PollThread::cancel_timer(Pollable* poll) {
+    Pthread_mutex_lock(&m_);
+    if (poll->poll_thread_ != this) {
+        Pthread_mutex_unlock(&m_);
+        return false;
+    }
+    wheel_.cancel(&poll->timer_);
+    n_timers = wheel_.size();
+    Pthread_mutex_unlock(&m_);
+    return true;
 }
 
-void PollMgr::add(Pollable* poll) {
-    int fd = poll->fd();
-    if (fd >= 0) {
-        int tid = fd % n_;
-        poll_threads_[tid].add(poll);
+// how long the poll loop may sleep before a timer is due, at most max_ms
+int PollThread::timer_wait_ms(int max_ms) {
+    Pthread_mutex_lock(&m_);
+    i64 next = wheel_.next_tick(max_ms);
+    Pthread_mutex_unlock(&m_);
+    return (int) min(max(next - time_now_us() / 1000, (i64) 0), (i64) max_ms);
+}
+
+void PollThread::fire_timers() {
+    vector<TimerWheel::Timer*> expired;
+
+    Pthread_mutex_lock(&m_);
+    wheel_.advance(time_now_us() / 1000, &expired);
+    n_timers = wheel_.size();
+    Pthread_mutex_unlock(&m_);
+
+    // pollables are only released by this thread, so they are still alive
+    i64 handled_us = time_now_us();
+    for (size_t i = 0; i < expired.size(); i++) {
+        Pollable* poll = (Pollable *) expired[i]->data;
+        poll->handle_timeout();
+        handled(poll, &handled_us);
+    }
+}
+
+// publish the load of the window just ended, and move pollables away if too busy
+void PollThread::end_window() {
+    i64 now = time_now_us();
+    i64 len = now - window_start_us_;
+    window_start_us_ = now;
+
+    vector<pair<i64, Pollable*> > loads;
+    i64 busy = 0;
+    i64 bytes = 0;
+
+    Pthread_mutex_lock(&m_);
+    loads.reserve(poll_set_.size());
+    for (set<Pollable*>::iterator it = poll_set_.begin(); it != poll_set_.end(); ++it) {
+        Pollable* poll = *it;
+        i64 poll_busy = poll->busy_us_ - poll->busy_mark_;
+        busy += poll_busy;
+        bytes += poll->bytes_ - poll->bytes_mark_;
+        poll->busy_mark_ = poll->busy_us_;
+        poll->bytes_mark_ = poll->bytes_;
+        if (poll_busy > 0) {
+            loads.push_back(make_pair(poll_busy, poll));
+        }
+    }
+    Pthread_mutex_unlock(&m_);
+
+    window_us = len;
+    window_busy_us = busy;
+    window_bytes = bytes;
+
+    if (PollMgr::rebalance_ms > 0 && !draining_) {
+        shed_load(loads);
     }
 }
 
+void PollThread::shed_load(vector<pair<i64, Pollable*> >& loads) {
+    Pthread_mutex_lock(&mgr_->m_);
+    vector<PollThread*> threads = mgr_->poll_threads_;
+    Pthread_mutex_unlock(&mgr_->m_);
+
+    if (threads.size() < 2) {
+        return;
+    }
+    i64 total = 0;
+    for (size_t i = 0; i < threads.size(); i++) {
+        total += threads[i]->window_busy_us;
+    }
+    i64 avg = total / threads.size();
+    i64 mine = window_busy_us;
+
+    // heaviest first
+    sort(loads.begin(), loads.end());
+    reverse(loads.begin(), loads.end());
+
+    int n_moves = 0;
+    for (size_t i = 0; i < loads.size() && n_moves < max_moves_per_window; i++) {
+        // close enough to the average, or too little load to bother (under 5% of the window)
+        if (mine * 4 <= avg * 5 || mine - avg < window_us / 20) {
+            break;
+        }
+
+        PollThread* target = NULL;
+        for (size_t j = 0; j < threads.size(); j++) {
+            if (threads[j] != this && (target == NULL || threads[j]->window_busy_us < target->window_busy_us)) {
+                target = threads[j];
+            }
+        }
+        i64 load = loads[i].first;
+        i64 gap = mine - target->window_busy_us;
+        if (load * 4 > gap * 3) {
+            // would only move the busy spot, like an elephant session
+            continue;
+        }
+
+        // pollables are only released by this thread, so they are still alive
+        if (migrate(loads[i].second, target)) {
+            mine -= load;
+            window_busy_us = mine;
+            __sync_add_and_fetch(&target->window_busy_us, load);
+            __sync_add_and_fetch(&n_moved_out, 1);
+            n_moves++;
+        }
+    }
+}
+
+PollThread* PollMgr::least_loaded() {
+    verify(!poll_threads_.empty());
+    PollThread* best = poll_threads_[0];
+    for (size_t i = 1; i < poll_threads_.size(); i++) {
+        if (poll_threads_[i]->n_pollables < best->n_pollables) {
+            best = poll_threads_[i];
+        }
+    }
+    return best;
+}
+
+PollThread* PollMgr::thread_on_cpu(int cpu) {
+    PollThread* best = NULL;
+    for (size_t i = 0; i < poll_threads_.size(); i++) {
+        PollThread* thread = poll_threads_[i];
+        if (thread->cpu == cpu && (best == NULL || thread->n_pollables < best->n_pollables)) {
+            best = thread;
+        }
+    }
+    return best;
+}
+
+// the cpu with the fewest running poll threads, lowest first
+int PollMgr::pick_cpu() {
+    if (!pin_cpus) {
+        return -1;
+    }
+    int n = n_cpus();
+    vector<int> n_pinned(n, 0);
+    for (size_t i = 0; i < poll_threads_.size(); i++) {
+        int cpu = poll_threads_[i]->cpu;
+        if (cpu >= 0 && cpu < n) {
+            n_pinned[cpu]++;
+        }
+    }
+    int best = 0;
+    for (int cpu = 1; cpu < n; cpu++) {
+        if (n_pinned[cpu] < n_pinned[best]) {
+            best = cpu;
+        }
+    }
+    return best;
+}
+
+int PollMgr::n_threads() {
+    Pthread_mutex_lock(&m_);
+    int n = poll_threads_.size();
+    Pthread_mutex_unlock(&m_);
+    return n;
+}
+
+void PollMgr::add_thread() {
+    Pthread_mutex_lock(&m_);
+    poll_threads_.push_back(new PollThread(this, pick_cpu()));
+    int n = poll_threads_.size();
+    Pthread_mutex_unlock(&m_);
+    Log::info("started poll thread, %d running", n);
+}
+
+bool PollMgr::drain_thread() {
+    Pthread_mutex_lock(&m_);
+    if (poll_threads_.size() <= 1) {
+        Pthread_mutex_unlock(&m_);
+        return false;
+    }
+    PollThread* thread = poll_threads_.back();
+    poll_threads_.pop_back();
+    drained_.push_back(thread);
+    int n = poll_threads_.size();
+    Pthread_mutex_unlock(&m_);
+
+    // it moves its pollables away and stops by itself
+    thread->drain();
+    Log::info("draining poll thread, %d left", n);
+    return true;
+}
+
+void PollMgr::add(Pollable* poll, int timer_ms /* =... */) {
+    int fd = poll->fd(0);
+    if (fd < 0) {
+        return;
+    }
+    int rx_cpu = pin_cpus ? incoming_cpu(fd) : -1;
+    for (;;) {
+        Pthread_mutex_lock(&m_);
+        PollThread* thread = NULL;
+        if (rx_cpu >= 0) {
+            thread = thread_on_cpu(rx_cpu);
+        }
+        bool on_rx_cpu = thread != NULL;
+        if (thread == NULL) {
+            thread = least_loaded();
+        }
+        Pthread_mutex_unlock(&m_);
+
+        // refused if it just started draining
+        if (thread->add(poll, timer_ms)) {
+            if (on_rx_cpu) {
+                __sync_add_and_fetch(&n_rx_placed_, 1);
+            }
+            return;
+        }
+    }
+}
+
+// the pollable might be moved between looking up its thread and locking it, retry then
+
 void PollMgr::remove(Pollable* poll) {
-    int fd = poll->fd();
-    if (fd >= 0) {
-        int tid = fd % n_;
-        poll_threads_[tid].remove(poll);
+    for (;;) {
+        PollThread* thread = poll->poll_thread_;
+        if (thread == NULL || thread->remove(poll)) {
+            return;
+        }
+    }
+}
+
+void PollMgr::update_mode(Pollable* poll, int idx, int new_mode) {
+    for (;;) {
+        PollThread* thread = poll->poll_thread_;
+        if (thread == NULL || thread->update_mode(poll, idx, new_mode)) {
+            return;
+        }
     }
 }
 
-void PollMgr::update_mode(Pollable* poll, int new_mode) {
-    int fd = poll->fd();
-    if (fd >= 0) {
-        int tid = fd % n_;
-        poll_threads_[tid].update_mode(poll, new_mode);
+void PollMgr::set_timer(Pollable* poll, int delay_ms) {
+    for (;;) {
+        PollThread* thread = poll->poll_thread_;
+        if (thread == NULL || thread->set_timer(poll, delay_ms)) {
+            return;
+        }
     }
 }
 
+void PollMgr::cancel_timer(Pollable* poll) {
+    for (;;) {
+        PollThread* thread = poll->poll_thread_;
+        if (thread == NULL || thread->cancel_timer(poll)) {
+            return;
+        }
+    }
+}
+
+void PollMgr::dump_stats() {
+    Pthread_mutex_lock(&m_);
+    int n_draining = 0;
+    for (size_t i = 0; i < drained_.size(); i++) {
+        if (drained_[i]->n_pollables > 0) {
+            n_draining++;
+        }
+    }
+    Log::info("poll threads: %d running, %d draining, %lld sessions placed on their rx cpu",
+            (int) poll_threads_.size(), n_draining, (long long) n_rx_placed_);
+
+    for (size_t i = 0; i < poll_threads_.size(); i++) {
+        PollThread* thread = poll_threads_[i];
+        i64 window_us = thread->window_us;
+        double secs = window_us / 1000000.0;
+        Log::info("poll thread %d (cpu %d): %d pollables, %d timers, %.1f%% busy, %.0f bytes/s, %d moved away, "
+                "%lld wakeups by busy poll, %lld handlers yielded at io budget", (int) i, thread->cpu,
+                (int) thread->n_pollables, (int) thread->n_timers, window_us > 0 ? 100.0 * thread->window_busy_us / window_us : 0.0,
+                window_us > 0 ? thread->window_bytes / secs : 0.0, (int) thread->n_moved_out,
+                (long long) thread->n_spin_hits, (long long) thread->n_requeued);
+    }
+    Pthread_mutex_unlock(&m_);
+}
+
 }
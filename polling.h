@@ -2,36 +2,199 @@
 
 #include <map>
 #include <set>
+#include <vector>
 
 #include "utils.h"
 
 namespace rpc {
 
+class PollThread;
+
+/**
+ * Hashed hierarchical timer wheel, in ticks of 1 ms: 4 levels of 256 slots
+ * each, covering 256 ms, 65 s, 4.6 h and 49 days. Timers are kept in
+ * intrusive lists, so arming and cancelling are O(1) and allocate nothing.
+ * A timer is placed in the level matching how far away it is due, and
+ * moved down a level (cascaded) as its slot comes up, so the cost of
+ * advancing does not grow with the number of timers armed. Ticks are
+ * skipped while the lower levels are empty, so advancing over a long time
+ * costs little too.
+ *
+ * Not thread safe, each poll thread has its own, guarded by its lock.
+ */
+class TimerWheel: public NoCopy {
+public:
+
+    struct Timer {
+        Timer* prev;
+        Timer* next;
+        i64 due_ms;
+        int level;
+        void* data;
+
+        Timer()
+                : prev(NULL), next(NULL), due_ms(0), level(0), data(NULL) {
+        }
+
+        bool armed() const {
+            return next != NULL;
+        }
+    };
+
+    TimerWheel(i64 now_ms);
+
+    // timers due now or earlier fire on the next tick
+    void arm(Timer*, i64 due_ms);
+    void cancel(Timer*);
+
+    // move to now_ms, and unlink timers that are due into *expired
+    void advance(i64 now_ms, std::vector<Timer*>* expired);
+
+    // the earliest tick that might fire a timer, but no later than max_ms from
+    // the current one (a cascade might bring timers due sooner)
+    i64 next_tick(int max_ms) const;
+
+    int size() const {
+        return n_armed_;
+    }
+
+private:
+
+    enum {
+        slot_bits = 8, n_slots = 1 << slot_bits, n_levels = 4
+    };
+
+    // list heads
+    Timer slots_[n_levels][n_slots];
+    int n_in_level_[n_levels];
+    i64 now_ms_;
+    int n_armed_;
+
+    void place(Timer*);
+    void cascade(int level);
+};
+
+/**
+ * A pollable watches one or more fds (e.g. both sockets of a session), they
+ * are identified by their index in [0, n_fds()). All fds of a pollable are
+ * handled by the same poll thread, so handlers of one pollable never run
+ * concurrently with each other. A pollable may be moved to another poll
+ * thread, but only between two rounds of its old thread's poll loop.
+ */
 class Pollable: public RefCounted {
+    friend class PollThread;
+    friend class PollMgr;
+
+    // the poll thread it is registered with, only changed with that thread's lock held
+    PollThread* volatile poll_thread_;
+
+    // load, only touched by its poll thread: time spent in handlers, bytes
+    // counted by the handlers, and both at the start of the current window
+    i64 busy_us_;
+    i64 bytes_;
+    i64 busy_mark_;
+    i64 bytes_mark_;
+
+    // modes of each fd left ready by its handlers, 2 bits per fd index
+    int still_ready_;
+
+    // set with PollMgr::set_timer(), in its poll thread's wheel when armed
+    TimerWheel::Timer timer_;
+
 protected:
 
     virtual ~Pollable() {
     }
 
+    // handlers count the bytes they move, shown as load of their poll thread
+    void count_bytes(int n) {
+        bytes_ += n;
+    }
+
+    // all bytes counted so far, only read it on the poll thread
+    i64 bytes_counted() const {
+        return bytes_;
+    }
+
+    /**
+     * Called by a handler that stopped at PollMgr::io_budget while fd idx can
+     * still be read or written (mode). Edge triggered polling would not report
+     * it again, so the poll thread calls the handler again in its next round,
+     * after the other pollables had their turn.
+     */
+    void still_ready(int idx, int mode) {
+        still_ready_ |= mode << (2 * idx);
+    }
+
 public:
 
     enum {
         READ = 0x1, WRITE = 0x2
     };
 
-    virtual int fd() = 0;
-    virtual int poll_mode() = 0;
-    virtual void handle_read() = 0;
-    virtual void handle_write() = 0;
-    virtual void handle_error() = 0;
+    // fd index is packed into the low bits of the pointer given to epoll/kqueue
+    static const int max_fds = 4;
+
+    Pollable()
+            : poll_thread_(NULL), busy_us_(0), bytes_(0), busy_mark_(0), bytes_mark_(0), still_ready_(0) {
+        timer_.data = this;
+    }
+
+    virtual int n_fds() {
+        return 1;
+    }
+    virtual int fd(int idx) = 0;
+    virtual int poll_mode(int idx) = 0;
+    virtual void handle_read(int idx) = 0;
+    virtual void handle_write(int idx) = 0;
+    virtual void handle_error(int idx) = 0;
+
+    /**
+     * Directions (READ, WRITE) of fd idx whose events are handled before the
+     * others reported in the same round, like user input relayed next to
+     * bulk updates.
+     */
+    virtual int urgent_mode(int idx) {
+        return 0;
+    }
+
+    // called on the poll thread when the timer set with PollMgr::set_timer() expires
+    virtual void handle_timeout() {
+    }
 };
 
+/**
+ * Runs pollables on a set of poll threads. Threads can be added, or drained
+ * at runtime: the pollables of a draining thread are moved to the others
+ * before it stops.
+ *
+ * Each poll thread measures the time its pollables spend in handlers, over
+ * windows of rebalance_ms. A thread busier than the average by a quarter
+ * moves its heaviest pollables to the least busy thread, skipping those that
+ * would only make that thread the busy one. A single very heavy pollable
+ * thus ends up alone on its thread, as the lighter ones move away.
+ */
 class PollMgr: public RefCounted {
 
-    class PollThread;
+    friend class PollThread;
 
-    PollThread* poll_threads_;
-    int n_;
+    // guard poll_threads_ and drained_
+    pthread_mutex_t m_;
+
+    // threads taking new pollables
+    std::vector<PollThread*> poll_threads_;
+
+    // stopped threads, kept until destruction as pollables might still have
+    // been looked up on them
+    std::vector<PollThread*> drained_;
+
+    // sessions placed on the poll thread of their rx cpu
+    volatile i64 n_rx_placed_;
+
+    // caller must hold m_
+    PollThread* least_loaded();
+    PollThread* thread_on_cpu(int cpu);
+    int pick_cpu();
 
 protected:
 
@@ -40,11 +203,64 @@ protected:
 
 public:
 
+    // length of the load measuring window, 0 disables moving pollables for balance
+    static int rebalance_ms;
+
+    /**
+     * Pin each poll thread to its own cpu, and put new pollables on the
+     * thread pinned to the cpu that received their first fd's packets
+     * (SO_INCOMING_CPU), so relaying stays on the cpu and numa node of the
+     * nic queue. Set before creating the PollMgr.
+     */
+    static bool pin_cpus;
+
+    /**
+     * Before blocking, poll threads check for events without waiting for up
+     * to this many microseconds, which saves the wakeup latency for
+     * interactive traffic at the cost of cpu. Spinning halves after each
+     * round that found nothing, so idle threads block right away. Sockets
+     * also get SO_BUSY_POLL. 0 disables. Set before creating the PollMgr.
+     */
+    static int busy_poll_us;
+
+    /**
+     * Bytes a handler moves per event before yielding to the other pollables
+     * of its thread, see Pollable::still_ready(). Keeps a bulk transfer from
+     * delaying interactive sessions on the same thread. 0 is unlimited.
+     */
+    static int io_budget;
+
     PollMgr(int n_threads = 1);
 
-    void add(Pollable*);
+    int n_threads();
+
+    // start another poll thread, new pollables go to the least loaded thread
+    void add_thread();
+
+    /**
+     * Move all pollables off the newest poll thread, then stop it.
+     * Returns false if it is the last one.
+     */
+    bool drain_thread();
+
+    // with timer_ms >= 0, the timer is set too, before any handler can run
+    void add(Pollable*, int timer_ms = -1);
     void remove(Pollable*);
-    void update_mode(Pollable*, int new_mode);
+    void update_mode(Pollable*, int idx, int new_mode);
+
+    /**
+     * Each registered pollable has one timer. set_timer() (re)arms it to fire
+     * once after delay_ms, timers are dropped when the pollable is removed.
+     * Timers are kept in a TimerWheel per poll thread, so a timer on every
+     * session is cheap.
+     */
+    void set_timer(Pollable*, int delay_ms);
+    void cancel_timer(Pollable*);
+
+    /**
+     * Log pollables and load per poll thread.
+     */
+    void dump_stats();
 };
 
 }
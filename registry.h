@@ -0,0 +1,235 @@
+#pragma once
+
+#include <list>
+#include <map>
+#include <string>
+
+#include "utils.h"
+
+namespace rpc {
+
+/**
+ * Sessions grouped by key, e.g. all connections forwarded with one forward_key.
+ *
+ * Keys are hashed into shards, each with its own lock, so registering and
+ * unregistering sessions of different keys rarely contend. Each session
+ * embeds a Hook, which links it into the list of sessions of its key, so
+ * unregistering is O(1). Key strings are interned: all sessions of a key
+ * share one copy, which lives as long as any of them is registered.
+ *
+ * T must be a RefCounted.
+ * This is thread safe.
+ */
+template<class T>
+class SessionRegistry: public NoCopy {
+
+    struct Entry;
+
+public:
+
+    class Hook {
+        friend class SessionRegistry;
+
+        Hook* prev_;
+        Hook* next_;
+        Entry* entry_;
+        int shard_;
+        T* owner_;
+
+        // no copy, and no vtable (hooks are embedded in every session)
+        Hook(const Hook&);
+        const Hook& operator =(const Hook&);
+
+    public:
+
+        Hook(T* owner)
+                : prev_(NULL), next_(NULL), entry_(NULL), shard_(-1), owner_(owner) {
+        }
+
+        /**
+         * Only valid while registered.
+         */
+        const std::string& key() const {
+            verify(entry_ != NULL);
+            return entry_->key;
+        }
+    };
+
+private:
+
+    struct Entry {
+        std::string key;
+        // sentinel of a circular list of hooks
+        Hook head;
+        int size;
+
+        Entry(const std::string& k)
+                : key(k), head(NULL), size(0) {
+            head.prev_ = &head;
+            head.next_ = &head;
+        }
+    };
+
+    struct Shard {
+        pthread_mutex_t m;
+        std::map<std::string, Entry*> entries;
+        int size;
+    };
+
+    static const int n_shards = 64;
+    Shard shards_[n_shards];
+
+    static int shard_of(const std::string& key) {
+        // FNV-1a
+        unsigned int h = 2166136261u;
+        for (size_t i = 0; i < key.length(); i++) {
+            h ^= (unsigned char) key[i];
+            h *= 16777619u;
+        }
+        return h % n_shards;
+    }
+
+public:
+
+    SessionRegistry() {
+        for (int i = 0; i < n_shards; i++) {
+            Pthread_mutex_init(&shards_[i].m, NULL);
+            shards_[i].size = 0;
+        }
+    }
+
+    ~SessionRegistry() {
+        for (int i = 0; i < n_shards; i++) {
+            for (typename std::map<std::string, Entry*>::iterator it = shards_[i].entries.begin();
+                    it != shards_[i].entries.end(); ++it) {
+                delete it->second;
+            }
+            Pthread_mutex_destroy(&shards_[i].m);
+        }
+    }
+
+    void insert(Hook* hook, const std::string& key) {
+        int sid = shard_of(key);
+        Shard& shard = shards_[sid];
+
+        Pthread_mutex_lock(&shard.m);
+
+        verify(hook->entry_ == NULL);
+        Entry* entry;
+        typename std::map<std::string, Entry*>::iterator it = shard.entries.find(key);
+        if (it == shard.entries.end()) {
+            entry = new Entry(key);
+            shard.entries.insert(std::make_pair(key, entry));
+        } else {
+            entry = it->second;
+        }
+
+        hook->entry_ = entry;
+        hook->shard_ = sid;
+        hook->prev_ = entry->head.prev_;
+        hook->next_ = &entry->head;
+        entry->head.prev_->next_ = hook;
+        entry->head.prev_ = hook;
+        entry->size++;
+        shard.size++;
+
+        Pthread_mutex_unlock(&shard.m);
+    }
+
+    /**
+     * Returns false if the hook is not registered (e.g. already removed by
+     * another thread), so callers can use it to make teardown happen once.
+     */
+    bool remove(Hook* hook) {
+        int sid = hook->shard_;
+        if (sid < 0) {
+            return false;
+        }
+        Shard& shard = shards_[sid];
+
+        Pthread_mutex_lock(&shard.m);
+
+        Entry* entry = hook->entry_;
+        if (entry == NULL) {
+            Pthread_mutex_unlock(&shard.m);
+            return false;
+        }
+
+        hook->prev_->next_ = hook->next_;
+        hook->next_->prev_ = hook->prev_;
+        hook->prev_ = NULL;
+        hook->next_ = NULL;
+        hook->entry_ = NULL;
+        entry->size--;
+        shard.size--;
+
+        if (entry->size == 0) {
+            shard.entries.erase(entry->key);
+            delete entry;
+        }
+
+        Pthread_mutex_unlock(&shard.m);
+        return true;
+    }
+
+    /**
+     * Append all sessions registered with key to 'sessions', each with an
+     * extra reference that the caller must release().
+     * Returns number of sessions found.
+     */
+    int collect(const std::string& key, std::list<T*>* sessions) {
+        int n = 0;
+        Shard& shard = shards_[shard_of(key)];
+
+        Pthread_mutex_lock(&shard.m);
+        typename std::map<std::string, Entry*>::iterator it = shard.entries.find(key);
+        if (it != shard.entries.end()) {
+            Entry* entry = it->second;
+            for (Hook* h = entry->head.next_; h != &entry->head; h = h->next_) {
+                h->owner_->ref_copy();
+                sessions->push_back(h->owner_);
+                n++;
+            }
+        }
+        Pthread_mutex_unlock(&shard.m);
+
+        return n;
+    }
+
+    /**
+     * Like collect(), for sessions of all keys. Only locks one shard at a time,
+     * so this is not an atomic snapshot.
+     */
+    int collect_all(std::list<T*>* sessions) {
+        int n = 0;
+        for (int i = 0; i < n_shards; i++) {
+            Pthread_mutex_lock(&shards_[i].m);
+            for (typename std::map<std::string, Entry*>::iterator it = shards_[i].entries.begin();
+                    it != shards_[i].entries.end(); ++it) {
+                Entry* entry = it->second;
+                for (Hook* h = entry->head.next_; h != &entry->head; h = h->next_) {
+                    h->owner_->ref_copy();
+                    sessions->push_back(h->owner_);
+                    n++;
+                }
+            }
+            Pthread_mutex_unlock(&shards_[i].m);
+        }
+        return n;
+    }
+
+    /**
+     * Total number of registered sessions, only locks one shard at a time.
+     */
+    int size() {
+        int n = 0;
+        for (int i = 0; i < n_shards; i++) {
+            Pthread_mutex_lock(&shards_[i].m);
+            n += shards_[i].size;
+            Pthread_mutex_unlock(&shards_[i].m);
+        }
+        return n;
+    }
+};
+
+} // namespace rpc
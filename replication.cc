@@ -0,0 +1,430 @@
+#include <utility>
+#include <vector>
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "replication.h"
+
+using namespace std;
+using namespace rpc;
+
+const i32 Replication::magic = 0x56505234;  // "VPR4", routes with max_duration_s and rates, secret in hello
+const int Replication::heartbeat_interval_ms = 500;
+const int Replication::follower_timeout_ms = 3000;
+const int Replication::max_hello_size = 4096;
+// a snapshot of about 100k routes
+const int Replication::max_frame_size = 16 * 1024 * 1024;
+// each takes a thread, even before it sent its secret
+const int Replication::max_followers = 64;
+
+string Replication::secret;
+
+bool Replication::send_frame(int fd, Marshal& payload) {
+    Marshal frame;
+    i32 len = payload.content_size();
+    frame << len;
+    verify(frame.read_from_marshal(payload, len) == len);
+    while (!frame.empty()) {
+        if (frame.write_to_fd(fd) <= 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// read exactly n bytes, give up if no data comes in for timeout_ms, or stop_flag is set
+static bool recv_exact(int fd, char* p, int n, const bool* stop_flag, int timeout_ms) {
+    const int tick_ms = 100;
+    int idle_ms = 0;
+    while (n > 0) {
+        if (*stop_flag) {
+            return false;
+        }
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        int r = poll(&pfd, 1, tick_ms);
+        if (r == 0 || (r < 0 && errno == EINTR)) {
+            idle_ms += tick_ms;
+            if (idle_ms >= timeout_ms) {
+                return false;
+            }
+            continue;
+        }
+        if (r < 0) {
+            return false;
+        }
+        r = recv(fd, p, n, 0);
+        if (r <= 0) {
+            return false;
+        }
+        p += r;
+        n -= r;
+        idle_ms = 0;
+    }
+    return true;
+}
+
+static bool recv_frame(int fd, string* payload, int max_size, const bool* stop_flag, int timeout_ms) {
+    i32 len;
+    if (!recv_exact(fd, (char *) &len, sizeof(len), stop_flag, timeout_ms)) {
+        return false;
+    }
+    if (len <= 0 || len > max_size) {
+        Log::error("replication: bad frame length %d", len);
+        return false;
+    }
+    payload->resize(len);
+    return recv_exact(fd, &(*payload)[0], len, stop_flag, timeout_ms);
+}
+
+/**
+ * Reads a frame payload written by Marshal. Every read fails, instead of
+ * aborting like Marshal's operator >>, once the payload is too short, and no
+ * length is trusted beyond the bytes left.
+ */
+class FrameReader {
+    const string& buf_;
+    size_t pos_;
+
+public:
+    FrameReader(const string& buf)
+            : buf_(buf), pos_(0) {
+    }
+
+    size_t left() const {
+        return buf_.size() - pos_;
+    }
+
+    bool read(void* p, size_t n) {
+        if (n > left()) {
+            return false;
+        }
+        memcpy(p, buf_.data() + pos_, n);
+        pos_ += n;
+        return true;
+    }
+
+    bool read(i32* v) {
+        return read(v, sizeof(*v));
+    }
+
+    bool read(i64* v) {
+        return read(v, sizeof(*v));
+    }
+
+    bool read(string* v) {
+        i32 len;
+        if (!read(&len) || len < 0 || (size_t) len > left()) {
+            return false;
+        }
+        v->assign(buf_.data() + pos_, len);
+        pos_ += len;
+        return true;
+    }
+
+    bool read(Route* r) {
+        i32 has_dest_passwd;
+        if (!read(&r->forward_key) || !read(&r->dest_addr) || !read(&has_dest_passwd) || !read(&r->dest_passwd)
+                || !read(&r->max_duration_s) || !read(&r->session_rate) || !read(&r->route_rate)) {
+            return false;
+        }
+        r->has_dest_passwd = (has_dest_passwd != 0);
+        return true;
+    }
+
+    bool read(RouteChange* c) {
+        return read(&c->seq) && read(&c->op) && read(&c->route);
+    }
+
+    // min_size is the fewest bytes an element takes
+    template<class T>
+    bool read(vector<T>* v, size_t min_size) {
+        i32 len;
+        if (!read(&len) || len < 0 || (size_t) len > left() / min_size) {
+            return false;
+        }
+        v->clear();
+        v->reserve(len);
+        for (i32 i = 0; i < len; i++) {
+            T elem;
+            if (!read(&elem)) {
+                return false;
+            }
+            v->push_back(elem);
+        }
+        return true;
+    }
+};
+
+// 3 string lengths, has_dest_passwd, max_duration_s and 2 rates
+static const size_t min_route_size = 4 * 5 + 8 * 2;
+static const size_t min_change_size = 8 + 4 + min_route_size;
+
+// compares in a time that depends only on the length of expected
+static bool secret_matches(const string& given, const string& expected) {
+    unsigned char diff = (given.size() != expected.size()) ? 1 : 0;
+    for (size_t i = 0; i < expected.size(); i++) {
+        diff |= (unsigned char) expected[i] ^ (unsigned char) (i < given.size() ? given[i] : 0);
+    }
+    return diff == 0;
+}
+
+ReplicationPublisher::ReplicationPublisher(RouteTable* table)
+        : table_(table), server_sock_(-1), addr_result_(NULL), stop_flag_(false), n_followers_(0) {
+    Pthread_mutex_init(&m_, NULL);
+    Pthread_cond_init(&followers_done_, NULL);
+}
+
+ReplicationPublisher::~ReplicationPublisher() {
+    stop_flag_ = true;
+    if (server_sock_ >= 0) {
+        Pthread_join(th_, NULL);
+        close(server_sock_);
+        freeaddrinfo(addr_result_);
+    }
+
+    // followers will notice stop_flag_ within a heartbeat interval
+    Pthread_mutex_lock(&m_);
+    while (n_followers_ > 0) {
+        Pthread_cond_wait(&followers_done_, &m_);
+    }
+    Pthread_mutex_unlock(&m_);
+
+    Pthread_cond_destroy(&followers_done_);
+    Pthread_mutex_destroy(&m_);
+}
+
+int ReplicationPublisher::start(const char* bind_addr) {
+    struct addrinfo* rp;
+    server_sock_ = bind_on(bind_addr, &addr_result_, &rp);
+    if (server_sock_ < 0) {
+        return -1;
+    }
+    const struct sockaddr_in* sin = (const struct sockaddr_in *) rp->ai_addr;
+    bool loopback = (rp->ai_family == AF_INET && (ntohl(sin->sin_addr.s_addr) >> 24) == 127);
+    if (Replication::secret.empty() && !loopback) {
+        // snapshots carry every route password
+        Log::error("replication: refusing to publish on non-loopback %s without --publish-secret", bind_addr);
+        close(server_sock_);
+        server_sock_ = -1;
+        freeaddrinfo(addr_result_);
+        addr_result_ = NULL;
+        return -1;
+    }
+    Log::info("replication: publishing route changes on %s", bind_addr);
+    Pthread_create(&th_, NULL, ReplicationPublisher::start_accept_loop, this);
+    return 0;
+}
+
+void* ReplicationPublisher::start_accept_loop(void* arg) {
+    ReplicationPublisher* thiz = (ReplicationPublisher *) arg;
+    thiz->accept_loop();
+    pthread_exit(NULL);
+    return NULL;
+}
+
+void* ReplicationPublisher::start_serve_follower(void* args) {
+    pair<ReplicationPublisher*, int>* follower_args = (pair<ReplicationPublisher*, int>*) args;
+    ReplicationPublisher* thiz = follower_args->first;
+    int fd = follower_args->second;
+    delete follower_args;
+
+    thiz->serve_follower(fd);
+
+    Pthread_mutex_lock(&thiz->m_);
+    thiz->n_followers_--;
+    Pthread_cond_signal(&thiz->followers_done_);
+    Pthread_mutex_unlock(&thiz->m_);
+
+    pthread_exit(NULL);
+    return NULL;
+}
+
+void ReplicationPublisher::accept_loop() {
+    fd_set fds;
+    while (!stop_flag_) {
+        FD_ZERO(&fds);
+        FD_SET(server_sock_, &fds);
+
+        timeval tv;
+        tv.tv_sec = 0;
+        tv.tv_usec = 50 * 1000; // 0.05 sec
+
+        int n_ready = select(server_sock_ + 1, &fds, NULL, NULL, &tv);
+        if (n_ready <= 0 || stop_flag_) {
+            continue;
+        }
+
+        int fd = accept(server_sock_, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+
+        Pthread_mutex_lock(&m_);
+        bool full = (n_followers_ >= Replication::max_followers);
+        if (!full) {
+            n_followers_++;
+        }
+        Pthread_mutex_unlock(&m_);
+        if (full) {
+            Log::warn("replication: refusing follower fd=%d, already serving %d", fd, Replication::max_followers);
+            close(fd);
+            continue;
+        }
+
+        pair<ReplicationPublisher*, int>* follower_args = new pair<ReplicationPublisher*, int>(this, fd);
+        pthread_t th;
+        Pthread_create(&th, NULL, ReplicationPublisher::start_serve_follower, follower_args);
+        verify(pthread_detach(th) == 0);
+    }
+}
+
+void ReplicationPublisher::serve_follower(int fd) {
+    // don't let a stuck follower block us forever
+    struct timeval tv;
+    tv.tv_sec = Replication::follower_timeout_ms / 1000;
+    tv.tv_usec = (Replication::follower_timeout_ms % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    string payload;
+    if (!recv_frame(fd, &payload, Replication::max_hello_size, &stop_flag_, Replication::follower_timeout_ms)) {
+        close(fd);
+        return;
+    }
+
+    FrameReader hello(payload);
+    i32 type, magic;
+    i64 epoch, seq;
+    string secret;
+    if (!hello.read(&type) || !hello.read(&magic) || type != Replication::HELLO || magic != Replication::magic
+            || !hello.read(&epoch) || !hello.read(&seq) || !hello.read(&secret)) {
+        Log::error("replication: bad hello from follower fd=%d", fd);
+        close(fd);
+        return;
+    }
+    if (!secret_matches(secret, Replication::secret)) {
+        Log::error("replication: follower fd=%d gave a wrong secret", fd);
+        close(fd);
+        return;
+    }
+
+    Log::info("replication: follower fd=%d connected at seq %lld", fd, (long long) seq);
+
+    vector<RouteChange> changes;
+    vector<Route> routes;
+    while (!stop_flag_) {
+        Marshal m;
+        if (!table_->changes_since(epoch, seq, &changes, Replication::heartbeat_interval_ms)) {
+            table_->snapshot(&epoch, &seq, &routes);
+            m << (i32) Replication::SNAPSHOT << epoch << seq << routes;
+        } else if (changes.empty()) {
+            m << (i32) Replication::HEARTBEAT << seq;
+        } else {
+            seq = changes.back().seq;
+            m << (i32) Replication::CHANGES << changes;
+        }
+        if (m.content_size() > Replication::max_frame_size) {
+            Log::error("replication: %d bytes frame for follower fd=%d is over the limit of %d", m.content_size(), fd,
+                    Replication::max_frame_size);
+            break;
+        }
+        if (!Replication::send_frame(fd, m)) {
+            break;
+        }
+    }
+
+    Log::info("replication: follower fd=%d disconnected", fd);
+    close(fd);
+}
+
+ReplicationFollower::ReplicationFollower(RouteTable* table, const char* leader_addr)
+        : table_(table), leader_addr_(leader_addr), stop_flag_(false) {
+    Pthread_create(&th_, NULL, ReplicationFollower::start_follow_loop, this);
+}
+
+ReplicationFollower::~ReplicationFollower() {
+    stop_flag_ = true;
+    Pthread_join(th_, NULL);
+}
+
+void* ReplicationFollower::start_follow_loop(void* arg) {
+    ReplicationFollower* thiz = (ReplicationFollower *) arg;
+    thiz->follow_loop();
+    pthread_exit(NULL);
+    return NULL;
+}
+
+void ReplicationFollower::follow_loop() {
+    while (!stop_flag_) {
+        int fd = connect_to(leader_addr_.c_str());
+        if (fd >= 0) {
+            Log::info("replication: following %s", leader_addr_.c_str());
+            follow_once(fd);
+            close(fd);
+            if (!stop_flag_) {
+                Log::warn("replication: lost connection to %s, will retry", leader_addr_.c_str());
+            }
+        }
+        // retry after 1 sec
+        for (int i = 0; i < 10 && !stop_flag_; i++) {
+            usleep(100 * 1000);
+        }
+    }
+}
+
+bool ReplicationFollower::follow_once(int fd) {
+    Marshal hello;
+    hello << (i32) Replication::HELLO << Replication::magic << table_->epoch() << table_->seq() << Replication::secret;
+    if (!Replication::send_frame(fd, hello)) {
+        return false;
+    }
+
+    string payload;
+    while (recv_frame(fd, &payload, Replication::max_frame_size, &stop_flag_, Replication::follower_timeout_ms)) {
+        FrameReader m(payload);
+        i32 type;
+        if (!m.read(&type)) {
+            Log::error("replication: empty frame from the leader");
+            return false;
+        }
+        if (type == Replication::SNAPSHOT) {
+            i64 epoch, seq;
+            vector<Route> routes;
+            if (!m.read(&epoch) || !m.read(&seq) || !m.read(&routes, min_route_size)) {
+                Log::error("replication: malformed snapshot from the leader");
+                return false;
+            }
+            table_->load_snapshot(epoch, seq, routes);
+            Log::info("replication: loaded snapshot of %d routes at seq %lld", (int) routes.size(), (long long) seq);
+        } else if (type == Replication::CHANGES) {
+            vector<RouteChange> changes;
+            if (!m.read(&changes, min_change_size)) {
+                Log::error("replication: malformed changes from the leader");
+                return false;
+            }
+            for (vector<RouteChange>::iterator it = changes.begin(); it != changes.end(); ++it) {
+                if (!table_->apply(*it)) {
+                    // out of order, reconnect and catch up from the log or a snapshot
+                    Log::error("replication: change seq %lld does not follow seq %lld", (long long) it->seq,
+                            (long long) table_->seq());
+                    return false;
+                }
+            }
+            Log::debug("replication: applied %d changes, now at seq %lld", (int) changes.size(),
+                    (long long) table_->seq());
+        } else if (type != Replication::HEARTBEAT) {
+            Log::error("replication: unknown message type %d", type);
+            return false;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <string>
+
+#include "utils.h"
+#include "routes.h"
+
+/**
+ * Route replication across a fleet of vncproxy nodes.
+ *
+ * One node owns the sqlite db and publishes its RouteTable changes. Other
+ * nodes follow it: on connect they send the (epoch, seq) they already have,
+ * and get either the missing tail of the change log, or a full snapshot if
+ * the tail is no longer available. After that, changes are pushed as soon as
+ * they are made, with heartbeats in between.
+ *
+ * Wire format: every frame is an i32 length followed by a Marshal'ed payload,
+ * which starts with an i32 message type. Frames come from the network, so
+ * they are parsed with bounds checks rather than Marshal's operator >>: a
+ * malformed frame drops its connection, not the process.
+ *
+ * Snapshots carry every forward_key and dest_passwd in cleartext. Followers
+ * prove they know the shared secret in their HELLO, and a publisher without
+ * a secret only listens on loopback (for a tunnel in front of it). Connections
+ * beyond max_followers are closed before their HELLO is read.
+ */
+class Replication {
+public:
+    enum {
+        HELLO = 1, SNAPSHOT = 2, CHANGES = 3, HEARTBEAT = 4
+    };
+
+    static const rpc::i32 magic;
+    static const int heartbeat_interval_ms;
+    static const int follower_timeout_ms;
+    static const int max_hello_size;
+    static const int max_frame_size;
+    static const int max_followers;
+
+    // shared by the publisher and its followers, empty for none
+    static std::string secret;
+
+    static bool send_frame(int fd, rpc::Marshal& payload);
+};
+
+class ReplicationPublisher: public rpc::NoCopy {
+    RouteTable* table_;
+    int server_sock_;
+    struct addrinfo* addr_result_;
+
+    pthread_t th_;
+    bool stop_flag_;
+
+    // follower threads are detached, the destructor waits for n_followers_ to drop to 0
+    pthread_mutex_t m_;
+    pthread_cond_t followers_done_;
+    int n_followers_;
+
+    static void* start_accept_loop(void*);
+    static void* start_serve_follower(void*);
+
+    void accept_loop();
+    void serve_follower(int fd);
+
+public:
+    ReplicationPublisher(RouteTable* table);
+    ~ReplicationPublisher();
+
+    // returns 0 on success, -1 if cannot listen on bind_addr, or it is not
+    // loopback and there is no secret
+    int start(const char* bind_addr);
+};
+
+class ReplicationFollower: public rpc::NoCopy {
+    RouteTable* table_;
+    std::string leader_addr_;
+
+    pthread_t th_;
+    bool stop_flag_;
+
+    static void* start_follow_loop(void*);
+
+    void follow_loop();
+
+    // returns false when connection to the leader is broken
+    bool follow_once(int fd);
+
+public:
+    ReplicationFollower(RouteTable* table, const char* leader_addr);
+    ~ReplicationFollower();
+};
@@ -0,0 +1,232 @@
+#include <list>
+
+#include <time.h>
+#include <errno.h>
+
+#include "routes.h"
+
+using namespace std;
+using namespace rpc;
+
+/**
+ * Followers further behind than this will be resynced with a full snapshot.
+ */
+const int RouteTable::max_log_size = 4096;
+
+RouteTable::RouteTable(i64 epoch)
+        : epoch_(epoch), seq_(0), listener_(NULL) {
+    Pthread_mutex_init(&m_, NULL);
+    Pthread_cond_init(&changed_, NULL);
+}
+
+RouteTable::~RouteTable() {
+    Pthread_cond_destroy(&changed_);
+    Pthread_mutex_destroy(&m_);
+}
+
+void RouteTable::append_log(const RouteChange& c) {
+    log_.push_back(c);
+    while ((int) log_.size() > max_log_size) {
+        log_.pop_front();
+    }
+}
+
+int RouteTable::sync(const map<string, Route>& routes) {
+    list<string> removed;
+    int n_changes = 0;
+
+    Pthread_mutex_lock(&m_);
+
+    map<string, Route>::iterator it = routes_.begin();
+    while (it != routes_.end()) {
+        if (routes.find(it->first) == routes.end()) {
+            RouteChange c;
+            c.seq = ++seq_;
+            c.op = RouteChange::DEL;
+            c.route.forward_key = it->first;
+            append_log(c);
+            removed.push_back(it->first);
+            routes_.erase(it++);
+            n_changes++;
+        } else {
+            ++it;
+        }
+    }
+
+    for (map<string, Route>::const_iterator it = routes.begin(); it != routes.end(); ++it) {
+        map<string, Route>::iterator old = routes_.find(it->first);
+        if (old == routes_.end() || old->second != it->second) {
+            RouteChange c;
+            c.seq = ++seq_;
+            c.op = RouteChange::PUT;
+            c.route = it->second;
+            append_log(c);
+            routes_[it->first] = it->second;
+            n_changes++;
+        }
+    }
+
+    if (n_changes > 0) {
+        Pthread_cond_broadcast(&changed_);
+    }
+
+    Pthread_mutex_unlock(&m_);
+
+    if (listener_ != NULL) {
+        for (list<string>::iterator it = removed.begin(); it != removed.end(); ++it) {
+            listener_->route_removed(*it);
+        }
+    }
+
+    return n_changes;
+}
+
+bool RouteTable::apply(const RouteChange& c) {
+    bool removed = false;
+
+    Pthread_mutex_lock(&m_);
+    if (c.seq != seq_ + 1) {
+        Pthread_mutex_unlock(&m_);
+        return false;
+    }
+    seq_ = c.seq;
+    if (c.op == RouteChange::DEL) {
+        removed = (routes_.erase(c.route.forward_key) > 0);
+    } else {
+        routes_[c.route.forward_key] = c.route;
+    }
+    append_log(c);
+    Pthread_cond_broadcast(&changed_);
+    Pthread_mutex_unlock(&m_);
+
+    if (removed && listener_ != NULL) {
+        listener_->route_removed(c.route.forward_key);
+    }
+    return true;
+}
+
+void RouteTable::load_snapshot(i64 epoch, i64 seq, const vector<Route>& routes) {
+    map<string, Route> new_routes;
+    for (vector<Route>::const_iterator it = routes.begin(); it != routes.end(); ++it) {
+        new_routes[it->forward_key] = *it;
+    }
+
+    list<string> removed;
+
+    Pthread_mutex_lock(&m_);
+    for (map<string, Route>::iterator it = routes_.begin(); it != routes_.end(); ++it) {
+        if (new_routes.find(it->first) == new_routes.end()) {
+            removed.push_back(it->first);
+        }
+    }
+    routes_.swap(new_routes);
+    epoch_ = epoch;
+    seq_ = seq;
+    // changes before the snapshot are unknown to us
+    log_.clear();
+    Pthread_cond_broadcast(&changed_);
+    Pthread_mutex_unlock(&m_);
+
+    if (listener_ != NULL) {
+        for (list<string>::iterator it = removed.begin(); it != removed.end(); ++it) {
+            listener_->route_removed(*it);
+        }
+    }
+}
+
+void RouteTable::snapshot(i64* epoch, i64* seq, vector<Route>* routes) {
+    Pthread_mutex_lock(&m_);
+    *epoch = epoch_;
+    *seq = seq_;
+    routes->clear();
+    routes->reserve(routes_.size());
+    for (map<string, Route>::iterator it = routes_.begin(); it != routes_.end(); ++it) {
+        routes->push_back(it->second);
+    }
+    Pthread_mutex_unlock(&m_);
+}
+
+bool RouteTable::changes_since(i64 epoch, i64 seq, vector<RouteChange>* changes, int timeout_ms) {
+    changes->clear();
+
+    Pthread_mutex_lock(&m_);
+
+    if (epoch == epoch_ && seq == seq_ && timeout_ms > 0) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (timeout_ms % 1000) * 1000 * 1000;
+        if (deadline.tv_nsec >= 1000 * 1000 * 1000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000 * 1000 * 1000;
+        }
+        while (epoch == epoch_ && seq == seq_) {
+            int r = pthread_cond_timedwait(&changed_, &m_, &deadline);
+            if (r == ETIMEDOUT) {
+                break;
+            }
+            verify(r == 0);
+        }
+    }
+
+    bool ok = true;
+    if (epoch != epoch_ || seq > seq_) {
+        ok = false;
+    } else if (seq < seq_) {
+        if (log_.empty() || log_.front().seq > seq + 1) {
+            ok = false;
+        } else {
+            for (deque<RouteChange>::iterator it = log_.begin(); it != log_.end(); ++it) {
+                if (it->seq > seq) {
+                    changes->push_back(*it);
+                }
+            }
+        }
+    }
+
+    Pthread_mutex_unlock(&m_);
+    return ok;
+}
+
+void RouteTable::scan(int (*callback)(void*, const Route&), void* cb_args) {
+    Pthread_mutex_lock(&m_);
+    for (map<string, Route>::iterator it = routes_.begin(); it != routes_.end(); ++it) {
+        if (callback(cb_args, it->second) != 0) {
+            break;
+        }
+    }
+    Pthread_mutex_unlock(&m_);
+}
+
+bool RouteTable::lookup(const string& forward_key, Route* route) {
+    bool found = false;
+    Pthread_mutex_lock(&m_);
+    map<string, Route>::iterator it = routes_.find(forward_key);
+    if (it != routes_.end()) {
+        *route = it->second;
+        found = true;
+    }
+    Pthread_mutex_unlock(&m_);
+    return found;
+}
+
+i64 RouteTable::epoch() {
+    Pthread_mutex_lock(&m_);
+    i64 r = epoch_;
+    Pthread_mutex_unlock(&m_);
+    return r;
+}
+
+i64 RouteTable::seq() {
+    Pthread_mutex_lock(&m_);
+    i64 r = seq_;
+    Pthread_mutex_unlock(&m_);
+    return r;
+}
+
+int RouteTable::size() {
+    Pthread_mutex_lock(&m_);
+    int r = routes_.size();
+    Pthread_mutex_unlock(&m_);
+    return r;
+}
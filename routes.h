@@ -0,0 +1,158 @@
+#pragma once
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "utils.h"
+#include "marshal.h"
+
+struct Route {
+    std::string forward_key;
+    std::string dest_addr;
+    bool has_dest_passwd;
+    std::string dest_passwd;
+
+    // sessions are closed after this long, 0 for Session::max_duration_s
+    rpc::i32 max_duration_s;
+
+    // bytes per second relayed to the client of each session, and to all
+    // clients of the route together, 0 for Session::session_rate and route_rate
+    rpc::i64 session_rate;
+    rpc::i64 route_rate;
+
+    Route()
+            : has_dest_passwd(false), max_duration_s(0), session_rate(0), route_rate(0) {
+    }
+
+    bool operator ==(const Route& o) const {
+        return forward_key == o.forward_key && dest_addr == o.dest_addr && has_dest_passwd == o.has_dest_passwd
+                && dest_passwd == o.dest_passwd && max_duration_s == o.max_duration_s
+                && session_rate == o.session_rate && route_rate == o.route_rate;
+    }
+    bool operator !=(const Route& o) const {
+        return !(*this == o);
+    }
+};
+
+struct RouteChange {
+    enum {
+        PUT = 1, DEL = 2
+    };
+
+    rpc::i64 seq;
+    rpc::i32 op;
+    Route route;    // only forward_key is meaningful for DEL
+
+    RouteChange()
+            : seq(0), op(PUT) {
+    }
+};
+
+/**
+ * Notified when routes are removed, so that sessions using them can be closed.
+ * Called without holding any RouteTable lock.
+ */
+class RouteListener {
+public:
+    virtual ~RouteListener() {
+    }
+    virtual void route_removed(const std::string& forward_key) = 0;
+};
+
+/**
+ * In-memory routing table, plus a bounded log of recent changes.
+ *
+ * Every change is assigned a sequence number. The node owning the sqlite db
+ * generates changes with sync(), followers replay them with apply() or reload
+ * with load_snapshot(). Within one epoch (a run of the publishing node),
+ * snapshot() at seq S followed by changes_since(S) gives a consistent view.
+ *
+ * This is thread safe.
+ */
+class RouteTable: public rpc::NoCopy {
+    pthread_mutex_t m_;
+    pthread_cond_t changed_;
+
+    std::map<std::string, Route> routes_;
+    rpc::i64 epoch_;
+    rpc::i64 seq_;
+    std::deque<RouteChange> log_;
+
+    RouteListener* listener_;
+
+    static const int max_log_size;
+
+    // caller must hold m_
+    void append_log(const RouteChange& c);
+
+public:
+
+    RouteTable(rpc::i64 epoch);
+    ~RouteTable();
+
+    void set_listener(RouteListener* l) {
+        listener_ = l;
+    }
+
+    /**
+     * Make the table match 'routes', generating PUT/DEL changes for the difference.
+     * Returns number of changes generated.
+     */
+    int sync(const std::map<std::string, Route>& routes);
+
+    /**
+     * Replay a change from the publisher.
+     * Returns false if the change does not follow our current seq, in which
+     * case the caller should resync from a snapshot.
+     */
+    bool apply(const RouteChange& c);
+
+    void load_snapshot(rpc::i64 epoch, rpc::i64 seq, const std::vector<Route>& routes);
+    void snapshot(rpc::i64* epoch, rpc::i64* seq, std::vector<Route>* routes);
+
+    /**
+     * Collect changes after 'seq', waiting up to timeout_ms if there is none yet.
+     * Returns false if they cannot be served from the log (different epoch, or
+     * the log has been truncated), a snapshot is needed then.
+     */
+    bool changes_since(rpc::i64 epoch, rpc::i64 seq, std::vector<RouteChange>* changes, int timeout_ms);
+
+    /**
+     * Invoke callback on every route, stops when callback returns non-zero.
+     * Callback is called with the table locked, so it must not call back into
+     * the table.
+     */
+    void scan(int (*callback)(void*, const Route&), void* cb_args);
+
+    bool lookup(const std::string& forward_key, Route* route);
+
+    rpc::i64 epoch();
+    rpc::i64 seq();
+    int size();
+};
+
+inline rpc::Marshal& operator <<(rpc::Marshal& m, const Route& r) {
+    m << r.forward_key << r.dest_addr << (rpc::i32) r.has_dest_passwd << r.dest_passwd << r.max_duration_s
+            << r.session_rate << r.route_rate;
+    return m;
+}
+
+inline rpc::Marshal& operator >>(rpc::Marshal& m, Route& r) {
+    rpc::i32 has_dest_passwd;
+    m >> r.forward_key >> r.dest_addr >> has_dest_passwd >> r.dest_passwd >> r.max_duration_s >> r.session_rate
+            >> r.route_rate;
+    r.has_dest_passwd = (has_dest_passwd != 0);
+    return m;
+}
+
+inline rpc::Marshal& operator <<(rpc::Marshal& m, const RouteChange& c) {
+    m << c.seq << c.op << c.route;
+    return m;
+}
+
+inline rpc::Marshal& operator >>(rpc::Marshal& m, RouteChange& c) {
+    m >> c.seq >> c.op >> c.route;
+    return m;
+}
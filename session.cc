@@ -0,0 +1,764 @@
+#include <list>
+#include <vector>
+
+#include <limits.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "session.h"
+
+using namespace std;
+using namespace rpc;
+
+SessionRegistry<Session> Session::all_sessions;
+
+/**
+ * Max bytes moved by each read() in the relay loop.
+ */
+const int Session::relay_buf_size = 64 * 1024;
+
+/**
+ * How often a session with paused reads checks if it may read again.
+ */
+const int Session::pause_recheck_ms = 50;
+// how long a closed session waits for the kernel to finish its zero copy sends
+const int Session::zerocopy_drain_ms = 30 * 1000;
+
+int Session::buffer_linger_ms = 1000;
+
+int Session::zerocopy_min_size = 0;
+
+bool Session::input_first = true;
+
+int Session::idle_timeout_s = 0;
+
+int Session::max_duration_s = 0;
+
+int Session::keepalive_s = 0;
+
+i64 Session::session_rate = 0;
+
+i64 Session::route_rate = 0;
+
+i64 Session::rate_burst = 256 * 1024;
+
+volatile i64 Session::n_shaped_bytes = 0;
+volatile i64 Session::n_rate_waits = 0;
+
+// bytes one event may move before the session yields, see PollMgr::io_budget
+static int io_budget() {
+    return PollMgr::io_budget > 0 ? PollMgr::io_budget : INT_MAX;
+}
+
+Session::Session(PollMgr* pmgr, BufferAccount* account, SourceAccount* source, int clnt_fd, int server_fd)
+        : poll_(pmgr), resident_(0), last_drain_us_(0), linger_armed_(false), timer_due_us_(0), end_us_(0),
+          last_active_us_(0), active_mark_(0), account_(account), source_(source),
+          throttled_(0), session_rate_(0), route_rate_(0), rate_wait_(false), shaped_bytes_(0), closed_(0),
+          hook_(this) {
+    fd_[CLIENT] = clnt_fd;
+    fd_[SERVER] = server_fd;
+    mode_[CLIENT] = Pollable::READ;
+    mode_[SERVER] = Pollable::READ;
+    paused_[CLIENT] = 0;
+    paused_[SERVER] = 0;
+    spill_[CLIENT] = NULL;
+    spill_[SERVER] = NULL;
+
+    sockmap_slot_ = -1;
+
+    zc_ = NULL;
+    zc_drain_until_us_ = 0;
+    if (zerocopy_min_size > 0 && ZeroCopyQueue::enable(clnt_fd)) {
+        zc_ = new ZeroCopyQueue(zerocopy_min_size);
+        out_[CLIENT].set_zerocopy(zc_);
+    }
+}
+
+Session::~Session() {
+    // fds are only closed here, after PollMgr dropped them, so they cannot be
+    // reused by new connections while still registered
+    close(fd_[CLIENT]);
+    close(fd_[SERVER]);
+    delete spill_[CLIENT];
+    delete spill_[SERVER];
+    if (zc_ != NULL) {
+        // chunks still busy (only if draining timed out, or at exit) are abandoned, not freed
+        out_[CLIENT].clear();
+        out_[CLIENT].set_zerocopy(NULL);
+        delete zc_;
+    }
+
+    MemoryGovernor::charge(account_, -resident_);
+    MemoryGovernor::put_account(account_);
+    Admission::leave(source_);
+}
+
+// let the kernel probe a quiet peer, so a half-open connection errors out instead of lingering
+static void set_keepalive(int fd, int idle_s) {
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+#ifdef TCP_KEEPIDLE
+    int interval = max(idle_s / 3, 1);
+    int count = 3;
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle_s, sizeof(idle_s));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+#endif // TCP_KEEPIDLE
+#ifdef TCP_USER_TIMEOUT
+    // also give up on data the peer does not ack for as long
+    unsigned int user_timeout_ms = 2 * idle_s * 1000;
+    setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout_ms, sizeof(user_timeout_ms));
+#endif // TCP_USER_TIMEOUT
+}
+
+void Session::start(PollMgr* pmgr, const Route& route, int clnt_fd, int server_fd, SourceAccount* source) {
+    const string& forward_key = route.forward_key;
+    Session* sess = new Session(pmgr, MemoryGovernor::get_account(forward_key), source, clnt_fd, server_fd);
+
+    sess->session_rate_ = route.session_rate > 0 ? route.session_rate : session_rate;
+    sess->route_rate_ = route.route_rate > 0 ? route.route_rate : route_rate;
+    if (sess->session_rate_ > 0) {
+        sess->rate_.set(sess->session_rate_, rate_burst);
+    }
+    if (sess->route_rate_ > 0) {
+        // the latest route limit applies to all of its sessions
+        BufferAccount* account = sess->account_;
+        Pthread_mutex_lock(&account->rate_m);
+        account->rate.set(sess->route_rate_, rate_burst);
+        Pthread_mutex_unlock(&account->rate_m);
+    }
+
+    // the handshake is lock-step: nobody sends until the client gets the server's
+    // reply, which, if already here, is picked up below once the fds are polled
+    sess->sockmap_slot_ = sess->shaped() ? -1 : SockMap::insert(clnt_fd, server_fd);
+
+    if (keepalive_s > 0) {
+        set_keepalive(clnt_fd, keepalive_s);
+        set_keepalive(server_fd, keepalive_s);
+    }
+
+    // from here on the timer is only touched on the poll thread, so it is armed along with adding
+    i64 now = time_now_us();
+    int duration_s = route.max_duration_s > 0 ? route.max_duration_s : max_duration_s;
+    if (duration_s > 0) {
+        sess->end_us_ = now + duration_s * 1000000LL;
+    }
+    sess->last_active_us_ = now;
+    sess->arm_deadlines(now);
+    int timer_ms = -1;
+    if (sess->timer_due_us_ != 0) {
+        timer_ms = (int) min((sess->timer_due_us_ - now) / 1000, (i64) INT_MAX);
+    }
+
+    // hold a ref while publishing the session, it might be shut down any time after that
+    sess->ref_copy();
+
+    all_sessions.insert(&sess->hook_, forward_key);
+    pmgr->add(sess, timer_ms);
+    if (sess->closed_) {
+        // revoked before added to pollmgr, so shutdown() could not remove it
+        pmgr->remove(sess);
+    }
+
+    sess->release();
+}
+
+void Session::revoke(const string& forward_key) {
+    list<Session*> sessions;
+    all_sessions.collect(forward_key, &sessions);
+
+    for (list<Session*>::iterator it = sessions.begin(); it != sessions.end(); ++it) {
+        (*it)->shutdown();
+        (*it)->release();
+    }
+}
+
+void Session::shutdown() {
+    if (!__sync_bool_compare_and_swap(&closed_, 0, 1)) {
+        // already shut down by another thread (e.g. revoked while erroring)
+        return;
+    }
+
+    all_sessions.remove(&hook_);
+
+    if (sockmap_slot_ >= 0) {
+        SockMap::remove(sockmap_slot_);
+    }
+
+    // wake up both peers now, fds will be closed when the last ref is dropped
+    ::shutdown(fd_[CLIENT], SHUT_RDWR);
+    ::shutdown(fd_[SERVER], SHUT_RDWR);
+    if (zc_ != NULL) {
+        // the kernel may still send from our chunks, the poll thread removes
+        // the session once it is done with them
+        poll_->set_timer(this, 0);
+    } else {
+        poll_->remove(this);
+    }
+
+    Log::info("shutdown: client_fd=%d, remote_fd=%d", fd_[CLIENT], fd_[SERVER]);
+
+    // the ref held since start()
+    this->release();
+}
+
+void Session::set_mode(int idx, int mode) {
+    if (paused_[idx] || (idx == SERVER && rate_wait_)) {
+        mode &= ~Pollable::READ;
+    }
+    if (mode_[idx] != mode) {
+        mode_[idx] = mode;
+        poll_->update_mode(this, idx, mode);
+    }
+}
+
+// the one PollMgr timer serves buffer linger, pause rechecks and deadlines, keep the earliest
+void Session::arm_timer(int delay_ms) {
+    i64 due = time_now_us() + (i64) delay_ms * 1000;
+    if (timer_due_us_ == 0 || due < timer_due_us_) {
+        timer_due_us_ = due;
+        // before the session is added, this only records the due time
+        poll_->set_timer(this, delay_ms);
+    }
+}
+
+// arm the timer for the next idle check or the end of the session, whichever comes first
+void Session::arm_deadlines(i64 now) {
+    i64 due = end_us_;
+    if (idle_timeout_s > 0 && sockmap_slot_ < 0) {
+        i64 idle_due = last_active_us_ + idle_timeout_s * 1000000LL;
+        if (due == 0 || idle_due < due) {
+            due = idle_due;
+        }
+    }
+    if (due != 0) {
+        // far deadlines are armed in steps the int takes
+        arm_timer((int) min(max((due - now + 999) / 1000, (i64) 0), (i64) INT_MAX));
+    }
+}
+
+// true if the session was closed for being idle, or too old
+bool Session::check_deadlines(i64 now) {
+    if (end_us_ != 0 && now >= end_us_) {
+        Log::info("session of client_fd=%d reached its max duration", fd_[CLIENT]);
+        shutdown();
+        return true;
+    }
+    if (idle_timeout_s > 0 && sockmap_slot_ < 0) {
+        if (bytes_counted() != active_mark_) {
+            // relayed something since the last check
+            active_mark_ = bytes_counted();
+            last_active_us_ = now;
+        } else if (now - last_active_us_ >= idle_timeout_s * 1000000LL) {
+            Log::info("session of client_fd=%d idle for %d seconds", fd_[CLIENT], idle_timeout_s);
+            shutdown();
+            return true;
+        }
+    }
+    return false;
+}
+
+void Session::update_resident() {
+    int resident = out_[CLIENT].storage_size() + out_[SERVER].storage_size();
+    if (zc_ != NULL) {
+        resident += zc_->storage_size();
+    }
+    if (resident != resident_) {
+        MemoryGovernor::charge(account_, resident - resident_);
+        resident_ = resident;
+    }
+}
+
+// how many more bytes read from fd_[idx] may be buffered, -1 if unlimited.
+// If 0, *reason tells which limit is hit.
+int Session::read_allowance(int idx, bool resuming, int* reason) {
+    if (throttled_) {
+        *reason = MemoryGovernor::BUDGET;
+        return 0;
+    }
+
+    // when resuming, wait until half of a cap is free, so reads do not flap at the limit
+    i64 allowance = -1;
+    i64 cap = MemoryGovernor::session_cap;
+    if (cap > 0) {
+        i64 room = cap - resident_ - (resuming ? cap / 2 : 0);
+        if (room <= 0) {
+            *reason = MemoryGovernor::SESSION_CAP;
+            return 0;
+        }
+        allowance = room;
+    }
+    cap = MemoryGovernor::route_cap;
+    if (cap > 0) {
+        i64 room = cap - account_->bytes - (resuming ? cap / 2 : 0);
+        if (room <= 0) {
+            *reason = MemoryGovernor::ROUTE_CAP;
+            return 0;
+        }
+        if (allowance < 0 || room < allowance) {
+            allowance = room;
+        }
+    }
+    return (int) min(allowance, (i64) INT_MAX);
+}
+
+void Session::pause_read(int idx, int reason) {
+    if (paused_[idx] == 0) {
+        MemoryGovernor::count_pause(reason);
+    }
+    paused_[idx] = reason;
+    set_mode(idx, mode_[idx]);
+    arm_timer(pause_recheck_ms);
+}
+
+void Session::try_resume_read(int idx) {
+    int reason = paused_[idx];
+    if (spill_[1 - idx] != NULL) {
+        // new data has to go behind the spilled, which can only take more with quota
+        if (!SpillFile::has_room(relay_buf_size)) {
+            arm_timer(pause_recheck_ms);
+            return;
+        }
+    } else if (!out_[1 - idx].empty() && read_allowance(idx, true, &reason) == 0) {
+        // relaying into an empty buffer costs nothing unless the receiver is slow
+        paused_[idx] = reason;
+        arm_timer(pause_recheck_ms);
+        return;
+    }
+    paused_[idx] = 0;
+
+    // adding READ back re-arms the edge, so data that came while paused is reported again
+    set_mode(idx, mode_[idx] | Pollable::READ);
+}
+
+// bytes the rate limits let through to the client now, -1 if not limited
+int Session::rate_allowance(i64 now) {
+    if (!shaped()) {
+        return -1;
+    }
+    double tokens = INT_MAX;
+    if (session_rate_ > 0) {
+        tokens = min(tokens, rate_.available(now));
+    }
+    if (route_rate_ > 0) {
+        Pthread_mutex_lock(&account_->rate_m);
+        tokens = min(tokens, account_->rate.available(now));
+        Pthread_mutex_unlock(&account_->rate_m);
+    }
+    return (int) max(tokens, 0.0);
+}
+
+// reads may go a little over the allowance, that is paid back before the next
+void Session::spend_rate(int n) {
+    if (n <= 0) {
+        return;
+    }
+    if (session_rate_ > 0) {
+        rate_.spend(n);
+    }
+    if (route_rate_ > 0) {
+        Pthread_mutex_lock(&account_->rate_m);
+        account_->rate.spend(n);
+        Pthread_mutex_unlock(&account_->rate_m);
+    }
+    shaped_bytes_ += n;
+    __sync_add_and_fetch(&n_shaped_bytes, n);
+}
+
+// how long until a worthwhile read is allowed: a relay buffer, or 10ms of the
+// rate if less, so slow limits do not wait for big chunks
+i64 Session::rate_wait_us(i64 now) {
+    i64 wait_us = 0;
+    if (session_rate_ > 0) {
+        double chunk = min((double) min((i64) relay_buf_size, rate_burst), max(session_rate_ / 100.0, 1.0));
+        wait_us = rate_.wait_us(chunk, now);
+    }
+    if (route_rate_ > 0) {
+        double chunk = min((double) min((i64) relay_buf_size, rate_burst), max(route_rate_ / 100.0, 1.0));
+        Pthread_mutex_lock(&account_->rate_m);
+        wait_us = max(wait_us, account_->rate.wait_us(chunk, now));
+        Pthread_mutex_unlock(&account_->rate_m);
+    }
+    return wait_us;
+}
+
+// stop reading from the server until the timer finds tokens again
+void Session::wait_for_rate(i64 now) {
+    if (!rate_wait_) {
+        rate_wait_ = true;
+        __sync_add_and_fetch(&n_rate_waits, 1);
+        set_mode(SERVER, mode_[SERVER]);
+    }
+    arm_timer((int) max((rate_wait_us(now) + 999) / 1000, (i64) 1));
+}
+
+void Session::try_resume_rate(i64 now) {
+    if (rate_wait_us(now) > 0) {
+        wait_for_rate(now);
+        return;
+    }
+    rate_wait_ = false;
+
+    // adding READ back re-arms the edge, so data that came while waiting is reported again
+    set_mode(SERVER, mode_[SERVER] | Pollable::READ);
+}
+
+// move data from fd_[idx] to the spill file of its peer, until the fd would block
+// or *budget is used up. Returns false if the spill file cannot take more.
+bool Session::spill_from_fd(int idx, int* budget) {
+    int peer = 1 - idx;
+    if (spill_[peer] == NULL) {
+        spill_[peer] = SpillFile::create();
+        if (spill_[peer] == NULL) {
+            return false;
+        }
+    }
+
+    char buf[relay_buf_size];
+    while (*budget > 0) {
+        if (!SpillFile::has_room(sizeof(buf))) {
+            return false;
+        }
+        int n = ::read(fd_[idx], buf, sizeof(buf));
+        if (n <= 0) {
+            return true;
+        }
+        count_bytes(n);
+        *budget -= n;
+        if (!spill_[peer]->append(buf, n)) {
+            // the data cannot be kept in order any more
+            shutdown();
+            return true;
+        }
+    }
+    return true;
+}
+
+// move the next part of spilled data back to out_[idx], returns false if there is none
+bool Session::unspill(int idx) {
+    if (spill_[idx] == NULL) {
+        return false;
+    }
+
+    int n = 0;
+    if (spill_[idx]->size() > 0) {
+        char buf[relay_buf_size];
+        n = spill_[idx]->read(buf, sizeof(buf));
+        if (n <= 0) {
+            shutdown();
+            return false;
+        }
+        out_[idx].write(buf, n);
+    }
+
+    if (spill_[idx]->size() == 0) {
+        // caught up, give back the disk space
+        delete spill_[idx];
+        spill_[idx] = NULL;
+    }
+    return n > 0;
+}
+
+// write out pending data, and only ask for WRITE events while some is left
+void Session::flush(int idx) {
+    int budget = io_budget();
+    for (;;) {
+        budget -= out_[idx].write_to_fd(fd_[idx]);
+        if (!out_[idx].empty() || !unspill(idx)) {
+            break;
+        }
+        if (budget <= 0) {
+            // the rest of the spill file waits for the next round
+            still_ready(idx, Pollable::WRITE);
+            break;
+        }
+    }
+    if (out_[idx].empty()) {
+        set_mode(idx, Pollable::READ);
+        if (buffer_linger_ms <= 0) {
+            out_[idx].shrink();
+        } else {
+            last_drain_us_ = time_now_us();
+            if (!linger_armed_) {
+                linger_armed_ = true;
+                arm_timer(buffer_linger_ms);
+            }
+        }
+    } else {
+        set_mode(idx, Pollable::READ | Pollable::WRITE);
+    }
+    update_resident();
+
+    // storage might have been freed, let paused sides read again
+    for (int i = 0; i < 2; i++) {
+        if (paused_[i]) {
+            try_resume_read(i);
+        }
+    }
+}
+
+void Session::handle_read(int idx) {
+    if (closed_) {
+        return;
+    }
+    int peer = 1 - idx;
+    int budget = io_budget();
+
+    // what goes to the client may be rate limited
+    int rate_allowed = -1;
+    i64 now = 0;
+    if (idx == SERVER && shaped()) {
+        if (rate_wait_) {
+            return;
+        }
+        now = time_now_us();
+        rate_allowed = rate_allowance(now);
+        if (rate_allowed == 0) {
+            wait_for_rate(now);
+            return;
+        }
+        budget = min(budget, rate_allowed);
+    }
+    int start_budget = budget;
+
+    while (!paused_[idx]) {
+        if (budget <= 0) {
+            // let other sessions have their turn, the rest is read next round
+            still_ready(idx, Pollable::READ);
+            break;
+        }
+
+        if (spill_[peer] != NULL || (SpillFile::threshold > 0 && out_[peer].storage_size() >= SpillFile::threshold
+                && !out_[peer].empty())) {
+            // keep reading at full speed, the receiver gets it from disk later
+            if (spill_from_fd(idx, &budget)) {
+                if (budget <= 0) {
+                    still_ready(idx, Pollable::READ);
+                }
+                break;
+            }
+            if (spill_[peer] != NULL) {
+                pause_read(idx, MemoryGovernor::SPILL_QUOTA);
+                break;
+            }
+            // out of quota before spilling anything, fall back to memory
+        }
+
+        if (!out_[peer].empty()) {
+            // new data has to go behind what is already pending
+            int reason = 0;
+            int allowance = read_allowance(idx, false, &reason);
+            if (allowance == 0) {
+                pause_read(idx, reason);
+                break;
+            }
+            int limit = allowance < 0 ? budget : min(allowance, budget);
+            int n = out_[peer].read_from_fd(fd_[idx], limit);
+            if (n > 0) {
+                count_bytes(n);
+                budget -= n;
+                flush(peer);
+            }
+            if (n < limit) {
+                // the fd has no more data
+                break;
+            }
+            // stopped at the limit, check it again
+            continue;
+        }
+
+        char buf[relay_buf_size];
+        int n = ::read(fd_[idx], buf, min((int) sizeof(buf), budget));
+        if (n <= 0) {
+            break;
+        }
+        count_bytes(n);
+        budget -= n;
+        int r = ::write(fd_[peer], buf, n);
+        if (r < n) {
+            // peer cannot take more now, keep the rest until it is writable
+            r = max(r, 0);
+            out_[peer].write(buf + r, n - r);
+            set_mode(peer, Pollable::READ | Pollable::WRITE);
+            update_resident();
+        }
+    }
+
+    if (rate_allowed >= 0) {
+        spend_rate(start_budget - budget);
+        if (budget <= 0 && !closed_ && rate_allowance(now) == 0) {
+            // the rest waits for tokens rather than the next round
+            wait_for_rate(now);
+        }
+    }
+}
+
+void Session::handle_write(int idx) {
+    if (!closed_ && !out_[idx].empty()) {
+        flush(idx);
+    }
+}
+
+void Session::handle_error(int idx) {
+    if (closed_) {
+        // completions come as errors too
+        drain_zerocopy();
+        return;
+    }
+    if (idx == CLIENT && zc_ != NULL && zc_->reap(fd_[CLIENT]) >= 0) {
+        // only zero copy completions, their chunks are freed now
+        update_resident();
+        return;
+    }
+    shutdown();
+}
+
+// on the poll thread after shutdown(): free the chunks the kernel is done
+// with, and remove the session once there are none left
+void Session::drain_zerocopy() {
+    if (zc_ == NULL || zc_drain_until_us_ < 0) {
+        return;
+    }
+    i64 now = time_now_us();
+    if (zc_drain_until_us_ == 0) {
+        // not sent by now, not sent at all; busy chunks move to zc_
+        out_[CLIENT].clear();
+        zc_drain_until_us_ = now + zerocopy_drain_ms * 1000LL;
+#ifdef TCP_USER_TIMEOUT
+        // a peer that stops acking is reset in time, which completes its sends
+        unsigned int user_timeout_ms = zerocopy_drain_ms / 2;
+        setsockopt(fd_[CLIENT], IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout_ms, sizeof(user_timeout_ms));
+#endif // TCP_USER_TIMEOUT
+    }
+
+    zc_->reap(fd_[CLIENT]);
+    update_resident();
+    if (zc_->idle() || now >= zc_drain_until_us_) {
+        if (!zc_->idle()) {
+            Log::warn("client_fd=%d: zero copy sends not done after %d ms, abandoning their chunks", fd_[CLIENT],
+                    zerocopy_drain_ms);
+        }
+        zc_drain_until_us_ = -1;
+        poll_->remove(this);
+    } else {
+        // completions also wake us up as errors, this is a fallback
+        poll_->set_timer(this, 100);
+    }
+}
+
+void Session::handle_timeout() {
+    timer_due_us_ = 0;
+    if (closed_) {
+        drain_zerocopy();
+        return;
+    }
+
+    i64 now = time_now_us();
+    if (check_deadlines(now)) {
+        return;
+    }
+
+    for (int idx = 0; idx < 2; idx++) {
+        if (paused_[idx]) {
+            try_resume_read(idx);
+        }
+    }
+    if (rate_wait_) {
+        try_resume_rate(now);
+    }
+
+    if (linger_armed_) {
+        i64 idle_ms = (now - last_drain_us_) / 1000;
+        if (idle_ms < buffer_linger_ms) {
+            arm_timer(buffer_linger_ms - idle_ms);
+        } else {
+            linger_armed_ = false;
+            out_[CLIENT].shrink();
+            out_[SERVER].shrink();
+            update_resident();
+        }
+    }
+
+    arm_deadlines(now);
+}
+
+void Session::dump_stats() {
+    list<Session*> sessions;
+    all_sessions.collect_all(&sessions);
+
+    int n_buffered = 0;
+    int n_in_kernel = 0;
+    int n_shaped = 0;
+    i64 total_resident = 0;
+    for (list<Session*>::iterator it = sessions.begin(); it != sessions.end(); ++it) {
+        Session* sess = *it;
+        i64 from_client, from_server;
+        if (sess->sockmap_slot_ >= 0 && SockMap::bytes(sess->sockmap_slot_, &from_client, &from_server)) {
+            Log::info("session client_fd=%d remote_fd=%d: relayed in kernel, %lld bytes from client, %lld from server",
+                    sess->fd_[CLIENT], sess->fd_[SERVER], (long long) from_client, (long long) from_server);
+            n_in_kernel++;
+        }
+        int resident = sess->resident_bytes();
+        if (resident > 0) {
+            Log::info("session client_fd=%d remote_fd=%d: %d buffer bytes", sess->fd_[CLIENT], sess->fd_[SERVER],
+                    resident);
+            n_buffered++;
+            total_resident += resident;
+        }
+        if (sess->shaped()) {
+            Log::info("session client_fd=%d remote_fd=%d: %lld bytes sent to client under rate limits%s",
+                    sess->fd_[CLIENT], sess->fd_[SERVER], (long long) sess->shaped_bytes_,
+                    sess->rate_wait_ ? ", waiting for tokens" : "");
+            n_shaped++;
+        }
+        sess->release();
+    }
+
+    Log::info("sessions: %d (%d bytes each), %d relayed in kernel, %d holding buffers, %lld buffer bytes in total",
+            (int) sessions.size(), (int) sizeof(Session), n_in_kernel, n_buffered, (long long) total_resident);
+    Log::info("rate limits: %d sessions shaped, %lld bytes sent under limits, %lld waits for tokens", n_shaped,
+            (long long) n_shaped_bytes, (long long) n_rate_waits);
+}
+
+void Session::govern() {
+    if (!MemoryGovernor::over_budget() && !MemoryGovernor::is_throttling()) {
+        return;
+    }
+
+    list<Session*> sessions;
+    all_sessions.collect_all(&sessions);
+
+    vector<i64> sizes;
+    sizes.reserve(sessions.size());
+    Session* largest = NULL;
+    i64 largest_size = 0;
+    for (list<Session*>::iterator it = sessions.begin(); it != sessions.end(); ++it) {
+        i64 size = (*it)->resident_;
+        sizes.push_back(size);
+        if (size > largest_size) {
+            largest = *it;
+            largest_size = size;
+        }
+    }
+
+    bool drop = false;
+    i64 threshold = MemoryGovernor::pause_threshold(sizes, &drop);
+
+    // paused sessions notice the throttle being lifted on their next recheck
+    int i = 0;
+    for (list<Session*>::iterator it = sessions.begin(); it != sessions.end(); ++it, ++i) {
+        (*it)->throttled_ = (threshold > 0 && sizes[i] >= threshold) ? 1 : 0;
+    }
+
+    if (drop && largest != NULL) {
+        Log::warn("dropping session client_fd=%d remote_fd=%d, holding %lld buffer bytes", largest->fd_[CLIENT],
+                largest->fd_[SERVER], (long long) largest_size);
+        MemoryGovernor::count_drop();
+        largest->shutdown();
+    }
+
+    for (list<Session*>::iterator it = sessions.begin(); it != sessions.end(); ++it) {
+        (*it)->release();
+    }
+}
@@ -0,0 +1,245 @@
+#pragma once
+
+#include <string>
+
+#include "utils.h"
+#include "marshal.h"
+#include "polling.h"
+#include "registry.h"
+#include "governor.h"
+#include "spill.h"
+#include "sockmap.h"
+#include "admission.h"
+#include "routes.h"
+
+/**
+ * A forwarded connection: the client socket, the VNC server socket, and the
+ * data waiting to be written to each of them, in one object.
+ *
+ * Both fds are registered with PollMgr as one Pollable, so all relaying of a
+ * session happens on one poll thread, and needs no lock. Other threads only
+ * call shutdown(), which is made idempotent with an atomic flag.
+ *
+ * Data is relayed through a stack buffer, out_[] only allocates when the
+ * receiving side cannot take everything right away. Once drained, buffers are
+ * kept for buffer_linger_ms in case more comes, then freed, so idle sessions
+ * hold no buffer storage.
+ *
+ * Buffer storage is charged to MemoryGovernor. When a limit is hit, the
+ * session stops reading from the side whose data it cannot pass on, which
+ * pushes back on the sender through TCP, and resumes once the data drained
+ * (or, for the global budget, once the governor lifts the throttle).
+ *
+ * If spilling is enabled, an outbound buffer that grows past
+ * SpillFile::threshold continues in a spill file instead, so the sender is
+ * not slowed down by a slow receiver. Pending data for fd_[i] is out_[i]
+ * followed by spill_[i], and is moved back to out_[i] as it drains.
+ *
+ * With zerocopy_min_size set, large bursts to the client are sent with
+ * MSG_ZEROCOPY from out_[CLIENT], see ZeroCopyQueue. The kernel may still
+ * read those chunks after shutdown(), so such a session stays registered,
+ * and keeps the client fd open, until their completions are reaped (see
+ * drain_zerocopy()).
+ *
+ * If SockMap is enabled, the kernel relays the data, and the session only
+ * watches its fds for hangups (and for data passed up before the sockets
+ * were redirected).
+ *
+ * Sessions are closed when idle or too old (idle_timeout_s, max_duration_s).
+ * These deadlines share the one PollMgr timer of the session with the
+ * buffer linger and pause rechecks, and are re-armed whenever it fires.
+ * Idleness is judged from the bytes relayed at each firing, so the relay
+ * path does not touch timers at all.
+ *
+ * What is relayed to the client can be rate limited, per session and per
+ * route (token buckets, the route's kept in its BufferAccount). A session
+ * out of tokens stops reading from the server, so the server is slowed down
+ * through TCP, and the timer resumes reading once enough tokens are back.
+ * Shaped sessions are not relayed by SockMap.
+ */
+class Session: public rpc::Pollable {
+public:
+
+    enum {
+        CLIENT = 0, SERVER = 1
+    };
+
+private:
+
+    rpc::PollMgr* poll_;
+    int fd_[2];
+    int mode_[2];
+
+    // data waiting to be written to fd_[i]
+    rpc::Marshal out_[2];
+    SpillFile* spill_[2];
+
+    // chunks of out_[CLIENT] the kernel still reads from, NULL if zero copy is off
+    rpc::ZeroCopyQueue* zc_;
+    // after shutdown(), when to stop waiting for zero copy completions; 0 before, -1 once removed
+    rpc::i64 zc_drain_until_us_;
+
+    // where the session is in SockMap, -1 if relayed in user space
+    int sockmap_slot_;
+
+    // bytes of storage held by out_[], read by other threads for stats
+    volatile int resident_;
+    rpc::i64 last_drain_us_;
+    bool linger_armed_;
+    rpc::i64 timer_due_us_;
+
+    // closed at end_us_ (0 if never), or when nothing was relayed since last_active_us_ for too long
+    rpc::i64 end_us_;
+    rpc::i64 last_active_us_;
+    rpc::i64 active_mark_;
+
+    // the route this session's buffers are charged to
+    BufferAccount* account_;
+
+    // the client address this session counts against, given back when closed
+    SourceAccount* source_;
+
+    // set by the governor thread, when this session holds too much of the budget
+    volatile int throttled_;
+
+    // why reading from fd_[i] is paused (a MemoryGovernor limit), 0 if not paused
+    int paused_[2];
+
+    // limits of what is relayed to the client in bytes/s, 0 if not limited;
+    // the route's tokens are in account_
+    rpc::i64 session_rate_;
+    rpc::i64 route_rate_;
+    rpc::TokenBucket rate_;
+    // reading from the server waits for tokens
+    bool rate_wait_;
+    volatile rpc::i64 shaped_bytes_;
+
+    static volatile rpc::i64 n_shaped_bytes;
+    static volatile rpc::i64 n_rate_waits;
+
+    volatile int closed_;
+
+    // forward_key is interned in the registry
+    rpc::SessionRegistry<Session>::Hook hook_;
+    static rpc::SessionRegistry<Session> all_sessions;
+
+    Session(rpc::PollMgr* pmgr, BufferAccount* account, SourceAccount* source, int clnt_fd, int server_fd);
+
+    static const int relay_buf_size;
+    static const int pause_recheck_ms;
+    static const int zerocopy_drain_ms;
+
+    void set_mode(int idx, int mode);
+    void arm_timer(int delay_ms);
+    void arm_deadlines(rpc::i64 now);
+    bool check_deadlines(rpc::i64 now);
+    void flush(int idx);
+    void update_resident();
+
+    int read_allowance(int idx, bool resuming, int* reason);
+    void pause_read(int idx, int reason);
+    void try_resume_read(int idx);
+
+    bool shaped() const {
+        return session_rate_ > 0 || route_rate_ > 0;
+    }
+    int rate_allowance(rpc::i64 now);
+    void spend_rate(int n);
+    rpc::i64 rate_wait_us(rpc::i64 now);
+    void wait_for_rate(rpc::i64 now);
+    void try_resume_rate(rpc::i64 now);
+
+    bool spill_from_fd(int idx, int* budget);
+    bool unspill(int idx);
+
+    void drain_zerocopy();
+
+protected:
+
+    // RefCounted object uses protected dtor to prevent accidental deletion
+    ~Session();
+
+public:
+
+    // drained buffers are freed after this long without traffic, 0 frees them immediately
+    static int buffer_linger_ms;
+
+    // send at least this many pending bytes to the client with MSG_ZEROCOPY, 0 disables
+    static int zerocopy_min_size;
+
+    // relay input from the client (keys, pointer) ahead of bulk updates from the server
+    static bool input_first;
+
+    // close sessions that relayed nothing for this long, 0 disables (not for SockMap sessions)
+    static int idle_timeout_s;
+
+    // close sessions this long after they started, unless their route says otherwise, 0 disables
+    static int max_duration_s;
+
+    // have the kernel probe quiet peers after this long, so half-open connections fail, 0 disables
+    static int keepalive_s;
+
+    // bytes/s relayed to the client of each session, and to all clients of a route,
+    // unless the route says otherwise, 0 disables
+    static rpc::i64 session_rate;
+    static rpc::i64 route_rate;
+
+    // bytes a rate limited session or route may send at once after a quiet spell
+    static rpc::i64 rate_burst;
+
+    /**
+     * Start relaying between clnt_fd and server_fd, both should be nonblocking,
+     * for a client forwarded by route. The session owns the fds from now on,
+     * and the admission account of the client (may be NULL). The limits of
+     * route override the defaults where not 0.
+     */
+    static void start(rpc::PollMgr* pmgr, const Route& route, int clnt_fd, int server_fd, SourceAccount* source);
+
+    /**
+     * Close all sessions forwarded with forward_key.
+     */
+    static void revoke(const std::string& forward_key);
+
+    void shutdown();
+
+    int resident_bytes() const {
+        return resident_;
+    }
+
+    /**
+     * Log number of sessions and their buffer usage.
+     */
+    static void dump_stats();
+
+    /**
+     * Enforce MemoryGovernor::budget: throttle the sessions holding the most
+     * buffer storage, and drop the largest if the governor says so. Called
+     * periodically.
+     */
+    static void govern();
+
+    int n_fds() {
+        return 2;
+    }
+
+    int fd(int idx) {
+        return fd_[idx];
+    }
+
+    int poll_mode(int idx) {
+        return mode_[idx];
+    }
+
+    // reading input from the client, and writing what is left of it to the server
+    int urgent_mode(int idx) {
+        if (!input_first) {
+            return 0;
+        }
+        return idx == CLIENT ? rpc::Pollable::READ : rpc::Pollable::WRITE;
+    }
+
+    void handle_read(int idx);
+    void handle_write(int idx);
+    void handle_error(int idx);
+    void handle_timeout();
+};
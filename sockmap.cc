@@ -0,0 +1,303 @@
+#include <string.h>
+#include <errno.h>
+#include <stddef.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#if defined(__NR_bpf) && defined(SO_COOKIE)
+#define USE_SOCKMAP
+#endif
+#endif // __linux__
+
+#include "sockmap.h"
+
+using namespace std;
+using namespace rpc;
+
+bool SockMap::enabled_ = false;
+int SockMap::sockmap_fd_ = -1;
+int SockMap::peers_fd_ = -1;
+int SockMap::prog_fd_ = -1;
+
+pthread_mutex_t SockMap::m_ = PTHREAD_MUTEX_INITIALIZER;
+vector<int> SockMap::free_slots_;
+vector<i64> SockMap::cookies_;
+
+#ifdef USE_SOCKMAP
+
+/**
+ * Value of the peers map, keyed by socket cookie.
+ */
+struct sockmap_peer {
+    // sockmap key of the socket to redirect to
+    u32 peer_key;
+    u32 pad;
+    // bytes received on this socket, added by the verdict program
+    u64 bytes;
+};
+
+static int sys_bpf(int cmd, union bpf_attr* attr) {
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static struct bpf_insn bpf_insn_of(int code, int dst, int src, int off, int imm) {
+    struct bpf_insn insn;
+    memset(&insn, 0, sizeof(insn));
+    insn.code = code;
+    insn.dst_reg = dst;
+    insn.src_reg = src;
+    insn.off = off;
+    insn.imm = imm;
+    return insn;
+}
+
+// load a map fd into a register, takes two instructions
+static void bpf_ld_map_fd(vector<struct bpf_insn>* prog, int dst, int map_fd) {
+    prog->push_back(bpf_insn_of(BPF_LD | BPF_DW | BPF_IMM, dst, BPF_PSEUDO_MAP_FD, 0, map_fd));
+    prog->push_back(bpf_insn_of(0, 0, 0, 0, 0));
+}
+
+/**
+ * The sk_skb verdict program, in C:
+ *
+ *   u64 cookie = bpf_get_socket_cookie(skb);
+ *   struct sockmap_peer* p = bpf_map_lookup_elem(&peers, &cookie);
+ *   if (p == NULL)
+ *       return SK_PASS;
+ *   __sync_fetch_and_add(&p->bytes, skb->len);
+ *   return bpf_sk_redirect_map(skb, &sockmap, p->peer_key, 0);
+ */
+static void build_verdict_prog(vector<struct bpf_insn>* prog, int sockmap_fd, int peers_fd) {
+    prog->push_back(bpf_insn_of(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0));
+    prog->push_back(bpf_insn_of(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_get_socket_cookie));
+    prog->push_back(bpf_insn_of(BPF_STX | BPF_MEM | BPF_DW, BPF_REG_10, BPF_REG_0, -8, 0));
+    prog->push_back(bpf_insn_of(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0));
+    prog->push_back(bpf_insn_of(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -8));
+    bpf_ld_map_fd(prog, BPF_REG_1, peers_fd);
+    prog->push_back(bpf_insn_of(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem));
+
+    // if (p == NULL) goto pass, skipping the 9 instructions below
+    prog->push_back(bpf_insn_of(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 9, 0));
+
+    prog->push_back(bpf_insn_of(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_1, BPF_REG_6, offsetof(struct __sk_buff, len), 0));
+    prog->push_back(bpf_insn_of(BPF_STX | BPF_XADD | BPF_DW, BPF_REG_0, BPF_REG_1, offsetof(struct sockmap_peer, bytes),
+            0));
+    prog->push_back(bpf_insn_of(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_0, offsetof(struct sockmap_peer, peer_key),
+            0));
+    prog->push_back(bpf_insn_of(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0));
+    bpf_ld_map_fd(prog, BPF_REG_2, sockmap_fd);
+    prog->push_back(bpf_insn_of(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0));
+    prog->push_back(bpf_insn_of(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_redirect_map));
+    prog->push_back(bpf_insn_of(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+    // pass:
+    prog->push_back(bpf_insn_of(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, SK_PASS));
+    prog->push_back(bpf_insn_of(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+}
+
+static bool get_cookie(int fd, u64* cookie) {
+    socklen_t len = sizeof(*cookie);
+    return getsockopt(fd, SOL_SOCKET, SO_COOKIE, cookie, &len) == 0;
+}
+
+static void map_delete(int map_fd, const void* key) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = map_fd;
+    attr.key = (u64) (uintptr_t) key;
+    sys_bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+static bool map_update(int map_fd, const void* key, const void* value) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = map_fd;
+    attr.key = (u64) (uintptr_t) key;
+    attr.value = (u64) (uintptr_t) value;
+    attr.flags = BPF_ANY;
+    return sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) == 0;
+}
+
+static int map_create(int map_type, int key_size, int value_size, int max_entries) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = map_type;
+    attr.key_size = key_size;
+    attr.value_size = value_size;
+    attr.max_entries = max_entries;
+    return sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+static int load_prog(const vector<struct bpf_insn>& prog, char* log, int log_size) {
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_SK_SKB;
+    attr.insns = (u64) (uintptr_t) &prog[0];
+    attr.insn_cnt = prog.size();
+    attr.license = (u64) (uintptr_t) "GPL";
+    if (log != NULL) {
+        attr.log_buf = (u64) (uintptr_t) log;
+        attr.log_size = log_size;
+        attr.log_level = 1;
+    }
+    return sys_bpf(BPF_PROG_LOAD, &attr);
+}
+
+bool SockMap::init(int max_sessions) {
+    verify(!enabled_);
+
+    sockmap_fd_ = map_create(BPF_MAP_TYPE_SOCKMAP, sizeof(u32), sizeof(u32), 2 * max_sessions);
+    if (sockmap_fd_ < 0) {
+        Log::warn("cannot create bpf sockmap, relaying in user space: %s", strerror(errno));
+        return false;
+    }
+
+    peers_fd_ = map_create(BPF_MAP_TYPE_HASH, sizeof(u64), sizeof(struct sockmap_peer), 2 * max_sessions);
+    if (peers_fd_ < 0) {
+        Log::warn("cannot create bpf hash map, relaying in user space: %s", strerror(errno));
+        close(sockmap_fd_);
+        return false;
+    }
+
+    vector<struct bpf_insn> prog;
+    build_verdict_prog(&prog, sockmap_fd_, peers_fd_);
+    prog_fd_ = load_prog(prog, NULL, 0);
+    if (prog_fd_ < 0) {
+        int err = errno;
+
+        // load again to get the verifier's explanation
+        static char log[16 * 1024];
+        log[0] = '\0';
+        load_prog(prog, log, sizeof(log));
+        Log::warn("cannot load bpf verdict program, relaying in user space: %s\n%s", strerror(err), log);
+        close(peers_fd_);
+        close(sockmap_fd_);
+        return false;
+    }
+
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.target_fd = sockmap_fd_;
+    attr.attach_bpf_fd = prog_fd_;
+    attr.attach_type = BPF_SK_SKB_STREAM_VERDICT;
+    if (sys_bpf(BPF_PROG_ATTACH, &attr) != 0) {
+        Log::warn("cannot attach bpf verdict program, relaying in user space: %s", strerror(errno));
+        close(prog_fd_);
+        close(peers_fd_);
+        close(sockmap_fd_);
+        return false;
+    }
+
+    Pthread_mutex_lock(&m_);
+    for (int slot = max_sessions - 1; slot >= 0; slot--) {
+        free_slots_.push_back(slot);
+    }
+    cookies_.resize(2 * max_sessions, 0);
+    Pthread_mutex_unlock(&m_);
+
+    Log::info("relaying sessions in the kernel with bpf sockmap, room for %d sessions", max_sessions);
+    enabled_ = true;
+    return true;
+}
+
+int SockMap::insert(int clnt_fd, int server_fd) {
+    if (!enabled_) {
+        return -1;
+    }
+
+    u64 cookie[2];
+    if (!get_cookie(clnt_fd, &cookie[0]) || !get_cookie(server_fd, &cookie[1])) {
+        return -1;
+    }
+
+    Pthread_mutex_lock(&m_);
+    int slot = -1;
+    if (!free_slots_.empty()) {
+        slot = free_slots_.back();
+        free_slots_.pop_back();
+        cookies_[2 * slot] = cookie[0];
+        cookies_[2 * slot + 1] = cookie[1];
+    }
+    Pthread_mutex_unlock(&m_);
+    if (slot < 0) {
+        // full, the rest go through user space
+        return -1;
+    }
+
+    // sockets without a peer entry are passed to user space, so add the peers
+    // last: redirecting to a socket not yet in the sockmap would drop the data
+    u32 key[2] = { (u32) (2 * slot), (u32) (2 * slot + 1) };
+    u32 fd[2] = { (u32) clnt_fd, (u32) server_fd };
+    struct sockmap_peer peer[2];
+    memset(peer, 0, sizeof(peer));
+    peer[0].peer_key = key[1];
+    peer[1].peer_key = key[0];
+    if (!map_update(sockmap_fd_, &key[0], &fd[0]) || !map_update(sockmap_fd_, &key[1], &fd[1])
+            || !map_update(peers_fd_, &cookie[0], &peer[0]) || !map_update(peers_fd_, &cookie[1], &peer[1])) {
+        Log::warn("cannot add session to bpf sockmap, relaying in user space: %s", strerror(errno));
+        remove(slot);
+        return -1;
+    }
+    return slot;
+}
+
+void SockMap::remove(int slot) {
+    Pthread_mutex_lock(&m_);
+    u64 cookie[2] = { (u64) cookies_[2 * slot], (u64) cookies_[2 * slot + 1] };
+    Pthread_mutex_unlock(&m_);
+
+    // stop redirecting before taking the sockets out
+    u32 key[2] = { (u32) (2 * slot), (u32) (2 * slot + 1) };
+    map_delete(peers_fd_, &cookie[0]);
+    map_delete(peers_fd_, &cookie[1]);
+    map_delete(sockmap_fd_, &key[0]);
+    map_delete(sockmap_fd_, &key[1]);
+
+    Pthread_mutex_lock(&m_);
+    free_slots_.push_back(slot);
+    Pthread_mutex_unlock(&m_);
+}
+
+bool SockMap::bytes(int slot, i64* from_client, i64* from_server) {
+    Pthread_mutex_lock(&m_);
+    u64 cookie[2] = { (u64) cookies_[2 * slot], (u64) cookies_[2 * slot + 1] };
+    Pthread_mutex_unlock(&m_);
+
+    i64* out[2] = { from_client, from_server };
+    for (int i = 0; i < 2; i++) {
+        struct sockmap_peer peer;
+        union bpf_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.map_fd = peers_fd_;
+        attr.key = (u64) (uintptr_t) &cookie[i];
+        attr.value = (u64) (uintptr_t) &peer;
+        if (sys_bpf(BPF_MAP_LOOKUP_ELEM, &attr) != 0) {
+            return false;
+        }
+        *out[i] = peer.bytes;
+    }
+    return true;
+}
+
+#else
+
+bool SockMap::init(int max_sessions) {
+    Log::warn("bpf sockmap is not supported on this platform, relaying in user space");
+    return false;
+}
+
+int SockMap::insert(int clnt_fd, int server_fd) {
+    return -1;
+}
+
+void SockMap::remove(int slot) {
+}
+
+bool SockMap::bytes(int slot, i64* from_client, i64* from_server) {
+    return false;
+}
+
+#endif // USE_SOCKMAP
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <vector>
+
+#include "utils.h"
+
+/**
+ * Relays established sessions inside the kernel.
+ *
+ * Both sockets of a session go into a BPF sockmap. An sk_skb verdict program
+ * looks up the peer of each socket by socket cookie, adds the bytes to a
+ * per-socket counter, and redirects the data to the peer's send queue, so it
+ * never reaches user space. Sockets without a peer entry are passed to user
+ * space as usual.
+ *
+ * Needs Linux with CAP_BPF (or CAP_SYS_ADMIN). If init() fails, sessions are
+ * relayed in user space. All methods are thread safe.
+ */
+class SockMap {
+    static bool enabled_;
+    static int sockmap_fd_;
+    static int peers_fd_;
+    static int prog_fd_;
+
+    static pthread_mutex_t m_;
+    static std::vector<int> free_slots_;
+    // socket cookies of both sockets in each slot
+    static std::vector<rpc::i64> cookies_;
+
+public:
+
+    /**
+     * Create the maps and load the verdict program, room for max_sessions.
+     * Returns false if BPF sockmaps cannot be used.
+     */
+    static bool init(int max_sessions);
+
+    static bool enabled() {
+        return enabled_;
+    }
+
+    /**
+     * Start relaying between the two sockets in the kernel.
+     * Returns a slot for remove() and bytes(), or -1 if the session has to be
+     * relayed in user space.
+     */
+    static int insert(int clnt_fd, int server_fd);
+
+    static void remove(int slot);
+
+    /**
+     * Bytes relayed in the kernel, from the client and from the server.
+     */
+    static bool bytes(int slot, rpc::i64* from_client, rpc::i64* from_server);
+};
@@ -0,0 +1,89 @@
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "spill.h"
+
+using namespace std;
+using namespace rpc;
+
+volatile i64 SpillFile::disk_used = 0;
+volatile i64 SpillFile::n_files = 0;
+volatile i64 SpillFile::n_bytes_spilled = 0;
+
+i64 SpillFile::threshold = 0;
+i64 SpillFile::quota = 1024 * 1024 * 1024;
+string SpillFile::dir = "/tmp";
+
+SpillFile* SpillFile::create() {
+    if (threshold <= 0 || !has_room(0)) {
+        return NULL;
+    }
+
+    string path = dir + "/vncproxy-spill-XXXXXX";
+    char* tmpl = new char[path.length() + 1];
+    strcpy(tmpl, path.c_str());
+
+    int fd = mkstemp(tmpl);
+    if (fd < 0) {
+        Log::error("cannot create spill file in %s: %s", dir.c_str(), strerror(errno));
+        delete[] tmpl;
+        return NULL;
+    }
+
+    // nobody else needs to see it, space is reclaimed as soon as it is closed
+    unlink(tmpl);
+    delete[] tmpl;
+
+    verify(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_APPEND) == 0);
+    __sync_add_and_fetch(&n_files, 1);
+    return new SpillFile(fd);
+}
+
+SpillFile::~SpillFile() {
+    close(fd_);
+    __sync_sub_and_fetch(&disk_used, write_off_);
+    __sync_sub_and_fetch(&n_files, 1);
+}
+
+bool SpillFile::append(const void* p, int n) {
+    const char* data = (const char *) p;
+    int n_written = 0;
+    while (n_written < n) {
+        int r = ::write(fd_, data + n_written, n - n_written);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            Log::error("cannot write to spill file: %s", strerror(errno));
+            break;
+        }
+        n_written += r;
+    }
+
+    // count what landed on disk even on errors, it is freed with the file
+    write_off_ += n_written;
+    __sync_add_and_fetch(&disk_used, n_written);
+    __sync_add_and_fetch(&n_bytes_spilled, n_written);
+    return n_written == n;
+}
+
+int SpillFile::read(void* p, int n) {
+    n = (int) min((i64) n, size());
+    int r;
+    do {
+        r = pread(fd_, p, n, read_off_);
+    } while (r < 0 && errno == EINTR);
+    if (r < 0) {
+        Log::error("cannot read from spill file: %s", strerror(errno));
+        return -1;
+    }
+    read_off_ += r;
+    return r;
+}
+
+void SpillFile::dump_stats() {
+    Log::info("spill: %lld bytes in %lld files, quota %lld; %lld bytes spilled in total", (long long) disk_used,
+            (long long) n_files, (long long) quota, (long long) n_bytes_spilled);
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <string>
+
+#include "utils.h"
+
+/**
+ * Overflow of a session's outbound buffer, kept in an unlinked temp file.
+ *
+ * Data is appended at the end (the fd is O_APPEND) and read back in order
+ * from read_off_. All spill files together may hold up to quota bytes on
+ * disk, counted until a file is deleted. Files are deleted as soon as they
+ * are drained, so a session that catches up gives back its quota and its fd.
+ *
+ * Not thread safe, each file is used by one session. The quota is shared.
+ */
+class SpillFile: public rpc::NoCopy {
+    int fd_;
+    rpc::i64 read_off_;
+    rpc::i64 write_off_;
+
+    static volatile rpc::i64 disk_used;
+    static volatile rpc::i64 n_files;
+    static volatile rpc::i64 n_bytes_spilled;
+
+    SpillFile(int fd)
+            : fd_(fd), read_off_(0), write_off_(0) {
+    }
+
+public:
+
+    // outbound buffers larger than this spill to disk, 0 disables spilling
+    static rpc::i64 threshold;
+    // max bytes held by all spill files together
+    static rpc::i64 quota;
+    static std::string dir;
+
+    /**
+     * Returns NULL if out of quota, or the file cannot be created.
+     */
+    static SpillFile* create();
+
+    ~SpillFile();
+
+    /**
+     * Whether quota is left for another n bytes.
+     */
+    static bool has_room(int n) {
+        return disk_used + n <= quota;
+    }
+
+    /**
+     * Bytes not yet read back.
+     */
+    rpc::i64 size() const {
+        return write_off_ - read_off_;
+    }
+
+    /**
+     * Returns false on I/O errors.
+     */
+    bool append(const void* p, int n);
+
+    /**
+     * Read back up to n bytes, in the order they were appended.
+     * Returns number of bytes read, or -1 on I/O errors.
+     */
+    int read(void* p, int n);
+
+    static void dump_stats();
+};
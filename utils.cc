@@ -1,12 +1,31 @@
+#include <string>
 #include <utility>
+#include <algorithm>
 
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif // __linux__
+#include <netdb.h>
 
 #include "utils.h"
 
+using namespace std;
+
 namespace rpc {
 
+int ThreadPool::grow_delay_ms = 20;
+int ThreadPool::idle_exit_ms = 10 * 1000;
+
 void* ThreadPool::start_thread_pool(void* args) {
     std::pair<ThreadPool*, int>* thread_args = (std::pair<ThreadPool*, int>*) args;
     ThreadPool* threadpool = thread_args->first;
@@ -19,51 +38,307 @@ void* ThreadPool::start_thread_pool(void* args) {
     return NULL;
 }
 
-ThreadPool::ThreadPool(int n /* =... */)
-        : n_(n) {
-    th_ = new pthread_t[n_];
-    q_ = new Queue<Runnable*> [n_];
+void* ThreadPool::start_manager(void* args) {
+    ((ThreadPool *) args)->run_manager();
+    pthread_exit(NULL);
+    return NULL;
+}
+
+static int round_up_pow2(int n) {
+    int r = 1;
+    while (r < n) {
+        r <<= 1;
+    }
+    return r;
+}
+
+ThreadPool::ThreadPool(int min_threads /* =... */, int max_threads /* =... */, int max_queued /* =... */)
+        : min_threads_(min_threads), max_threads_(max_threads), n_threads_(0), jobs_(round_up_pow2(max_queued)),
+          wake_seq_(0), n_parked_(0), n_pending_(0), stop_(false), queue_moved_us_(time_now_us()), delay_sum_us_(0),
+          delay_max_us_(0), n_taken_(0), n_rejected_(0) {
+    verify(min_threads_ >= 1 && max_threads_ >= min_threads_);
+
+    memset((void *) delay_hist_, 0, sizeof(delay_hist_));
+#ifndef __linux__
+    Pthread_mutex_init(&park_m_, NULL);
+    Pthread_cond_init(&park_cv_, NULL);
+#endif // __linux__
+
+    Pthread_mutex_init(&slots_m_, NULL);
+    workers_ = new Worker[max_threads_];
+    for (int i = 0; i < max_threads_; i++) {
+        workers_[i].state = SLOT_FREE;
+    }
+
+    Pthread_mutex_lock(&slots_m_);
+    for (int i = 0; i < min_threads_; i++) {
+        start_worker(i);
+    }
+    Pthread_mutex_unlock(&slots_m_);
 
-    for (int i = 0; i < n_; i++) {
-        std::pair<ThreadPool*, int>* thread_args = new std::pair<ThreadPool*, int>;
-        thread_args->first = this;
-        thread_args->second = i;
-        Pthread_create(&th_[i], NULL, ThreadPool::start_thread_pool, thread_args);
+    if (max_threads_ > min_threads_) {
+        Pthread_create(&manager_th_, NULL, ThreadPool::start_manager, this);
     }
 }
 
 ThreadPool::~ThreadPool() {
-    for (int i = 0; i < n_; i++) {
-        q_[i].push(NULL);	// NULL is used as a termination token
+    // no thread starts or retires after this
+    Pthread_mutex_lock(&slots_m_);
+    stop_ = true;
+    Pthread_mutex_unlock(&slots_m_);
+
+    if (max_threads_ > min_threads_) {
+        Pthread_join(manager_th_, NULL);
+    }
+    wake(max_threads_);
+
+    for (int i = 0; i < max_threads_; i++) {
+        if (workers_[i].state != SLOT_FREE) {
+            Pthread_join(workers_[i].th, NULL);
+        }
+    }
+    delete[] workers_;
+    Pthread_mutex_destroy(&slots_m_);
+
+#ifndef __linux__
+    Pthread_cond_destroy(&park_cv_);
+    Pthread_mutex_destroy(&park_m_);
+#endif // __linux__
+}
+
+// slots_m_ must be held
+void ThreadPool::start_worker(int slot) {
+    Worker& w = workers_[slot];
+    verify(w.state == SLOT_FREE);
+    w.state = SLOT_RUNNING;
+    n_threads_++;
+
+    std::pair<ThreadPool*, int>* thread_args = new std::pair<ThreadPool*, int>;
+    thread_args->first = this;
+    thread_args->second = slot;
+    Pthread_create(&w.th, NULL, ThreadPool::start_thread_pool, thread_args);
+}
+
+bool ThreadPool::grow() {
+    bool grown = false;
+    Pthread_mutex_lock(&slots_m_);
+    if (!stop_ && n_threads_ < max_threads_) {
+        for (int i = 0; i < max_threads_; i++) {
+            Worker& w = workers_[i];
+            if (w.state == SLOT_RUNNING) {
+                continue;
+            }
+            if (w.state == SLOT_EXITED) {
+                // the thread has left run_thread() already
+                Pthread_join(w.th, NULL);
+                w.state = SLOT_FREE;
+            }
+            start_worker(i);
+            grown = true;
+            break;
+        }
     }
-    for (int i = 0; i < n_; i++) {
-        Pthread_join(th_[i], NULL);
+    Pthread_mutex_unlock(&slots_m_);
+    return grown;
+}
+
+bool ThreadPool::retire(int tid) {
+    bool retired = false;
+    Pthread_mutex_lock(&slots_m_);
+    if (!stop_ && n_threads_ > min_threads_ && n_pending_ == 0) {
+        n_threads_--;
+        workers_[tid].state = SLOT_EXITED;
+        retired = true;
     }
-    delete[] th_;
-    delete[] q_;
+    Pthread_mutex_unlock(&slots_m_);
+    return retired;
 }
 
-void ThreadPool::run_async(Runnable* r) {
+void ThreadPool::run_manager() {
+    int tick_us = max(1000, grow_delay_ms * 1000 / 2);
+    while (!stop_) {
+        usleep(tick_us);
+        // every thread is stuck in a job and nothing was taken for a while
+        i64 now = time_now_us();
+        if (n_pending_ > 0 && n_parked_ == 0 && now - queue_moved_us_ > grow_delay_ms * 1000LL) {
+            if (grow()) {
+                // give the new thread time to take a job before starting another
+                queue_moved_us_ = now;
+            }
+        }
+    }
+}
+
+bool ThreadPool::push(Runnable* r, bool wait) {
     verify(r != NULL);
-    // NULL is used to terminate a thread
 
-    // Randomly select a thread for the job.
-    // There could be better schedule policy.
-    int queue_id = rand() % n_;
-    q_[queue_id].push(r);
+    Job j;
+    j.r = r;
+    j.queued_us = time_now_us();
+
+    // counted before the push so it never drops below zero when the job is
+    // taken right away, and before checking for parked threads so a thread
+    // about to park sees it
+    if (__sync_add_and_fetch(&n_pending_, 1) == 1) {
+        queue_moved_us_ = j.queued_us;
+    }
+
+    while (!jobs_.try_push(j)) {
+        if (!wait) {
+            __sync_sub_and_fetch(&n_pending_, 1);
+            __sync_add_and_fetch(&n_rejected_, 1);
+            return false;
+        }
+        // all threads are busy with a full queue behind them
+        if (n_parked_ > 0) {
+            wake(1);
+        }
+        sched_yield();
+    }
+
+    if (n_parked_ > 0) {
+        wake(1);
+    }
+    return true;
+}
+
+void ThreadPool::run_async(Runnable* r) {
+    push(r, true);
+}
+
+bool ThreadPool::try_run_async(Runnable* r) {
+    return push(r, false);
+}
+
+void ThreadPool::wake(int n_threads) {
+    __sync_add_and_fetch(&wake_seq_, 1);
+#ifdef __linux__
+    syscall(SYS_futex, &wake_seq_, FUTEX_WAKE_PRIVATE, n_threads, NULL, NULL, 0);
+#else
+    Pthread_mutex_lock(&park_m_);
+    if (n_threads == 1) {
+        Pthread_cond_signal(&park_cv_);
+    } else {
+        Pthread_cond_broadcast(&park_cv_);
+    }
+    Pthread_mutex_unlock(&park_m_);
+#endif // __linux__
+}
+
+// wait until jobs are pending, returns false if the pool is stopped and drained,
+// *idle tells if the wait timed out
+bool ThreadPool::park(bool* idle) {
+    *idle = false;
+
+    // read before checking for jobs, any wake() after that moves it
+    int seen = wake_seq_;
+    __sync_add_and_fetch(&n_parked_, 1);
+    if (n_pending_ == 0 && !stop_) {
+        // only threads above the minimum may retire, but any of them can be it
+        bool may_retire = max_threads_ > min_threads_;
+#ifdef __linux__
+        struct timespec timeout;
+        timeout.tv_sec = idle_exit_ms / 1000;
+        timeout.tv_nsec = (idle_exit_ms % 1000) * 1000 * 1000;
+        // returns right away if wake_seq_ is no longer seen
+        if (syscall(SYS_futex, &wake_seq_, FUTEX_WAIT_PRIVATE, seen, may_retire ? &timeout : NULL, NULL, 0) != 0
+                && errno == ETIMEDOUT) {
+            *idle = true;
+        }
+#else
+        struct timespec deadline;
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        i64 deadline_us = (i64) now.tv_sec * 1000 * 1000 + now.tv_usec + idle_exit_ms * 1000LL;
+        deadline.tv_sec = deadline_us / (1000 * 1000);
+        deadline.tv_nsec = (deadline_us % (1000 * 1000)) * 1000;
+        Pthread_mutex_lock(&park_m_);
+        while (wake_seq_ == seen) {
+            if (!may_retire) {
+                Pthread_cond_wait(&park_cv_, &park_m_);
+            } else if (pthread_cond_timedwait(&park_cv_, &park_m_, &deadline) == ETIMEDOUT) {
+                *idle = true;
+                break;
+            }
+        }
+        Pthread_mutex_unlock(&park_m_);
+#endif // __linux__
+    }
+    __sync_sub_and_fetch(&n_parked_, 1);
+    return !(stop_ && n_pending_ == 0);
+}
+
+void ThreadPool::count_delay(i64 delay_us) {
+    int bucket = 0;
+    while (bucket < n_delay_buckets - 1 && delay_us >= (1000LL << bucket)) {
+        bucket++;
+    }
+    __sync_add_and_fetch(&delay_hist_[bucket], 1);
+    __sync_add_and_fetch(&delay_sum_us_, delay_us);
+    __sync_add_and_fetch(&n_taken_, 1);
+
+    i64 old_max = delay_max_us_;
+    while (delay_us > old_max && !__sync_bool_compare_and_swap(&delay_max_us_, old_max, delay_us)) {
+        old_max = delay_max_us_;
+    }
 }
 
 void ThreadPool::run_thread(int tid) {
     for (;;) {
-        Runnable* j = q_[tid].pop();
-        if (j == NULL) {
+        Job j;
+        if (jobs_.try_pop(&j)) {
+            __sync_sub_and_fetch(&n_pending_, 1);
+            i64 now = time_now_us();
+            queue_moved_us_ = now;
+            i64 delay_us = now - j.queued_us;
+            count_delay(delay_us);
+
+            // others are queued behind a late job and no thread is free
+            if (delay_us > grow_delay_ms * 1000LL && n_pending_ > 0 && n_parked_ == 0
+                    && n_threads_ < max_threads_) {
+                grow();
+            }
+
+            j.r->run();
+            delete j.r;
+            continue;
+        }
+
+        // returns right away if a job was pushed after the queue looked empty
+        bool idle;
+        if (!park(&idle)) {
+            return;
+        }
+        if (idle && retire(tid)) {
             return;
         }
-        j->run();
-        delete j;
     }
 }
 
+void ThreadPool::dump_stats() {
+    Log::info("thread pool: %d threads (min %d, max %d), %d idle, %d jobs queued (queue size %d), %lld rejected",
+            (int) n_threads_, min_threads_, max_threads_, (int) n_parked_, (int) n_pending_, jobs_.capacity(),
+            (long long) n_rejected_);
+
+    i64 n_taken = n_taken_;
+    if (n_taken == 0) {
+        return;
+    }
+    // upper bound of the bucket holding the 99th percentile
+    i64 below = 0;
+    int bucket = 0;
+    while (bucket < n_delay_buckets - 1) {
+        below += delay_hist_[bucket];
+        if (below * 100 >= n_taken * 99) {
+            break;
+        }
+        bucket++;
+    }
+    double p99_ms = bucket < n_delay_buckets - 1 ? (double) (1 << bucket) : delay_max_us_ / 1000.0;
+    Log::info("job queueing delay: %lld jobs, avg %.2f ms, p99 < %.0f ms, max %.2f ms", (long long) n_taken,
+            delay_sum_us_ / 1000.0 / n_taken, p99_ms, delay_max_us_ / 1000.0);
+}
+
 int Log::level = Log::DEBUG;
 FILE* Log::fp = stdout;
 pthread_mutex_t Log::m = PTHREAD_MUTEX_INITIALIZER;
@@ -148,4 +423,178 @@ int set_nonblocking(int fd, bool nonblocking) {
     return ret;
 }
 
+i64 time_now_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (i64) now.tv_sec * 1000 * 1000 + now.tv_nsec / 1000;
+}
+
+int n_cpus() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int) n : 1;
+}
+
+int current_cpu() {
+#ifdef __linux__
+    return sched_getcpu();
+#else
+    return -1;
+#endif // __linux__
+}
+
+int numa_node_of_cpu(int cpu) {
+#ifdef __linux__
+    if (cpu < 0) {
+        return 0;
+    }
+    // cpuN has a nodeM link in sysfs on numa systems
+    for (int node = 0; node < 64; node++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/node%d", cpu, node);
+        if (access(path, F_OK) == 0) {
+            return node;
+        }
+    }
+#endif // __linux__
+    return 0;
+}
+
+bool pin_to_cpu(int cpu) {
+#ifdef __linux__
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0;
+#else
+    return false;
+#endif // __linux__
+}
+
+int incoming_cpu(int sock) {
+#ifdef SO_INCOMING_CPU
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+    if (getsockopt(sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0) {
+        return cpu;
+    }
+#endif // SO_INCOMING_CPU
+    return -1;
+}
+
+int connect_to(const char* addr, int timeout_ms /* =... */) {
+    int sock;
+    string addr_str(addr);
+    int idx = addr_str.find(":");
+    if (idx == string::npos) {
+        Log::error("connect_to(): bad connect address: %s", addr);
+        errno = EINVAL;
+        return -1;
+    }
+    string host = addr_str.substr(0, idx);
+    string port = addr_str.substr(idx + 1);
+
+    struct addrinfo hints, *result, *rp;
+    memset(&hints, 0, sizeof(struct addrinfo));
+
+    hints.ai_family = AF_INET; // ipv4
+    hints.ai_socktype = SOCK_STREAM; // tcp
+
+    int r = getaddrinfo(host.c_str(), port.c_str(), &hints, &result);
+    if (r != 0) {
+        Log::error("connect_to(): getaddrinfo(): %s", gai_strerror(r));
+        return -1;
+    }
+
+    for (rp = result; rp != NULL; rp = rp->ai_next) {
+        sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+        if (sock == -1) {
+            continue;
+        }
+
+        const int yes = 1;
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+        if (timeout_ms > 0) {
+            // bounds connect() too on Linux
+            struct timeval tv;
+            tv.tv_sec = timeout_ms / 1000;
+            tv.tv_usec = (timeout_ms % 1000) * 1000;
+            setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        }
+
+        if (::connect(sock, rp->ai_addr, rp->ai_addrlen) == 0) {
+            break;
+        }
+        ::close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(result);
+
+    if (rp == NULL) {
+        // failed to connect
+        Log::error("connect_to(): connect(): %s", strerror(errno));
+        return -1;
+    }
+
+    return sock;
+}
+
+int bind_on(const char* bind_addr, struct addrinfo **result, struct addrinfo **rp) {
+    int server_sock = -1;
+
+    string addr(bind_addr);
+    int idx = addr.find(":");
+    if (idx == string::npos) {
+        Log::error("bind_on(): bad bind address: %s", bind_addr);
+        errno = EINVAL;
+        return -1;
+    }
+    string host = addr.substr(0, idx);
+    string port = addr.substr(idx + 1);
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(struct addrinfo));
+
+    hints.ai_family = AF_INET; // ipv4
+    hints.ai_socktype = SOCK_STREAM; // tcp
+    hints.ai_flags = AI_PASSIVE; // server side
+
+    int r = getaddrinfo((host == "0.0.0.0") ? NULL : host.c_str(), port.c_str(), &hints, result);
+    if (r != 0) {
+        Log::error("bind_on(): getaddrinfo(): %s", gai_strerror(r));
+        return -1;
+    }
+
+    for (*rp = *result; *rp != NULL; *rp = (*rp)->ai_next) {
+        server_sock = socket((*rp)->ai_family, (*rp)->ai_socktype, (*rp)->ai_protocol);
+        if (server_sock == -1) {
+            continue;
+        }
+
+        const int yes = 1;
+        setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+        if (bind(server_sock, (*rp)->ai_addr, (*rp)->ai_addrlen) == 0) {
+            break;
+        }
+        close(server_sock);
+        server_sock = -1;
+    }
+
+    if (*rp == NULL) {
+        // failed to bind
+        Log::error("bind_on(): bind(): %s", strerror(errno));
+        freeaddrinfo(*result);
+        return -1;
+    }
+
+    verify(server_sock >= 0);
+
+    // about backlog: http://www.linuxjournal.com/files/linuxjournal.com/linuxjournal/articles/023/2333/2333s2.html
+    const int backlog = SOMAXCONN;
+    verify(listen(server_sock, backlog) == 0);
+
+    return server_sock;
+}
+
 }
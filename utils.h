@@ -8,6 +8,7 @@
 #include <assert.h>
 #include <pthread.h>
 #include <inttypes.h>
+#include <netdb.h>
 
 /**
  * Use assert() when the test is only intended for debugging.
@@ -26,6 +27,7 @@
 #define Pthread_cond_init(c, attr) verify(pthread_cond_init(c, attr) == 0)
 #define Pthread_cond_destroy(c) verify(pthread_cond_destroy(c) == 0)
 #define Pthread_cond_signal(c) verify(pthread_cond_signal(c) == 0)
+#define Pthread_cond_broadcast(c) verify(pthread_cond_broadcast(c) == 0)
 #define Pthread_cond_wait(c, m) verify(pthread_cond_wait(c, m) == 0)
 #define Pthread_create(th, attr, func, arg) verify(pthread_create(th, attr, func, arg) == 0)
 #define Pthread_join(th, attr) verify(pthread_join(th, attr) == 0)
@@ -34,6 +36,8 @@ namespace rpc {
 
 typedef int32_t i32;
 typedef int64_t i64;
+typedef uint32_t u32;
+typedef uint64_t u64;
 
 class Log {
     static int level;
@@ -80,98 +84,251 @@ public:
  * Note: All sub class of RefCounted *MUST* have protected destructor!
  * This prevents accidentally deleting the object.
  * You are only allowed to cleanup with release() call.
- * This is thread safe.
+ * This is thread safe, the counter is updated with atomic operations, so
+ * there is no per-object lock.
  */
 class RefCounted: public NoCopy {
-    pthread_mutex_t m_;
-    int refcnt_;
+    volatile int refcnt_;
 
 protected:
 
     virtual ~RefCounted() {
-        Pthread_mutex_destroy(&m_);
     }
 
 public:
 
     RefCounted()
             : refcnt_(1) {
-        Pthread_mutex_init(&m_, NULL);
     }
 
     RefCounted* ref_copy() {
-        Pthread_mutex_lock(&m_);
-        refcnt_++;
-        Pthread_mutex_unlock(&m_);
+        __sync_add_and_fetch(&refcnt_, 1);
         return this;
     }
 
     void release() {
-        Pthread_mutex_lock(&m_);
-        refcnt_--;
-        verify(refcnt_ >= 0);
-        bool should_delete = (refcnt_ == 0);
-        Pthread_mutex_unlock(&m_);
-        if (should_delete) {
+        int r = __sync_sub_and_fetch(&refcnt_, 1);
+        verify(r >= 0);
+        if (r == 0) {
             delete this;
         }
     }
 };
 
 /**
- * Thread safe queue.
+ * Bounded lock-free queue, for any number of producers and consumers.
+ *
+ * A ring of cells, each with a sequence number that tells producers and
+ * consumers whether the cell is free for the current lap or holds an element,
+ * so a push or pop is one compare-and-swap on the ring position and no memory
+ * is allocated. Capacity must be a power of two. Neither call blocks, callers
+ * decide how to wait.
  */
 template<class T>
-class Queue {
-    std::list<T> q_;
-    pthread_cond_t not_empty_;
-    pthread_mutex_t m_;
+class RingQueue {
+    struct Cell {
+        volatile u64 seq;
+        T data;
+    };
+
+    Cell* cells_;
+    u64 mask_;
+
+    // producers and consumers each on their own cache line
+    char pad0_[64];
+    volatile u64 push_pos_;
+    char pad1_[64];
+    volatile u64 pop_pos_;
+    char pad2_[64];
+
+    // not copyable
+    RingQueue(const RingQueue&);
+    RingQueue& operator =(const RingQueue&);
 
 public:
 
-    Queue() {
-        Pthread_mutex_init(&m_, NULL);
-        Pthread_cond_init(&not_empty_, NULL);
+    RingQueue(int capacity)
+            : mask_(capacity - 1), push_pos_(0), pop_pos_(0) {
+        verify(capacity > 0 && (capacity & (capacity - 1)) == 0);
+        cells_ = new Cell[capacity];
+        for (int i = 0; i < capacity; i++) {
+            cells_[i].seq = i;
+        }
     }
 
-    ~Queue() {
-        Pthread_cond_destroy(&not_empty_);
-        Pthread_mutex_destroy(&m_);
+    ~RingQueue() {
+        delete[] cells_;
     }
 
-    void push(const T& e) {
-        Pthread_mutex_lock(&m_);
-        q_.push_back(e);
-        Pthread_cond_signal(&not_empty_);
-        Pthread_mutex_unlock(&m_);
+    int capacity() const {
+        return (int) (mask_ + 1);
     }
 
-    T pop() {
-        Pthread_mutex_lock(&m_);
-        while (q_.empty()) {
-            Pthread_cond_wait(&not_empty_, &m_);
+    // approximate while other threads push or pop
+    int size() const {
+        i64 n = (i64) (push_pos_ - pop_pos_);
+        return n < 0 ? 0 : (int) n;
+    }
+
+    // returns false if full
+    bool try_push(const T& e) {
+        Cell* cell;
+        u64 pos = __atomic_load_n(&push_pos_, __ATOMIC_RELAXED);
+        for (;;) {
+            cell = &cells_[pos & mask_];
+            u64 seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+            i64 diff = (i64) (seq - pos);
+            if (diff == 0) {
+                if (__sync_bool_compare_and_swap(&push_pos_, pos, pos + 1)) {
+                    break;
+                }
+                pos = __atomic_load_n(&push_pos_, __ATOMIC_RELAXED);
+            } else if (diff < 0) {
+                // cell still holds the element from the previous lap
+                return false;
+            } else {
+                pos = __atomic_load_n(&push_pos_, __ATOMIC_RELAXED);
+            }
         }
-        T e = q_.front();
-        q_.pop_front();
-        Pthread_mutex_unlock(&m_);
-        return e;
+        cell->data = e;
+        __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    // returns false if empty
+    bool try_pop(T* e) {
+        Cell* cell;
+        u64 pos = __atomic_load_n(&pop_pos_, __ATOMIC_RELAXED);
+        for (;;) {
+            cell = &cells_[pos & mask_];
+            u64 seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+            i64 diff = (i64) (seq - (pos + 1));
+            if (diff == 0) {
+                if (__sync_bool_compare_and_swap(&pop_pos_, pos, pos + 1)) {
+                    break;
+                }
+                pos = __atomic_load_n(&pop_pos_, __ATOMIC_RELAXED);
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = __atomic_load_n(&pop_pos_, __ATOMIC_RELAXED);
+            }
+        }
+        *e = cell->data;
+        __atomic_store_n(&cell->seq, pos + mask_ + 1, __ATOMIC_RELEASE);
+        return true;
     }
 };
 
+/**
+ * Runs jobs on between min and max threads.
+ *
+ * All threads take jobs, oldest first, from one shared queue, so a job stuck
+ * on a slow client never holds up jobs behind it while other threads are
+ * idle. The queue is a bounded lock-free ring. Threads only sleep, on a
+ * futex, when no job is pending, and submitters only make a syscall when a
+ * thread sleeps.
+ *
+ * The pool starts min threads, and starts another one, up to max, when a job
+ * has been queued for longer than grow_delay_ms. Threads above min exit after
+ * idle_exit_ms without work.
+ */
 class ThreadPool {
-    int n_;
-    pthread_t* th_;
-    Queue<Runnable*>* q_;
+    struct Job {
+        Runnable* r;
+        i64 queued_us;
+    };
+
+    enum { SLOT_FREE, SLOT_RUNNING, SLOT_EXITED };
+
+    struct Worker {
+        pthread_t th;
+        int state;
+    };
+
+    int min_threads_;
+    int max_threads_;
+
+    // one slot per possible thread, guarded by slots_m_
+    Worker* workers_;
+    pthread_mutex_t slots_m_;
+    volatile int n_threads_;
+
+    RingQueue<Job> jobs_;
+
+    // idle threads park until wake_seq_ moves, a futex word on Linux
+    volatile int wake_seq_;
+    volatile int n_parked_;
+    volatile int n_pending_;
+    volatile bool stop_;
+#ifndef __linux__
+    pthread_mutex_t park_m_;
+    pthread_cond_t park_cv_;
+#endif // __linux__
+
+    // starts threads while all are stuck in jobs, if max > min
+    pthread_t manager_th_;
+    // when the oldest pending job last changed
+    volatile i64 queue_moved_us_;
+
+    // queueing delay of jobs, bucket i counts delays below 2^i ms
+    static const int n_delay_buckets = 16;
+    volatile i64 delay_hist_[n_delay_buckets];
+    volatile i64 delay_sum_us_;
+    volatile i64 delay_max_us_;
+    volatile i64 n_taken_;
+    volatile i64 n_rejected_;
 
     static void* start_thread_pool(void*);
+    static void* start_manager(void*);
     void run_thread(int tid);
+    void run_manager();
+    void count_delay(i64 delay_us);
+    bool park(bool* idle);
+    void wake(int n_threads);
+    void start_worker(int slot);
+    bool grow();
+    bool retire(int tid);
+    bool push(Runnable* r, bool wait);
 
 public:
-    ThreadPool(int n = 64);
+
+    // a job queued for longer than this starts another thread
+    static int grow_delay_ms;
+
+    // threads above the minimum exit after being idle this long
+    static int idle_exit_ms;
+
+    /**
+     * max_queued bounds the job queue, rounded up to a power of two.
+     */
+    ThreadPool(int min_threads = 64, int max_threads = 64, int max_queued = 65536);
+
+    // runs all pending jobs before returning
     ~ThreadPool();
 
     // NOTE: Runnable* will be deleted after execution.
+    // Waits for room if the job queue is full.
     void run_async(Runnable*);
+
+    /**
+     * Like run_async(), but returns false right away if the job queue is
+     * full. The Runnable is then not taken, the caller still owns it.
+     */
+    bool try_run_async(Runnable*);
+
+    // jobs waiting for a thread, and how many may wait
+    int pending() const {
+        return n_pending_;
+    }
+    int max_pending() const {
+        return jobs_.capacity();
+    }
+
+    /**
+     * Log threads, queue depth, rejected jobs, and queueing delay.
+     */
+    void dump_stats();
 };
 
 class Counter {
@@ -193,7 +350,105 @@ public:
     }
 };
 
+/**
+ * Lets through rate tokens per second on average, and bursts of up to burst
+ * tokens. Starts full. Tokens may also be spent beyond what is there, which
+ * is paid back before any more are let through. Not thread safe.
+ */
+class TokenBucket {
+    double rate_;
+    double burst_;
+    double tokens_;
+    i64 last_us_;
+public:
+    TokenBucket(double rate = 0, double burst = 0)
+            : rate_(rate), burst_(burst), tokens_(burst), last_us_(0) {
+    }
+
+    void refill(i64 now_us) {
+        if (last_us_ != 0 && now_us > last_us_) {
+            tokens_ += (now_us - last_us_) * rate_ / 1000000.0;
+            if (tokens_ > burst_) {
+                tokens_ = burst_;
+            }
+        }
+        last_us_ = now_us;
+    }
+
+    // takes n tokens if there are that many
+    bool take(double n, i64 now_us) {
+        refill(now_us);
+        if (tokens_ < n) {
+            return false;
+        }
+        tokens_ -= n;
+        return true;
+    }
+
+    // back to where it started, as far as anyone can tell
+    bool full(i64 now_us) {
+        refill(now_us);
+        return tokens_ >= burst_;
+    }
+
+    // change the limits, keeping the tokens there are (a full bucket if never used)
+    void set(double rate, double burst) {
+        rate_ = rate;
+        burst_ = burst;
+        if (last_us_ == 0 || tokens_ > burst_) {
+            tokens_ = burst_;
+        }
+    }
+
+    double rate() const {
+        return rate_;
+    }
+
+    double available(i64 now_us) {
+        refill(now_us);
+        return tokens_;
+    }
+
+    void spend(double n) {
+        tokens_ -= n;
+    }
+
+    // how long until n tokens are there, 0 if they are
+    i64 wait_us(double n, i64 now_us) {
+        refill(now_us);
+        if (tokens_ >= n || rate_ <= 0) {
+            return 0;
+        }
+        return (i64) ((n - tokens_) * 1000000.0 / rate_) + 1;
+    }
+};
+
 int set_nonblocking(int fd, bool nonblocking);
 
+// monotonic clock, in microseconds
+i64 time_now_us();
+
+// online cpus, at least 1
+int n_cpus();
+
+// cpu the caller runs on, -1 if unknown
+int current_cpu();
+
+// numa node of a cpu, 0 if unknown or not numa
+int numa_node_of_cpu(int cpu);
+
+// pin the calling thread to one cpu, returns false if not supported
+bool pin_to_cpu(int cpu);
+
+// cpu whose rx queue delivered the packets of a socket, -1 if unknown
+int incoming_cpu(int sock);
+
+// connect to "host:port", returns a blocking socket, or -1 on failure
+// with timeout_ms > 0, connecting gives up after that long (Linux only)
+int connect_to(const char* addr, int timeout_ms = -1);
+
+// bind and listen on "host:port", returns the server socket, or -1 on failure
+int bind_on(const char* bind_addr, struct addrinfo **result, struct addrinfo **rp);
+
 }
 
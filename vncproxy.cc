@@ -4,11 +4,13 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <limits.h>
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <pthread.h>
+#include <sys/time.h>
 
 #include <sqlite3.h>
 
@@ -16,290 +18,54 @@
 #include "utils.h"
 #include "marshal.h"
 #include "polling.h"
+#include "session.h"
+#include "governor.h"
+#include "spill.h"
+#include "routes.h"
+#include "replication.h"
+#include "handshake.h"
+#include "admission.h"
 
 using namespace std;
 using namespace rpc;
 
 bool global_stop_flag = false;
+bool global_dump_stats_flag = false;
+// poll threads asked to start and drain by signals, only ever incremented by
+// the handler: the main loop acts on what it has not seen yet
+volatile sig_atomic_t global_poll_threads_started = 0;
+volatile sig_atomic_t global_poll_threads_drained = 0;
 sqlite3 *global_db;
+RouteTable *global_routes;
 pthread_mutex_t global_m = PTHREAD_MUTEX_INITIALIZER;
 
-class EndPoint: public Pollable {
-    PollMgr* poll_;
-    int fd_;
-    EndPoint* peer_;
-    string forward_key_;
-
-    bool leader_;
-    Marshal buf_;
-    pthread_mutex_t m_;
-    bool enabled_;
-
-    static pthread_mutex_t all_tie_leaders_m;
-    static multimap<string, EndPoint*> all_tie_leaders;
-
+class SessionRevoker: public RouteListener {
 public:
-    EndPoint(PollMgr* pmgr, int fd)
-    : poll_(pmgr), fd_(fd), peer_(NULL), leader_(false), enabled_(false) {
-        Pthread_mutex_init(&m_, NULL);
-    }
-
-    ~EndPoint() {
-        Pthread_mutex_destroy(&m_);
-    }
-
-    void tie(EndPoint* o, const string& forward_key) {
-        this->forward_key_ = forward_key;
-        this->leader_ = true;
-        this->peer_ = o;
-        o->peer_ = this;
-
-        Pthread_mutex_lock(&all_tie_leaders_m);
-        all_tie_leaders.insert(make_pair(forward_key_, this));
-        Pthread_mutex_unlock(&all_tie_leaders_m);
-    }
-
-    void handle_read() {
-        if (!enabled_) {
-            return;
-        }
-        Pthread_mutex_lock(&peer_->m_);
-        int cnt = peer_->buf_.read_from_fd(fd_);
-        if (cnt > 0) {
-            poll_->update_mode(peer_, Pollable::READ | Pollable::WRITE);
-        }
-        Pthread_mutex_unlock(&peer_->m_);
-        //Log::debug("read (fd=%d): cnt=%d", fd_, cnt);
-    }
-
-    void handle_write() {
-        if (!enabled_) {
-            return;
-        }
-        Pthread_mutex_lock(&m_);
-        int cnt = buf_.write_to_fd(fd_);
-        if (buf_.content_size_gt(0)) {
-            poll_->update_mode(this, Pollable::READ | Pollable::WRITE);
-        } else {
-            poll_->update_mode(this, Pollable::READ);
-        }
-        Pthread_mutex_unlock(&m_);
-        //Log::debug("write (fd=%d): cnt=%d", fd_, cnt);
-    }
-
-    int fd() {
-        return fd_;
-    }
-
-    void shutdown() {
-        close(fd_);
-        poll_->remove(this);
-        if (leader_) {
-            peer_->shutdown();
-
-            Pthread_mutex_lock(&all_tie_leaders_m);
-            for (multimap<string, EndPoint*>::iterator it = all_tie_leaders.lower_bound(forward_key_); it != all_tie_leaders.upper_bound(forward_key_); ++it) {
-                if (it->second == this) {
-                    all_tie_leaders.erase(it);
-                    break;
-                }
-            }
-            Pthread_mutex_unlock(&all_tie_leaders_m);
-
-            Log::info("shutdown: client_fd=%d, remote_fd=%d", fd_, peer_->fd_);
-        }
-        this->release();
-        //Log::info("shutdown %d", fd_);
-    }
-
-    void handle_error() {
-        if (!enabled_) {
-            return;
-        }
-        //Log::error("error: fd=%d", fd_);
-        if (leader_) {
-            shutdown();
-        } else {
-            // peer is leader
-            peer_->shutdown();
-        }
-    }
-
-    int poll_mode() {
-        return Pollable::READ | Pollable::WRITE;
-    }
-
-    void ready() {
-        enabled_ = true;
-    }
-
-    static void cleanup(const set<string>& valid_forward_keys) {
-        list<EndPoint*> outlier;
-        Pthread_mutex_lock(&all_tie_leaders_m);
-        for (map<string, EndPoint*>::iterator it = all_tie_leaders.begin(); it != all_tie_leaders.end(); ++it) {
-            if (valid_forward_keys.find(it->first) == valid_forward_keys.end()) {
-                outlier.push_back(it->second);
-            }
-        }
-        Pthread_mutex_unlock(&all_tie_leaders_m);
-
-        for (list<EndPoint*>::iterator it = outlier.begin(); it != outlier.end(); ++it) {
-            (*it)->shutdown();
-        }
+    void route_removed(const string& forward_key) {
+        Log::info("route '%s' removed, closing its connections", forward_key.c_str());
+        Session::revoke(forward_key);
     }
 };
-multimap<string, EndPoint*> EndPoint::all_tie_leaders;
-pthread_mutex_t EndPoint::all_tie_leaders_m = PTHREAD_MUTEX_INITIALIZER;
-
-// make sure that writes to fd1 will be read from fd2, and vice versa
-// both fd1 & fd2 should be nonblocking
-void tie_fd(const string& forward_key, PollMgr* poll, int fd1, int fd2) {
-    EndPoint* ep1 = new EndPoint(poll, fd1);
-    EndPoint* ep2 = new EndPoint(poll, fd2);
-
-    ep1->tie(ep2, forward_key);
-
-    poll->add(ep1);
-    poll->add(ep2);
-
-    ep1->ready();
-    ep2->ready();
-}
-
-int connect_to(const char* addr) {
-    int sock;
-    string addr_str(addr);
-    int idx = addr_str.find(":");
-    if (idx == string::npos) {
-        Log::error("connect_to(): bad connect address: %s", addr);
-        errno = EINVAL;
-        return -1;
-    }
-    string host = addr_str.substr(0, idx);
-    string port = addr_str.substr(idx + 1);
-
-    struct addrinfo hints, *result, *rp;
-    memset(&hints, 0, sizeof(struct addrinfo));
-
-    hints.ai_family = AF_INET; // ipv4
-    hints.ai_socktype = SOCK_STREAM; // tcp
-
-    int r = getaddrinfo(host.c_str(), port.c_str(), &hints, &result);
-    if (r != 0) {
-        Log::error("connect_to(): getaddrinfo(): %s", gai_strerror(r));
-        return -1;
-    }
-
-    for (rp = result; rp != NULL; rp = rp->ai_next) {
-        sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-        if (sock == -1) {
-            continue;
-        }
-
-        const int yes = 1;
-        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
-
-        if (::connect(sock, rp->ai_addr, rp->ai_addrlen) == 0) {
-            break;
-        }
-        ::close(sock);
-        sock = -1;
-    }
-    freeaddrinfo(result);
-
-    if (rp == NULL) {
-        // failed to connect
-        Log::error("connect_to(): connect(): %s", strerror(errno));
-        return -1;
-    }
-
-    return sock;
-}
-
-int bind_on(const char* bind_addr, struct addrinfo **result, struct addrinfo **rp) {
-    int server_sock = -1;
-
-    string addr(bind_addr);
-    int idx = addr.find(":");
-    if (idx == string::npos) {
-        Log::error("bind_on(): bad bind address: %s", bind_addr);
-        errno = EINVAL;
-        return -1;
-    }
-    string host = addr.substr(0, idx);
-    string port = addr.substr(idx + 1);
-
-    struct addrinfo hints;
-    memset(&hints, 0, sizeof(struct addrinfo));
-
-    hints.ai_family = AF_INET; // ipv4
-    hints.ai_socktype = SOCK_STREAM; // tcp
-    hints.ai_flags = AI_PASSIVE; // server side
-
-    int r = getaddrinfo((host == "0.0.0.0") ? NULL : host.c_str(), port.c_str(), &hints, result);
-    if (r != 0) {
-        Log::error("bind_on(): getaddrinfo(): %s", gai_strerror(r));
-        return -1;
-    }
-
-    for (*rp = *result; *rp != NULL; *rp = (*rp)->ai_next) {
-        server_sock = socket((*rp)->ai_family, (*rp)->ai_socktype, (*rp)->ai_protocol);
-        if (server_sock == -1) {
-            continue;
-        }
-
-        const int yes = 1;
-        setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
-
-        if (bind(server_sock, (*rp)->ai_addr, (*rp)->ai_addrlen) == 0) {
-            break;
-        }
-        close(server_sock);
-        server_sock = -1;
-    }
-
-    if (rp == NULL) {
-        // failed to bind
-        Log::error("bind_on(): bind(): %s", strerror(errno));
-        freeaddrinfo(*result);
-        return -1;
-    }
-
-    verify(server_sock >= 0);
-
-    // about backlog: http://www.linuxjournal.com/files/linuxjournal.com/linuxjournal/articles/023/2333/2333s2.html
-    const int backlog = SOMAXCONN;
-    verify(listen(server_sock, backlog) == 0);
-
-    return server_sock;
-}
 
 struct vnc_auth_info {
     unsigned char* challenge;
     unsigned char* response;
     bool matched;
-    string forward_key;
-    string dest_addr;
-    bool has_dest_passwd;
-    string dest_passwd;
+    Route route;
 
     vnc_auth_info(unsigned char* chal, unsigned char* resp)
-            : challenge(chal), response(resp), matched(false), has_dest_passwd(false) {
+            : challenge(chal), response(resp), matched(false) {
     }
 };
 
 // locked by global_m
-int vnc_auth_callback(void* cb_args, int columns, char** values, char** column_names) {
+int vnc_auth_callback(void* cb_args, const Route& route) {
     vnc_auth_info* auth_info = (vnc_auth_info *) cb_args;
 
-    if (auth_info->matched) {
-        return 0;
-    }
-
     unsigned char auth_key[8];
     unsigned char expected_response[16];
     memset(auth_key, 0, 8);
-    memcpy(auth_key, values[0], strlen(values[0]));
+    memcpy(auth_key, route.forward_key.c_str(), min((size_t) 8, route.forward_key.length()));
     rfbDesKey(auth_key, EN0);
 
     for (int i = 0; i < 16; i += 8) {
@@ -308,149 +74,144 @@ int vnc_auth_callback(void* cb_args, int columns, char** values, char** column_n
 
     if (memcmp(auth_info->response, expected_response, 16) == 0) {
         auth_info->matched = true;
-        auth_info->forward_key = values[0];
-        auth_info->dest_addr = values[1];
-        if (values[2] != NULL) {
-            auth_info->has_dest_passwd = true;
-            auth_info->dest_passwd = values[2];
-        }
+        auth_info->route = route;
+        return 1;
     }
 
     return 0;
 }
 
-class VncOperator: public Runnable {
-    PollMgr* poll_;
-    int clnt_;
-public:
-    VncOperator(PollMgr* pmgr, int clnt)
-            : poll_(pmgr), clnt_(clnt) {
-    }
+// bound blocking calls on fd by deadline_us, false (with errno EAGAIN) if it passed already
+static bool set_deadline(int fd, i64 deadline_us) {
+    i64 left_us = deadline_us - time_now_us();
+    if (left_us <= 0) {
+        errno = EAGAIN;
+        return false;
+    }
+    struct timeval tv;
+    tv.tv_sec = left_us / 1000000;
+    tv.tv_usec = left_us % 1000000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    errno = 0;
+    return true;
+}
 
-    void run() {
-        // ensure clnt socket is in blocking mode, so we can easily read/write full messages
-        verify(set_nonblocking(clnt_, false) == 0);
+static bool recv_by(int fd, void* buf, int size, i64 deadline_us) {
+    return set_deadline(fd, deadline_us) && recv(fd, buf, size, MSG_WAITALL) == size;
+}
 
-        // vnc hand shake, only support protocol version 3.8
-        if (send(clnt_, "RFB 003.008\n", 12, MSG_WAITALL) < 0) {
-            Log::error("error communicating with client");
-            close(clnt_);
-            return;
-        }
+static bool send_by(int fd, const void* buf, int size, i64 deadline_us) {
+    return set_deadline(fd, deadline_us) && send(fd, buf, size, MSG_WAITALL) == size;
+}
 
-        char buf[16];
-        if (recv(clnt_, buf, 12, MSG_WAITALL) < 0) {
-            Log::error("error communicating with client");
-            close(clnt_);
-            return;
+/**
+ * The rest of a handshake, once the client sent its auth response: find the
+ * route, connect and authenticate to the VNC server, and start relaying. Runs
+ * on the thread pool, with blocking calls bounded by the handshake deadline.
+ */
+class VncOperator: public Runnable {
+    PollMgr* poll_;
+    int clnt_;
+    // given back when done with the client, unless its session took it
+    SourceAccount* source_;
+    unsigned char challenge_[16];
+    unsigned char response_[16];
+    i64 deadline_us_;
+
+    // remote_fd is -1 if not connected yet
+    void give_up(int remote_fd) {
+        bool timed_out = errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS
+                || time_now_us() >= deadline_us_;
+        if (timed_out) {
+            Log::info("handshake with client_fd=%d timed out talking to the server", clnt_);
+        } else {
+            Log::error("error communicating with remote server");
         }
-
-        buf[12] = '\0';
-        //Log::debug("client protocol: %s", buf);
-        if (strcmp(buf, "RFB 003.008\n") != 0) {
-            Log::info("client protocol not supported: %s", buf);
-            close(clnt_);
-            return;
+        Handshake::count_abort(Handshake::SERVER, timed_out);
+        if (remote_fd >= 0) {
+            close(remote_fd);
         }
+        close(clnt_);
+    }
 
-        // request passwd from client, which is used as redirect hint
-        buf[0] = 1; // 1 security type available
-        buf[1] = 2; // use VNC auth
-        if (send(clnt_, buf, 2, MSG_WAITALL) < 0) {
-            Log::error("error communicating with client");
-            close(clnt_);
-            return;
-        }
+public:
+    VncOperator(PollMgr* pmgr, int clnt, SourceAccount* source, const unsigned char* challenge,
+            const unsigned char* response, i64 deadline_us)
+            : poll_(pmgr), clnt_(clnt), source_(source), deadline_us_(deadline_us) {
+        memcpy(challenge_, challenge, sizeof(challenge_));
+        memcpy(response_, response, sizeof(response_));
+    }
 
-        if (recv(clnt_, buf, 1, MSG_WAITALL) < 0) {
-            Log::error("error communicating with client");
-            close(clnt_);
-            return;
-        }
+    ~VncOperator() {
+        Admission::leave(source_);
+    }
 
-        //Log::info("client security type: 0x%x", buf[0]);
+    void run() {
+        // blocking from here on, so we can easily read/write full messages
+        verify(set_nonblocking(clnt_, false) == 0);
 
-        // challenge client for passwd
+        char buf[256];
         unsigned char challenge[16], response[16];
-        for (int i = 0; i < sizeof(challenge); i++) {
-            challenge[i] = rand() & 0xFF;
-        }
-        if (send(clnt_, challenge, sizeof(challenge), MSG_WAITALL) < 0) {
-            Log::error("error communicating with client");
-            close(clnt_);
-            return;
-        }
-        if (recv(clnt_, response, sizeof(response), MSG_WAITALL) < 0) {
-            Log::error("error communicating with client");
-            close(clnt_);
-            return;
-        }
+        memcpy(challenge, challenge_, sizeof(challenge));
+        memcpy(response, response_, sizeof(response));
 
         Pthread_mutex_lock(&global_m);
 
         vnc_auth_info auth_info(challenge, response);
-        char* errmsg = NULL;
-        int r = sqlite3_exec(global_db, "select forward_key, dest_addr, dest_passwd from vncproxy", vnc_auth_callback, &auth_info, &errmsg);
+        global_routes->scan(vnc_auth_callback, &auth_info);
 
         Pthread_mutex_unlock(&global_m);
 
-        if (r != SQLITE_OK) {
-            Log::error("encountered sqlite error: %s", errmsg);
-            sqlite3_free(errmsg);
-            close(clnt_);
-            return;
-        }
-
         if (!auth_info.matched) {
             // tell client auth failed
             Log::info("client authentication failed");
+            Admission::auth_failed(source_);
             int32_t fail = 1;
             memcpy(buf, &fail, sizeof(fail));
-            send(clnt_, buf, sizeof(fail), MSG_WAITALL);
+            send_by(clnt_, buf, sizeof(fail), deadline_us_);
             close(clnt_);
             return;
         }
         // no need to reply 'pass', leave this to remote side
+        Admission::auth_passed(source_);
 
-        Log::info("forward client_fd=%d to: %s", clnt_, auth_info.dest_addr.c_str());
+        Log::info("forward client_fd=%d to: %s", clnt_, auth_info.route.dest_addr.c_str());
 
         // now connect to remote vnc server
-        int remote_fd = connect_to(auth_info.dest_addr.c_str());
+        i64 left_ms = (deadline_us_ - time_now_us()) / 1000;
+        int remote_fd = -1;
+        if (left_ms <= 0) {
+            errno = EAGAIN;
+        } else {
+            remote_fd = connect_to(auth_info.route.dest_addr.c_str(), (int) left_ms);
+        }
         if (remote_fd < 0) {
-            Log::error("error communicating with remote server");
-            close(clnt_);
+            give_up(-1);
             return;
         }
 
         // recv "RFB 003.008\n"
-        if (recv(remote_fd, buf, 12, MSG_WAITALL) < 0 || memcmp(buf, "RFB 003.008\n", 12) != 0) {
-            Log::error("error communicating with remote server");
-            close(remote_fd);
-            close(clnt_);
+        if (!recv_by(remote_fd, buf, 12, deadline_us_) || memcmp(buf, "RFB 003.008\n", 12) != 0) {
+            give_up(remote_fd);
             return;
         }
 
         // tell server to use protocol version 3.8
-        if (send(remote_fd, "RFB 003.008\n", 12, MSG_WAITALL) < 0) {
-            Log::error("error communicating with remote server");
-            close(remote_fd);
-            close(clnt_);
+        if (!send_by(remote_fd, "RFB 003.008\n", 12, deadline_us_)) {
+            give_up(remote_fd);
             return;
         }
 
         // recv server auth type
-        if (recv(remote_fd, buf, 1, MSG_WAITALL) < 0) {
-            Log::error("error communicating with remote server");
-            close(remote_fd);
-            close(clnt_);
+        if (!recv_by(remote_fd, buf, 1, deadline_us_)) {
+            give_up(remote_fd);
             return;
         }
 
-        int auth_types = buf[0];
-        if (recv(remote_fd, buf, auth_types, MSG_WAITALL) < 0) {
-            Log::error("error communicating with remote server");
-            close(remote_fd);
-            close(clnt_);
+        int auth_types = (unsigned char) buf[0];
+        if (auth_types == 0 || !recv_by(remote_fd, buf, auth_types, deadline_us_)) {
+            give_up(remote_fd);
             return;
         }
 
@@ -466,25 +227,19 @@ public:
         }
 
         if (support_none_auth) {
-            if (send(remote_fd, "\1", 1, MSG_WAITALL) < 0) {
-                Log::error("error communicating with remote server");
-                close(remote_fd);
-                close(clnt_);
+            if (!send_by(remote_fd, "\1", 1, deadline_us_)) {
+                give_up(remote_fd);
                 return;
             }
-        } else if (support_vnc_auth && auth_info.has_dest_passwd) {
-            if (send(remote_fd, "\2", 1, MSG_WAITALL) < 0) {
-                Log::error("error communicating with remote server");
-                close(remote_fd);
-                close(clnt_);
+        } else if (support_vnc_auth && auth_info.route.has_dest_passwd) {
+            if (!send_by(remote_fd, "\2", 1, deadline_us_)) {
+                give_up(remote_fd);
                 return;
             }
 
             // get challenge
-            if (recv(remote_fd, challenge, sizeof(challenge), MSG_WAITALL) < 0) {
-                Log::error("error communicating with remote server");
-                close(remote_fd);
-                close(clnt_);
+            if (!recv_by(remote_fd, challenge, sizeof(challenge), deadline_us_)) {
+                give_up(remote_fd);
                 return;
             }
 
@@ -493,7 +248,8 @@ public:
 
             unsigned char auth_key[8];
             memset(auth_key, 0, 8);
-            memcpy(auth_key, &(auth_info.dest_passwd[0]), auth_info.dest_passwd.length());
+            const string& passwd = auth_info.route.dest_passwd;
+            memcpy(auth_key, passwd.c_str(), min((size_t) 8, passwd.length()));
             rfbDesKey(auth_key, EN0);
 
             for (int i = 0; i < 16; i += 8) {
@@ -503,16 +259,15 @@ public:
             Pthread_mutex_unlock(&global_m);
 
             // send response
-            if (send(remote_fd, response, sizeof(response), MSG_WAITALL) < 0) {
-                Log::error("error communicating with remote server");
-                close(remote_fd);
-                close(clnt_);
+            if (!send_by(remote_fd, response, sizeof(response), deadline_us_)) {
+                give_up(remote_fd);
                 return;
             }
 
         } else {
             // auth type not supported
             Log::error("remote server authentication methods not supported");
+            Handshake::count_abort(Handshake::SERVER, false);
             close(remote_fd);
             close(clnt_);
             return;
@@ -523,7 +278,49 @@ public:
         // tie the fd up, need nonblocking mode
         verify(set_nonblocking(clnt_, true) == 0);
         verify(set_nonblocking(remote_fd, true) == 0);
-        tie_fd(auth_info.forward_key, poll_, clnt_, remote_fd);
+        Session::start(poll_, auth_info.route, clnt_, remote_fd, source_);
+        source_ = NULL;
+    }
+};
+
+// hands clients that sent their auth response to the thread pool, for the server side
+class HandshakeDispatcher: public HandshakeListener {
+    PollMgr* poll_;
+
+    // guard thpool_, which is NULL once stopped
+    pthread_mutex_t m_;
+    ThreadPool* thpool_;
+
+public:
+    HandshakeDispatcher(PollMgr* pmgr, ThreadPool* thpool)
+            : poll_(pmgr), thpool_(thpool) {
+        Pthread_mutex_init(&m_, NULL);
+    }
+
+    ~HandshakeDispatcher() {
+        Pthread_mutex_destroy(&m_);
+    }
+
+    // called before the thread pool is deleted, handshakes still coming are dropped
+    void stop() {
+        Pthread_mutex_lock(&m_);
+        thpool_ = NULL;
+        Pthread_mutex_unlock(&m_);
+    }
+
+    void client_authenticating(int clnt_fd, SourceAccount* source, const unsigned char* challenge,
+            const unsigned char* response, i64 deadline_us) {
+        VncOperator* op = new VncOperator(poll_, clnt_fd, source, challenge, response, deadline_us);
+        Pthread_mutex_lock(&m_);
+        bool queued = thpool_ != NULL && thpool_->try_run_async(op);
+        Pthread_mutex_unlock(&m_);
+        if (!queued) {
+            // it would wait behind a full queue until the deadline anyway
+            Log::warn("handshake queue full, rejecting client connection, fd: %d", clnt_fd);
+            Handshake::count_abort(Handshake::SERVER, false);
+            delete op;
+            close(clnt_fd);
+        }
     }
 };
 
@@ -532,39 +329,203 @@ void do_stop(int sig) {
     Log::info("got signal %d, will stop", sig);
 }
 
-int collect_forward_key_callback(void* cb_args, int columns, char** values, char** column_names) {
-    set<string>* valid_forward_keys = (set<string>*) cb_args;
-    valid_forward_keys->insert(values[0]);
+void do_dump_stats(int sig) {
+    global_dump_stats_flag = true;
+}
+
+#ifdef SIGRTMIN
+void do_resize_poll(int sig) {
+    if (sig == SIGRTMIN + 1) {
+        global_poll_threads_started++;
+    } else {
+        global_poll_threads_drained++;
+    }
+}
+#endif // SIGRTMIN
+
+void dump_stats(ThreadPool* thpool, PollMgr* poll) {
+    thpool->dump_stats();
+    Handshake::dump_stats();
+    Admission::dump_stats();
+    poll->dump_stats();
+    Session::dump_stats();
+    MemoryGovernor::dump_stats();
+    SpillFile::dump_stats();
+    ZeroCopyQueue::dump_stats();
+    Marshal::dump_chunk_stats();
+    BufferArena::dump_stats();
+}
+
+// optional columns are looked up by name, so older dbs without them still load
+int collect_route_callback(void* cb_args, int columns, char** values, char** column_names) {
+    map<string, Route>* routes = (map<string, Route>*) cb_args;
+    Route route;
+    for (int i = 0; i < columns; i++) {
+        const char* name = column_names[i];
+        if (strcmp(name, "forward_key") == 0) {
+            route.forward_key = values[i];
+        } else if (strcmp(name, "dest_addr") == 0) {
+            route.dest_addr = values[i];
+        } else if (strcmp(name, "dest_passwd") == 0 && values[i] != NULL) {
+            route.has_dest_passwd = true;
+            route.dest_passwd = values[i];
+        } else if (strcmp(name, "max_duration") == 0 && values[i] != NULL) {
+            route.max_duration_s = max(atoi(values[i]), 0);
+        } else if (strcmp(name, "session_rate") == 0 && values[i] != NULL) {
+            route.session_rate = max(strtoll(values[i], NULL, 10), 0LL);
+        } else if (strcmp(name, "route_rate") == 0 && values[i] != NULL) {
+            route.route_rate = max(strtoll(values[i], NULL, 10), 0LL);
+        }
+    }
+    (*routes)[route.forward_key] = route;
     return 0;
 }
 
-void* cleanup_thread(void *) {
+int data_version_callback(void* cb_args, int columns, char** values, char** column_names) {
+    i64* data_version = (i64 *) cb_args;
+    *data_version = strtoll(values[0], NULL, 10);
+    return 0;
+}
+
+// load routing records into global_routes whenever the db is modified
+void* db_sync_thread(void *) {
+    i64 last_data_version = -1;
     while (!global_stop_flag) {
-        set<string> valid_forward_keys;
         char* errmsg = NULL;
 
-        Pthread_mutex_lock(&global_m);
-        int r = sqlite3_exec(global_db, "select forward_key from vncproxy", collect_forward_key_callback, &valid_forward_keys, &errmsg);
-        Pthread_mutex_unlock(&global_m);
+        // data_version changes when other connections commit, so we only rescan on changes
+        i64 data_version = -1;
+        int r = sqlite3_exec(global_db, "pragma data_version", data_version_callback, &data_version, &errmsg);
+        if (r == SQLITE_OK && (data_version != last_data_version || data_version < 0)) {
+            map<string, Route> routes;
+            r = sqlite3_exec(global_db, "select * from vncproxy", collect_route_callback, &routes, &errmsg);
+            if (r == SQLITE_OK) {
+                last_data_version = data_version;
+                int n_changes = global_routes->sync(routes);
+                if (n_changes > 0) {
+                    Log::info("route table updated: %d changes, %d routes, seq %lld", n_changes, (int) routes.size(),
+                            (long long) global_routes->seq());
+                }
+            }
+        }
 
         if (r != SQLITE_OK) {
             Log::error("encountered sqlite error: %s", errmsg);
             sqlite3_free(errmsg);
-        } else {
-            EndPoint::cleanup(valid_forward_keys);
         }
 
-        sleep(1);
+        usleep(100 * 1000);
     }
     pthread_exit(NULL);
     return NULL;
 }
 
+// throttle sessions when relay buffers go over budget
+void* governor_thread(void *) {
+    while (!global_stop_flag) {
+        Session::govern();
+        usleep(100 * 1000);
+    }
+    pthread_exit(NULL);
+    return NULL;
+}
+
+// parse sizes like "512k", "64m", "1g", returns -1 if malformed
+i64 parse_size(const char* str) {
+    char* end = NULL;
+    i64 size = strtoll(str, &end, 10);
+    if (end == str || size < 0) {
+        return -1;
+    }
+    if (*end == 'k' || *end == 'K') {
+        size <<= 10;
+        end++;
+    } else if (*end == 'm' || *end == 'M') {
+        size <<= 20;
+        end++;
+    } else if (*end == 'g' || *end == 'G') {
+        size <<= 30;
+        end++;
+    }
+    return *end == '\0' ? size : -1;
+}
+
 void print_help(char* argv[]) {
-    printf("usage: %s <host:port> [proxy-db='vncproxy.sqlite3']\n", argv[0]);
+    printf("usage: %s <host:port> [proxy-db='vncproxy.sqlite3'] [options]\n", argv[0]);
     printf("\n");
     printf("the proxy-db should have following schema:\n");
     printf("vncproxy(forward_key varchar(8) primary key, dest_addr text not null, dest_passwd varchar(8))\n");
+    printf("\n");
+    printf("options:\n");
+    printf("  --publish=<host:port>   publish route changes to followers on this address\n");
+    printf("  --follow=<host:port>    replicate routes from a publishing vncproxy, instead of reading proxy-db\n");
+    printf("  --publish-secret=<secret>\n");
+    printf("                          shared by the publisher and its followers, needed to publish on non-loopback\n");
+    printf("  --buffer-linger=<ms>    free drained relay buffers after this long without traffic (default %d)\n",
+            Session::buffer_linger_ms);
+    printf("  --buffer-budget=<size>  total relay buffer memory, sessions holding the most stop reading above it\n");
+    printf("  --session-buffer-cap=<size>\n");
+    printf("                          relay buffer memory of one session, before it stops reading\n");
+    printf("  --route-buffer-cap=<size>\n");
+    printf("                          relay buffer memory of all sessions of one forward_key\n");
+    printf("  --drop-after=<ms>       close the largest sessions if over budget for this long\n");
+    printf("  --sockmap[=<n>]         relay up to n sessions (default 32768) in the kernel with bpf sockmap (Linux only)\n");
+    printf("  --hugepages=<size>      take relay buffers from up to this much huge page memory\n");
+    printf("  --zerocopy=<size>       send bursts of at least this size to clients with MSG_ZEROCOPY (Linux only)\n");
+    printf("  --spill-threshold=<size>\n");
+    printf("                          spill relay buffers larger than this to disk (default 0, no spilling)\n");
+    printf("  --spill-quota=<size>    max disk space used by spill files (default %lldm)\n",
+            (long long) (SpillFile::quota >> 20));
+    printf("  --spill-dir=<dir>       where to put spill files (default %s)\n", SpillFile::dir.c_str());
+    printf("  --idle-timeout=<s>      close sessions that relayed nothing for this long (default 0, never)\n");
+    printf("  --max-duration=<s>      close sessions this long after they started, unless their route's\n");
+    printf("                          max_duration column says otherwise (default 0, never)\n");
+    printf("  --keepalive=<s>         probe peers quiet for this long with tcp keepalive, to find dead ones\n");
+    printf("  --session-rate=<size>   bytes per second sent to each client, unless its route's session_rate\n");
+    printf("                          column says otherwise (default 0, unlimited)\n");
+    printf("  --route-rate=<size>     bytes per second sent to all clients of one route together, unless its\n");
+    printf("                          route_rate column says otherwise (default 0, unlimited)\n");
+    printf("  --rate-burst=<size>     bytes a rate limited session or route may send at once (default %lldk)\n",
+            (long long) (Session::rate_burst >> 10));
+    printf("  --poll-threads=<n>      threads relaying sessions (default: one per online cpu)\n");
+    printf("  --busy-poll=<us>        poll threads spin this long for events before sleeping, for lower latency\n");
+    printf("  --no-input-first        do not relay client input ahead of screen updates on busy poll threads\n");
+    printf("  --io-budget=<size>      bytes a session relays per turn before others on its poll thread (default %dk, 0 unlimited)\n",
+            PollMgr::io_budget / 1024);
+    printf("  --pin-cpus              pin poll threads to cpus, and relay each session on the cpu of its nic queue\n");
+    printf("  --rebalance=<ms>        move busy sessions to idle poll threads, judged over this long (default %d, 0 disables)\n",
+            PollMgr::rebalance_ms);
+    printf("  --handshake-timeout=<ms>\n");
+    printf("                          close connections not done with the handshake after this long (default %d)\n",
+            Handshake::total_timeout_ms);
+    printf("  --handshake-phase-timeout=<ms>\n");
+    printf("                          ... or waiting this long for any one message of the client (default %d)\n",
+            Handshake::phase_timeout_ms);
+    printf("  --min-threads=<n>       handshake threads kept running (default 4)\n");
+    printf("  --max-threads=<n>       handshake threads started when handshakes queue up (default 64)\n");
+    printf("  --max-queue=<n>         handshakes queued for a thread, more connections are closed (default 1024)\n");
+    printf("  --max-handshakes=<n>    turn new connections away while this many wait for their client's handshake (default %d)\n",
+            Admission::max_handshakes);
+    printf("  --auth-delay=<ms>       wait this long before checking a login after a failed one from the same\n");
+    printf("                          address, twice as long after each more (default %d, 0 disables)\n",
+            Admission::auth_delay_ms);
+    printf("  --auth-max-delay=<ms>   ... but at most this long (default %d)\n", Admission::auth_max_delay_ms);
+    printf("  --ban-after=<n>         turn an address away after this many failed logins in a row (default %d, 0 never)\n",
+            Admission::ban_after);
+    printf("  --ban=<s>               ... for this long, failed logins are forgotten after it too (default %d)\n",
+            Admission::ban_s);
+    printf("  --max-conns=<n>         connections taken at once (default: what the fd limit allows)\n");
+    printf("  --max-source-conns=<n>  connections taken at once from one client address\n");
+    printf("  --conn-rate=<n>         new connections taken per second, on average\n");
+    printf("  --conn-burst=<n>        ... and at once after a quiet spell (default: the rate)\n");
+    printf("  --source-conn-rate=<n>  new connections taken per second from one client address\n");
+    printf("  --source-conn-burst=<n> ... and at once after a quiet spell (default: the rate)\n");
+    printf("                          sizes take k/m/g suffixes, a cap or budget of 0 means unlimited\n");
+    printf("\n");
+    printf("send SIGUSR1 to log session and buffer statistics\n");
+#ifdef SIGRTMIN
+    printf("send SIGRTMIN+1 to start another poll thread, SIGRTMIN+2 to drain one\n");
+#endif // SIGRTMIN
 }
 
 int main(int argc, char* argv[]) {
@@ -577,10 +538,162 @@ int main(int argc, char* argv[]) {
         }
     }
 
-    if (argc < 2) {
+    const char* bind_addr = NULL;
+    const char* db_fn = "vncproxy.sqlite3";
+    const char* publish_addr = NULL;
+    const char* follow_addr = NULL;
+    int n_positional = 0;
+    bool bad_size = false;
+    int sockmap_sessions = 0;
+    i64 arena_size = 0;
+    int min_threads = 4;
+    int max_threads = 64;
+    int max_queued = 1024;
+    int poll_threads = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--publish=", 10) == 0) {
+            publish_addr = argv[i] + 10;
+        } else if (strncmp(argv[i], "--follow=", 9) == 0) {
+            follow_addr = argv[i] + 9;
+        } else if (strncmp(argv[i], "--publish-secret=", 17) == 0) {
+            Replication::secret = argv[i] + 17;
+        } else if (strncmp(argv[i], "--buffer-linger=", 16) == 0) {
+            Session::buffer_linger_ms = atoi(argv[i] + 16);
+        } else if (strncmp(argv[i], "--buffer-budget=", 16) == 0) {
+            MemoryGovernor::budget = parse_size(argv[i] + 16);
+            bad_size = bad_size || MemoryGovernor::budget < 0;
+        } else if (strncmp(argv[i], "--session-buffer-cap=", 21) == 0) {
+            MemoryGovernor::session_cap = parse_size(argv[i] + 21);
+            bad_size = bad_size || MemoryGovernor::session_cap < 0;
+        } else if (strncmp(argv[i], "--route-buffer-cap=", 19) == 0) {
+            MemoryGovernor::route_cap = parse_size(argv[i] + 19);
+            bad_size = bad_size || MemoryGovernor::route_cap < 0;
+        } else if (strcmp(argv[i], "--sockmap") == 0) {
+            sockmap_sessions = 32768;
+        } else if (strncmp(argv[i], "--sockmap=", 10) == 0) {
+            sockmap_sessions = atoi(argv[i] + 10);
+            bad_size = bad_size || sockmap_sessions <= 0;
+        } else if (strncmp(argv[i], "--hugepages=", 12) == 0) {
+            arena_size = parse_size(argv[i] + 12);
+            bad_size = bad_size || arena_size < 0;
+        } else if (strncmp(argv[i], "--zerocopy=", 11) == 0) {
+            i64 size = parse_size(argv[i] + 11);
+            bad_size = bad_size || size < 0 || size > INT_MAX;
+            Session::zerocopy_min_size = (int) size;
+        } else if (strncmp(argv[i], "--spill-threshold=", 18) == 0) {
+            SpillFile::threshold = parse_size(argv[i] + 18);
+            bad_size = bad_size || SpillFile::threshold < 0;
+        } else if (strncmp(argv[i], "--spill-quota=", 14) == 0) {
+            SpillFile::quota = parse_size(argv[i] + 14);
+            bad_size = bad_size || SpillFile::quota < 0;
+        } else if (strncmp(argv[i], "--spill-dir=", 12) == 0) {
+            SpillFile::dir = argv[i] + 12;
+        } else if (strncmp(argv[i], "--drop-after=", 13) == 0) {
+            MemoryGovernor::drop_after_ms = atoi(argv[i] + 13);
+        } else if (strncmp(argv[i], "--idle-timeout=", 15) == 0) {
+            Session::idle_timeout_s = atoi(argv[i] + 15);
+            bad_size = bad_size || Session::idle_timeout_s < 0;
+        } else if (strncmp(argv[i], "--max-duration=", 15) == 0) {
+            Session::max_duration_s = atoi(argv[i] + 15);
+            bad_size = bad_size || Session::max_duration_s < 0;
+        } else if (strncmp(argv[i], "--keepalive=", 12) == 0) {
+            Session::keepalive_s = atoi(argv[i] + 12);
+            bad_size = bad_size || Session::keepalive_s < 0;
+        } else if (strncmp(argv[i], "--poll-threads=", 15) == 0) {
+            poll_threads = atoi(argv[i] + 15);
+            bad_size = bad_size || poll_threads <= 0;
+        } else if (strncmp(argv[i], "--busy-poll=", 12) == 0) {
+            PollMgr::busy_poll_us = atoi(argv[i] + 12);
+            bad_size = bad_size || PollMgr::busy_poll_us < 0;
+        } else if (strcmp(argv[i], "--no-input-first") == 0) {
+            Session::input_first = false;
+        } else if (strncmp(argv[i], "--io-budget=", 12) == 0) {
+            i64 budget = parse_size(argv[i] + 12);
+            bad_size = bad_size || budget < 0 || budget > INT_MAX;
+            PollMgr::io_budget = (int) budget;
+        } else if (strcmp(argv[i], "--pin-cpus") == 0) {
+            PollMgr::pin_cpus = true;
+        } else if (strncmp(argv[i], "--rebalance=", 12) == 0) {
+            PollMgr::rebalance_ms = atoi(argv[i] + 12);
+            bad_size = bad_size || PollMgr::rebalance_ms < 0;
+        } else if (strncmp(argv[i], "--handshake-timeout=", 20) == 0) {
+            Handshake::total_timeout_ms = atoi(argv[i] + 20);
+            bad_size = bad_size || Handshake::total_timeout_ms <= 0;
+        } else if (strncmp(argv[i], "--handshake-phase-timeout=", 26) == 0) {
+            Handshake::phase_timeout_ms = atoi(argv[i] + 26);
+            bad_size = bad_size || Handshake::phase_timeout_ms <= 0;
+        } else if (strncmp(argv[i], "--min-threads=", 14) == 0) {
+            min_threads = atoi(argv[i] + 14);
+        } else if (strncmp(argv[i], "--max-threads=", 14) == 0) {
+            max_threads = atoi(argv[i] + 14);
+        } else if (strncmp(argv[i], "--max-queue=", 12) == 0) {
+            max_queued = atoi(argv[i] + 12);
+            bad_size = bad_size || max_queued <= 0;
+        } else if (strncmp(argv[i], "--max-handshakes=", 17) == 0) {
+            Admission::max_handshakes = atoi(argv[i] + 17);
+            bad_size = bad_size || Admission::max_handshakes < 0;
+        } else if (strncmp(argv[i], "--session-rate=", 15) == 0) {
+            Session::session_rate = parse_size(argv[i] + 15);
+            bad_size = bad_size || Session::session_rate < 0;
+        } else if (strncmp(argv[i], "--route-rate=", 13) == 0) {
+            Session::route_rate = parse_size(argv[i] + 13);
+            bad_size = bad_size || Session::route_rate < 0;
+        } else if (strncmp(argv[i], "--rate-burst=", 13) == 0) {
+            Session::rate_burst = parse_size(argv[i] + 13);
+            bad_size = bad_size || Session::rate_burst <= 0;
+        } else if (strncmp(argv[i], "--auth-delay=", 13) == 0) {
+            Admission::auth_delay_ms = atoi(argv[i] + 13);
+            bad_size = bad_size || Admission::auth_delay_ms < 0;
+        } else if (strncmp(argv[i], "--auth-max-delay=", 17) == 0) {
+            Admission::auth_max_delay_ms = atoi(argv[i] + 17);
+            bad_size = bad_size || Admission::auth_max_delay_ms < 0;
+        } else if (strncmp(argv[i], "--ban-after=", 12) == 0) {
+            Admission::ban_after = atoi(argv[i] + 12);
+            bad_size = bad_size || Admission::ban_after < 0;
+        } else if (strncmp(argv[i], "--ban=", 6) == 0) {
+            Admission::ban_s = atoi(argv[i] + 6);
+            bad_size = bad_size || Admission::ban_s <= 0;
+        } else if (strncmp(argv[i], "--max-conns=", 12) == 0) {
+            Admission::max_conns = atoi(argv[i] + 12);
+            bad_size = bad_size || Admission::max_conns < 0;
+        } else if (strncmp(argv[i], "--max-source-conns=", 19) == 0) {
+            Admission::max_source_conns = atoi(argv[i] + 19);
+            bad_size = bad_size || Admission::max_source_conns < 0;
+        } else if (strncmp(argv[i], "--conn-rate=", 12) == 0) {
+            Admission::conn_rate = atof(argv[i] + 12);
+            bad_size = bad_size || Admission::conn_rate < 0;
+        } else if (strncmp(argv[i], "--conn-burst=", 13) == 0) {
+            Admission::conn_burst = atof(argv[i] + 13);
+            bad_size = bad_size || Admission::conn_burst < 0;
+        } else if (strncmp(argv[i], "--source-conn-rate=", 19) == 0) {
+            Admission::source_rate = atof(argv[i] + 19);
+            bad_size = bad_size || Admission::source_rate < 0;
+        } else if (strncmp(argv[i], "--source-conn-burst=", 20) == 0) {
+            Admission::source_burst = atof(argv[i] + 20);
+            bad_size = bad_size || Admission::source_burst < 0;
+        } else if (strncmp(argv[i], "--", 2) == 0) {
+            printf("unknown option: %s\n\n", argv[i]);
+            print_help(argv);
+            exit(1);
+        } else if (n_positional == 0) {
+            bind_addr = argv[i];
+            n_positional++;
+        } else if (n_positional == 1) {
+            db_fn = argv[i];
+            n_positional++;
+        }
+    }
+
+    if (min_threads < 1 || max_threads < min_threads) {
+        printf("need 1 <= --min-threads <= --max-threads\n\n");
+        bad_size = true;
+    }
+
+    if (bind_addr == NULL || bad_size) {
         print_help(argv);
         exit(1);
     }
+    Admission::init();
 
     srand(getpid());
 
@@ -589,23 +702,54 @@ int main(int argc, char* argv[]) {
 
     signal(SIGINT, do_stop);
     signal(SIGQUIT, do_stop);
+    signal(SIGUSR1, do_dump_stats);
+#ifdef SIGRTMIN
+    // not job control signals, which the tty sends to a background vncproxy
+    signal(SIGRTMIN + 1, do_resize_poll);
+    signal(SIGRTMIN + 2, do_resize_poll);
+#endif // SIGRTMIN
 
-    const char* bind_addr = argv[1];
     Log::info("bind address: %s", bind_addr);
-    char* db_fn = "vncproxy.sqlite3";
-    if (argc >= 3) {
-        db_fn = argv[2];
+
+    if (arena_size > 0) {
+        BufferArena::init(arena_size);
+        Log::info("relay buffers from huge page arena, up to %lld bytes", (long long) arena_size);
     }
-    Log::info("proxy db file: %s", db_fn);
 
-    int r = sqlite3_open(db_fn, &global_db);
-    if (r != 0) {
-        Log::fatal("cannot open db file '%s': %s", db_fn, sqlite3_errmsg(global_db));
-        sqlite3_close(global_db);
-        exit(1);
+    SessionRevoker revoker;
+    ReplicationFollower* follower = NULL;
+    if (follow_addr != NULL) {
+        // epoch will be given by the publisher
+        global_routes = new RouteTable(0);
+        global_routes->set_listener(&revoker);
+        Log::info("following routes from: %s", follow_addr);
+        follower = new ReplicationFollower(global_routes, follow_addr);
+    } else {
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        i64 epoch = ((i64) now.tv_sec * 1000 * 1000 + now.tv_usec) ^ ((i64) getpid() << 48);
+        global_routes = new RouteTable(epoch);
+        global_routes->set_listener(&revoker);
+
+        Log::info("proxy db file: %s", db_fn);
+
+        int r = sqlite3_open(db_fn, &global_db);
+        if (r != 0) {
+            Log::fatal("cannot open db file '%s': %s", db_fn, sqlite3_errmsg(global_db));
+            sqlite3_close(global_db);
+            exit(1);
+        }
+
+        verify(sqlite3_exec(global_db, "create table if not exists vncproxy(forward_key varchar(8) primary key, dest_addr text not null, dest_passwd varchar(8))", NULL, NULL, NULL) == 0);
     }
 
-    verify(sqlite3_exec(global_db, "create table if not exists vncproxy(forward_key varchar(8) primary key, dest_addr text not null, dest_passwd varchar(8))", NULL, NULL, NULL) == 0);
+    ReplicationPublisher* publisher = NULL;
+    if (publish_addr != NULL) {
+        publisher = new ReplicationPublisher(global_routes);
+        if (publisher->start(publish_addr) != 0) {
+            exit(1);
+        }
+    }
 
     struct addrinfo *result, *rp;
     int server_sock = bind_on(bind_addr, &result, &rp);
@@ -614,12 +758,31 @@ int main(int argc, char* argv[]) {
     }
     verify(set_nonblocking(server_sock, true) == 0);
 
-    PollMgr* poll = new PollMgr;
-    ThreadPool* thpool = new ThreadPool;
+    if (sockmap_sessions > 0) {
+        SockMap::init(sockmap_sessions);
+    }
+
+    if (poll_threads == 0) {
+        poll_threads = n_cpus();
+    }
+    Log::info("relaying on %d poll threads", poll_threads);
+    PollMgr* poll = new PollMgr(poll_threads);
+    ThreadPool* thpool = new ThreadPool(min_threads, max_threads, max_queued);
+    HandshakeDispatcher dispatcher(poll, thpool);
 
-    pthread_t cleanup_th;
-    Pthread_create(&cleanup_th, NULL, cleanup_thread, NULL);
+    pthread_t db_sync_th;
+    if (follower == NULL) {
+        Pthread_create(&db_sync_th, NULL, db_sync_thread, NULL);
+    }
 
+    pthread_t governor_th;
+    if (MemoryGovernor::budget > 0) {
+        Log::info("relay buffer budget: %lld bytes", (long long) MemoryGovernor::budget);
+        Pthread_create(&governor_th, NULL, governor_thread, NULL);
+    }
+
+    sig_atomic_t poll_threads_started = 0;
+    sig_atomic_t poll_threads_drained = 0;
     fd_set fds;
     while (!global_stop_flag) {
         FD_ZERO(&fds);
@@ -631,27 +794,58 @@ int main(int argc, char* argv[]) {
         int fdmax = server_sock;
 
         int n_ready = select(fdmax + 1, &fds, NULL, NULL, &tv);
-        if (n_ready == 0) {
+        if (global_dump_stats_flag) {
+            global_dump_stats_flag = false;
+            dump_stats(thpool, poll);
+        }
+        while (poll_threads_started != global_poll_threads_started) {
+            poll_threads_started++;
+            poll->add_thread();
+        }
+        while (poll_threads_drained != global_poll_threads_drained) {
+            poll_threads_drained++;
+            if (!poll->drain_thread()) {
+                Log::warn("not draining the last poll thread");
+            }
+        }
+        if (n_ready <= 0) {
             continue;
         }
         if (global_stop_flag) {
             break;
         }
 
-        int clnt_socket = accept(server_sock, rp->ai_addr, &rp->ai_addrlen);
+        sockaddr_storage clnt_addr;
+        socklen_t clnt_addr_len = sizeof(clnt_addr);
+        int clnt_socket = accept(server_sock, (sockaddr*) &clnt_addr, &clnt_addr_len);
         if (clnt_socket >= 0) {
+            const char* reason;
+            SourceAccount* source = Admission::admit((sockaddr*) &clnt_addr, thpool, &reason);
+            if (source == NULL) {
+                Admission::reject(clnt_socket, reason);
+                continue;
+            }
             Log::info("got new client connection, fd: %d", clnt_socket);
-            thpool->run_async(new VncOperator(poll, clnt_socket));
+            Handshake::start(poll, &dispatcher, clnt_socket, source);
         }
     }
 
     Log::info("doing final cleanup");
-    Pthread_join(cleanup_th, NULL);
+    if (MemoryGovernor::budget > 0) {
+        Pthread_join(governor_th, NULL);
+    }
+    if (follower == NULL) {
+        Pthread_join(db_sync_th, NULL);
+        sqlite3_close(global_db);
+    }
+    delete follower;
+    delete publisher;
 
+    dispatcher.stop();
     delete thpool;
     poll->release();
     freeaddrinfo(result);
-    sqlite3_close(global_db);
+    delete global_routes;
     Log::info("cleanup finished, quit now");
 
     return 0;